@@ -0,0 +1,206 @@
+#ifndef IMAGEATLAS_H
+#define IMAGEATLAS_H
+#include <memory>
+#include <vector>
+#include <d3d11.h>
+#include "imgui.h"
+#include "ImagePixels.h"
+
+// Our own copy of the packer, imgui_draw.cpp keeps its implementation static as well
+#ifndef STB_RECT_PACK_IMPLEMENTATION
+#define STBRP_STATIC
+#define STBRP_ASSERT(x)     do { IM_ASSERT(x); } while (0)
+#define STB_RECT_PACK_IMPLEMENTATION
+#endif
+#include "imstb_rectpack.h"
+//#########################################################
+//################ IMAGE ATLAS ############################
+//#########################################################
+
+/// <summary>
+/// Where an image was packed in the atlas
+/// </summary>
+struct AtlasRegion {
+    int page = -1;
+    ImVec2 uvMin = ImVec2(0, 0);
+    ImVec2 uvMax = ImVec2(1, 1);
+};
+
+/// <summary>
+/// Packs the small images into a few large textures, the way ImFontAtlas does with the glyphs, so the images drawn one
+/// after the other use the same texture and imgui batches them into a single draw command
+/// </summary>
+class ImageAtlas {
+public:
+    static constexpr int PAGE_SIZE = 1024;
+    static constexpr size_t MAX_IMAGE_SIZE = 256; // larger images get their own texture
+    static constexpr int MIP_LEVELS = 4; // the smallest level is 1/8 of the page
+    static constexpr int ALIGNMENT = 1 << (MIP_LEVELS - 1); // the images start and end on whole pixels of every level
+    static constexpr int PADDING = ALIGNMENT; // the edges of each image are repeated around it so filtering doesnt bleed, even on the last level
+
+    /// <summary>
+    /// Whether an image is small enough to be packed
+    /// </summary>
+    static bool CanPack(const ImagePixels& pixels)
+    {
+        return pixels.width > 0 && pixels.height > 0 && pixels.width <= MAX_IMAGE_SIZE && pixels.height <= MAX_IMAGE_SIZE;
+    }
+
+    /// <summary>
+    /// Packs an image in the first page with room for it, creating a page if none has
+    /// </summary>
+    /// <param name="region">Page and uvs of the image in it</param>
+    /// <returns>Whether the image was packed</returns>
+    bool Pack(ID3D11Device* device, ID3D11DeviceContext* context, const ImagePixels& pixels, AtlasRegion& region)
+    {
+        stbrp_rect rect = {};
+        // every size is a multiple of the alignment so the packer only places the images on aligned positions
+        rect.w = static_cast<stbrp_coord>(AlignUp(pixels.width + PADDING * 2));
+        rect.h = static_cast<stbrp_coord>(AlignUp(pixels.height + PADDING * 2));
+
+        int page = 0;
+        for (; page < (int)pages.size(); page++)
+        {
+            if (stbrp_pack_rects(&pages[page]->packer, &rect, 1) && rect.was_packed)
+                break;
+        }
+        if (page == (int)pages.size())
+        {
+            if (!AddPage(device) || !stbrp_pack_rects(&pages[page]->packer, &rect, 1) || !rect.was_packed)
+                return false;
+        }
+
+        ImagePixels padded = AddPadding(pixels, rect.w, rect.h);
+        std::vector<ImagePixels> mips = padded.BuildMips(MIP_LEVELS);
+        for (UINT level = 0; level <= mips.size(); level++)
+        {
+            const ImagePixels& levelPixels = level == 0 ? padded : mips[level - 1];
+            D3D11_BOX box = {};
+            box.left = rect.x >> level;
+            box.top = rect.y >> level;
+            box.right = box.left + (UINT)levelPixels.width;
+            box.bottom = box.top + (UINT)levelPixels.height;
+            box.front = 0;
+            box.back = 1;
+            context->UpdateSubresource(pages[page]->texture, level, &box, levelPixels.data.data(), (UINT)(levelPixels.width * ImagePixels::BYTES_PER_PIXEL), 0);
+        }
+        pages[page]->regions++;
+
+        region.page = page;
+        region.uvMin = ImVec2((float)(rect.x + PADDING) / PAGE_SIZE, (float)(rect.y + PADDING) / PAGE_SIZE);
+        region.uvMax = ImVec2((float)(rect.x + PADDING + pixels.width) / PAGE_SIZE, (float)(rect.y + PADDING + pixels.height) / PAGE_SIZE);
+        return true;
+    }
+
+    /// <summary>
+    /// Frees the region of an image. The packer cant reuse single regions, so a page is packed again from scratch once
+    /// all of its images are gone.
+    /// </summary>
+    void Release(const AtlasRegion& region)
+    {
+        if (region.page < 0 || region.page >= (int)pages.size())
+            return;
+        Page& page = *pages[region.page];
+        if (page.regions > 0 && --page.regions == 0)
+            stbrp_init_target(&page.packer, PAGE_SIZE, PAGE_SIZE, page.nodes.data(), (int)page.nodes.size());
+    }
+
+    ID3D11ShaderResourceView* GetPageView(int page) const
+    {
+        return pages[page]->srv;
+    }
+
+    size_t GetPageCount() const
+    {
+        return pages.size();
+    }
+
+    void Shutdown()
+    {
+        pages.clear();
+    }
+
+private:
+    struct Page {
+        ID3D11Texture2D* texture = nullptr;
+        ID3D11ShaderResourceView* srv = nullptr;
+        stbrp_context packer; // points into nodes and to itself, so pages never move
+        std::vector<stbrp_node> nodes;
+        unsigned regions = 0; // images packed in the page
+
+        ~Page()
+        {
+            if (srv) srv->Release();
+            if (texture) texture->Release();
+        }
+    };
+
+    bool AddPage(ID3D11Device* device)
+    {
+        auto page = std::make_unique<Page>();
+
+        D3D11_TEXTURE2D_DESC desc = {};
+        desc.Width = PAGE_SIZE;
+        desc.Height = PAGE_SIZE;
+        desc.MipLevels = MIP_LEVELS;
+        desc.ArraySize = 1;
+        desc.Format = ImagePixels::FORMAT;
+        desc.SampleDesc.Count = 1;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+        if (FAILED(device->CreateTexture2D(&desc, nullptr, &page->texture)))
+        {
+            std::cout << "[ERROR] | " << __FUNCTION__ << " | Failed to create an atlas page" << std::endl;
+            return false;
+        }
+
+        D3D11_SHADER_RESOURCE_VIEW_DESC viewDesc = {};
+        viewDesc.Format = desc.Format;
+        viewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+        viewDesc.Texture2D.MipLevels = MIP_LEVELS;
+        viewDesc.Texture2D.MostDetailedMip = 0;
+        if (FAILED(device->CreateShaderResourceView(page->texture, &viewDesc, &page->srv)))
+        {
+            std::cout << "[ERROR] | " << __FUNCTION__ << " | Failed to create the view of an atlas page" << std::endl;
+            return false;
+        }
+
+        page->nodes.resize(PAGE_SIZE);
+        stbrp_init_target(&page->packer, PAGE_SIZE, PAGE_SIZE, page->nodes.data(), (int)page->nodes.size());
+        pages.push_back(std::move(page));
+        return true;
+    }
+
+    static size_t AlignUp(size_t size)
+    {
+        return (size + ALIGNMENT - 1) & ~static_cast<size_t>(ALIGNMENT - 1);
+    }
+
+    /// <summary>
+    /// Copies the pixels at PADDING from the top left of a larger image, with their edges repeated all around them
+    /// </summary>
+    static ImagePixels AddPadding(const ImagePixels& pixels, size_t paddedWidth, size_t paddedHeight)
+    {
+        const size_t bpp = ImagePixels::BYTES_PER_PIXEL;
+        ImagePixels padded;
+        padded.width = paddedWidth;
+        padded.height = paddedHeight;
+        padded.data.resize(paddedWidth * paddedHeight * bpp);
+        for (size_t y = 0; y < paddedHeight; y++)
+        {
+            size_t sourceY = y < PADDING ? 0 : (y - PADDING >= pixels.height ? pixels.height - 1 : y - PADDING);
+            const uint8_t* sourceRow = pixels.data.data() + sourceY * pixels.width * bpp;
+            uint8_t* row = padded.data.data() + y * paddedWidth * bpp;
+            for (size_t x = 0; x < PADDING; x++)
+                memcpy(row + x * bpp, sourceRow, bpp);
+            memcpy(row + PADDING * bpp, sourceRow, pixels.width * bpp);
+            for (size_t x = PADDING + pixels.width; x < paddedWidth; x++)
+                memcpy(row + x * bpp, sourceRow + (pixels.width - 1) * bpp, bpp);
+        }
+        return padded;
+    }
+
+    std::vector<std::unique_ptr<Page>> pages;
+};
+
+#endif // !IMAGEATLAS_H
@@ -6,6 +6,7 @@
 #include "imgui_internal.h"
 #include <DirectXTex.h>
 #include "RenderManager.h"
+#include "ImageLoader.h"
 #include <wincodec.h>
 #include "imgui.h"
 
@@ -47,9 +48,15 @@ namespace Rotation {
 
 /// <summary>
 /// A class to represent DirectX images
+/// <remarks>
+/// The textures come from the TextureCache, images of the same file share theirs and release it when destroyed
+/// </remarks>
 /// </summary>
 class ImGuiImage {
 public:
+    // size drawn by an image loaded in the background until its size is known
+    static constexpr float PLACEHOLDER_SIZE = 32.0f;
+
     /// <summary>
     /// Empty constructor , this doesnt initialize anything.
     /// </summary>
@@ -60,80 +67,71 @@ public:
 
     }
     /// <summary>
-    /// Returns an image from the path
+    /// Returns an image from the path, decoded and uploaded right away unless the cache already has it
+    /// <remarks>
+    /// The file is decoded once into raw RGBA pixels which are uploaded with their mips, the pixels are kept for Bake
+    /// </remarks>
     /// </summary>
-    /// <param name="path">Path of the image file (it must be a png file)</param>
+    /// <param name="path">Path of the image file (any format WIC can decode)</param>
     ImGuiImage(const wchar_t* path)
     {
-        this->rotation = 0;
-        ID3D11Device* g_pd3dDevice = RenderManager::GetInstance()->GetDevice();
-        // misname in the commit lmao
-        if (fs::exists(path))
-        {
-            original_path = path;
+        original_path = path;
+        original = TextureCache::GetInstance()->Load(path);
+        texture = original;
+    }
 
-            DirectX::ScratchImage tempImage; // the temp image to store from the file
-            DirectX::TexMetadata tempMetadata;
-            if (LoadFromFile(path, tempImage))
-            {
-                HRESULT hr;
-                std::vector<uint8_t> tempBytes;
-                if (ImageToBytes(tempBytes, tempImage))
-                {
-                    bytes = std::make_unique<std::vector<uint8_t>>(tempBytes);
-                    image_info.height = tempImage.GetMetadata().height;
-                    image_info.width = tempImage.GetMetadata().width;
-                    image_info.imageSize = tempImage.GetMetadata().arraySize;
-                    std::cout << "Bytes set successfully" << std::endl;
-
-                    // we could use the tempImage that we made , but i did this to make sure that the bytes we set are correct
-
-                    if (!bytes->empty()) // we perform check , cuz something bad could happen idk
-                    {
-                        // we do everything again to make sure it's correct
-                        DirectX::ScratchImage anotherImage;
-                        if (BytesToImage(*bytes, anotherImage))
-                        {
-                            ID3D11ShaderResourceView* srv;
-                            hr = DirectX::CreateShaderResourceView(g_pd3dDevice, anotherImage.GetImages(), anotherImage.GetImageCount(), anotherImage.GetMetadata(), &srv);
-                            if (SUCCEEDED(hr))
-                            {
-                                this->m_ImageID = (ImTextureID)srv;
-                                std::cout << "Finished" << std::endl;
-                            }
-                            else {
-                                std::cout << "Failed to create the shader resource view" << std::endl;
-                            }
-                        }
-                        else {
-                            std::cout << "Failed to load memory from the bytes , perhaps they are empty ?" << std::endl;
-                        }
-                    }
-                    else {
-                        std::cout << "Bytes are empty , this is a fatal error" << std::endl;
-                    }
-                }
-                else {
-                    std::cout << "ImageToBytes failed" << std::endl;
-                }
-            }
-            else {
-                std::cout << "Loading image from system failed , please check your path" << std::endl;
-            }
-        }
-        else {
-            std::cout << "Image doesnt exist , make sure the path is correct" << std::endl;
-        }
+    /// <summary>
+    /// Returns an image from the path, decoded by the ImageLoader threads and uploaded by a later frame unless the
+    /// cache already has it
+    /// <remarks>
+    /// The image draws a placeholder until then, baking it before that is applied once it's loaded
+    /// </remarks>
+    /// </summary>
+    /// <param name="path">Path of the image file (any format WIC can decode)</param>
+    static ImGuiImage LoadAsync(const wchar_t* path)
+    {
+        TextureHandle cached = TextureCache::GetInstance()->FindFile(path);
+        if (cached)
+            return ImGuiImage(std::move(cached), path);
+        return ImGuiImage(ImageLoader::GetInstance()->Load(path), path);
+    }
 
+    /// <summary>
+    /// Whether the image has its texture, false while it's loaded in the background or if loading it failed
+    /// </summary>
+    bool IsLoaded()
+    {
+        TakePending();
+        return texture.IsValid();
     }
 
     /// <summary>
     /// Get the texture id of the image
     /// </summary>
-    /// <returns>ImTextureID of the image</returns>
+    /// <returns>ImTextureID of the image, the placeholder while it's loaded in the background</returns>
     ImTextureID GetTextureID()
     {
-        return this->m_ImageID;
+        TakePending();
+        if (!texture && pending)
+            return ImageLoader::GetInstance()->GetPlaceholder();
+        return texture.GetTextureID();
+    }
+
+    /// <summary>
+    /// Get the uvs of the image in its texture, the small images share a page of the atlas
+    /// </summary>
+    /// <returns>The top left uv of the image</returns>
+    ImVec2 GetUV0()
+    {
+        TakePending();
+        return texture.GetUV0();
+    }
+
+    /// <returns>The bottom right uv of the image</returns>
+    ImVec2 GetUV1()
+    {
+        TakePending();
+        return texture.GetUV1();
     }
 
     /// <summary>
@@ -144,14 +142,21 @@ public:
     /// </returns>
     ImVec2 GetSize()
     {
-        return ImVec2(image_info.width, image_info.height);
+        TakePending();
+        if (display_size.x > 0 && display_size.y > 0)
+            return display_size;
+        if (!texture && pending)
+            return bake_size.x > 0 ? bake_size : ImVec2(PLACEHOLDER_SIZE, PLACEHOLDER_SIZE);
+        return texture.GetSize();
     }
 
 
     /// <summary>
     /// Resize the image on the fly. 
     /// <remarks>
-    /// NOTE : This doesnt modify the original image file, all changes happens in the memory and during run time only
+    /// NOTE : This doesnt modify the original image file, all changes happens in the memory and during run time only.
+    /// Only the size the image is drawn at changes, the gpu picks the mips of the texture that fit it so this costs
+    /// nothing. Use Bake for a texture of that size.
     /// </remarks>
     /// </summary>
     /// <param name="newHeight">Desired Height</param>
@@ -159,92 +164,40 @@ public:
     /// <returns></returns>
     bool Resize(float newHeight, float newWidth)
     {
+        TakePending();
         // make sure we're loaded
-        if (!bytes->empty() && m_ImageID != NULL)
+        if (!texture && !pending)
         {
-            if (newHeight == image_info.height && newWidth == image_info.width)
-            {
-                std::cout << "[WARNING] | " << __FUNCTION__ << " | image wasnt resized because it has the same dimensions" << std::endl;
-                return true; // no need to resize if same size
-            }
-            HRESULT hr;
-            DirectX::ScratchImage tempImage;
-            ID3D11Device* g_pd3dDevice = RenderManager::GetInstance()->GetDevice();
-            if (BytesToImage(*bytes, tempImage))
-            {
-                DirectX::ScratchImage newImage;
-                DirectX::TexMetadata newMetadata;
-                hr = DirectX::Resize(
-                    tempImage.GetImages(),
-                    tempImage.GetImageCount(),
-                    tempImage.GetMetadata(),
-                    newWidth,
-                    newHeight,
-                    DirectX::TEX_FILTER_DEFAULT,
-                    newImage
-                );
-                if (SUCCEEDED(hr))
-                {
-                    DirectX::Blob data;
-                    hr = DirectX::SaveToWICMemory(
-                        newImage.GetImages(),
-                        newImage.GetImageCount(),
-                        DirectX::WIC_FLAGS_NONE,
-                        GUID_ContainerFormatPng,
-                        data
-                    );
-                    if (SUCCEEDED(hr))
-                    {
-                        std::vector<uint8_t> tempBytes;
-                        if (BlobToBytes(data, tempBytes))
-                        {
-                            bytes = std::make_unique<std::vector<uint8_t>>(tempBytes);
-
-                            image_info.height = newImage.GetMetadata().height;
-                            image_info.width = newImage.GetMetadata().width;
-                            image_info.imageSize = newImage.GetMetadata().arraySize;
-
-                            std::cout << "Bytes set successfully" << std::endl;
-                            ID3D11ShaderResourceView* srv;
-                            hr = DirectX::CreateShaderResourceView(g_pd3dDevice, newImage.GetImages(), newImage.GetImageCount(), newImage.GetMetadata(), &srv);
-                            if (SUCCEEDED(hr))
-                            {
-                                this->m_ImageID = (ImTextureID)srv;
-                                std::cout << "Finished" << std::endl;
-                                return true;
-                            }
-                            else {
-                                std::cout << "Failed to create the shader resource view" << std::endl;
-                                return false;
-                            }
-                        }
-                        else {
-                            std::cout << "Failed to convert Blob to bytes" << std::endl;
-                            return false;
-                        }
-
-
-                    }
-                    else {
-                        std::cout << "[ERROR] | " << __FUNCTION__ << " | Failed to write bytes into our own image" << std::endl;
-                        return false;
-                    }
-                }
-                else {
-                    std::cout << "[ERROR] | " << __FUNCTION__ << " | Failed to resize the image " << std::endl;
-                    return false;
-                }
-            }
-            else {
-                std::cout << "[ERROR] | " << __FUNCTION__ << " | Failed to load image from bytes" << std::endl;
-                return false;
-            }
-        }
-
-        else {
             std::cout << "[ERROR] You're trying to resize an uninitialized image (maybe try using .Reset()) " << std::endl;
             return false;
         }
+        display_size = ImVec2(newWidth, newHeight);
+        return true;
+    }
+
+    /// <summary>
+    /// Makes a resized copy of the texture, from the pixels of the file without decoding anything
+    /// <remarks>
+    /// The images baked to the same size and quality share the copy. Worth it over Resize for images drawn small that
+    /// need a sharper filter than the mips, or a point filter for pixel art.
+    /// </remarks>
+    /// </summary>
+    /// <param name="newHeight">Desired Height</param>
+    /// <param name="newWidth">Desired Width</param>
+    /// <param name="quality">Filter of the copy</param>
+    /// <returns>Whether the copy was made, or will be once the image is loaded</returns>
+    bool Bake(float newHeight, float newWidth, ResizeQuality quality = ResizeQuality::Box)
+    {
+        TakePending();
+        display_size = ImVec2(0, 0);
+        if (!texture && pending)
+        {
+            // applied when the loader is done with it
+            bake_size = ImVec2(newWidth, newHeight);
+            bake_quality = quality;
+            return true;
+        }
+        return BakeTexture(newHeight, newWidth, quality);
     }
 
     /// <summary>
@@ -252,8 +205,17 @@ public:
     /// </summary>
     void Reset()
     {
-        //new object (= original cuz we only dealin with bytes so no changes to original file
-        ImGuiImage tempImage(original_path);
+        display_size = ImVec2(0, 0);
+        bake_size = ImVec2(0, 0);
+        if (original || pending)
+        {
+            // the texture of the file is still there (or on its way), nothing to load
+            texture = original;
+            return;
+        }
+
+        //new object (= original cuz edits only live in memory so no changes to original file
+        ImGuiImage tempImage(original_path.c_str());
 
         //swap members , cuz you cant assign the current objects
         Swap(tempImage);
@@ -264,22 +226,38 @@ public:
     /// </summary>
     void Draw()
     {
+        TakePending();
+        if (!texture && pending)
+        {
+            // keeps the layout of the window while the image is loaded
+            ImGui::Image(GetTextureID(), GetSize());
+            return;
+        }
+
         // perform checks cuz u shouldnt be drawin an image with no data lol
-        if (!bytes->empty() && m_ImageID != NULL)
+        if (texture)
         {
             if (this->rotation == 0) // skip
             {
-                ImGui::Image(GetTextureID(), GetSize());
+                ImGui::Image(GetTextureID(), GetSize(), GetUV0(), GetUV1());
             }
             else {
                 Rotation::ImRotateStart();
-                ImGui::Image(GetTextureID(), GetSize());
+                ImGui::Image(GetTextureID(), GetSize(), GetUV0(), GetUV1());
                 Rotation::ImRotateEnd(DegreesToRadians(this->rotation));
 
             }
         }
     }
 
+    /// <summary>
+    /// Adds the image to a draw list, with its uvs
+    /// </summary>
+    void AddToDrawList(ImDrawList* drawList, const ImVec2& pMin, const ImVec2& pMax)
+    {
+        drawList->AddImage(GetTextureID(), pMin, pMax, GetUV0(), GetUV1());
+    }
+
     /// <summary>
     /// A simple function to get/set the rotation of the image
     /// </summary>
@@ -290,133 +268,105 @@ public:
     }
 
 private:
-    /// <summary>
-    /// <value>ImGui Texture ID of the image</value>
-    /// </summary>
-    ImTextureID m_ImageID;
-    std::unique_ptr<std::vector<uint8_t>> bytes; // image bytes
+    TextureHandle original; // texture of the file, with its pixels
+    TextureHandle texture; // texture drawn, the original one or a baked copy of it
+    ImVec2 display_size = ImVec2(0, 0); // size the texture is drawn at, 0 for its own
 
-    const wchar_t* original_path; // keep this in case , i might write a reset function that will revert it to it's old state maybe
-    // perhaps i should consider storing everything as new bytes but i'm not sure yet
-    // or maybe not saving edits but idk yet
-    struct {
-        float width;
-        float height;
-        size_t imageSize;
-    } image_info;
+    std::shared_ptr<PendingImage> pending; // set while the image is loaded in the background
+    ImVec2 bake_size = ImVec2(0, 0); // size it gets baked to once loaded, 0 to keep its own
+    ResizeQuality bake_quality = ResizeQuality::Box;
 
-    float rotation; // newly added after ms devs ghosted me in DirectXTex github page
+    std::wstring original_path; // keep this in case , i might write a reset function that will revert it to it's old state maybe
+
+    float rotation = 0; // newly added after ms devs ghosted me in DirectXTex github page
 
 
 
     // internal functions to make my life easier
 private:
 
+    ImGuiImage(std::shared_ptr<PendingImage> loading, const wchar_t* path)
+        : pending(std::move(loading)), original_path(path)
+    {
+    }
+
+    ImGuiImage(TextureHandle cached, const wchar_t* path)
+        : original(cached), texture(std::move(cached)), original_path(path)
+    {
+    }
+
     float DegreesToRadians(float degrees) {
         return degrees * (DirectX::XM_PI / 180);
     }
 
     void Swap(ImGuiImage& other)
     {
-        std::swap(m_ImageID, other.m_ImageID);
-        std::swap(bytes, other.bytes);
-        std::swap(image_info, other.image_info);
+        std::swap(original, other.original);
+        std::swap(texture, other.texture);
+        std::swap(display_size, other.display_size);
+        std::swap(pending, other.pending);
+        std::swap(bake_size, other.bake_size);
+        std::swap(bake_quality, other.bake_quality);
+        std::swap(original_path, other.original_path);
     }
 
-    bool BlobToBytes(DirectX::Blob& blob, std::vector<uint8_t>& bytes) const
+    bool BakeTexture(float newHeight, float newWidth, ResizeQuality quality)
     {
-        if (blob.GetBufferPointer() != nullptr || blob.GetBufferSize() > 0)
+        if (!original)
         {
-            const uint8_t* dataPtr = static_cast<const uint8_t*>(blob.GetBufferPointer());
-            size_t dataSize = blob.GetBufferSize();
-            std::vector<uint8_t> imageBytes(dataPtr, dataPtr + dataSize);
-            bytes = std::move(imageBytes);
-            return true;
+            std::cout << "[ERROR] You're trying to resize an uninitialized image (maybe try using .Reset()) " << std::endl;
+            return false;
         }
-        return false;
-
-
-    }
-
-    bool ImageToBytes(std::vector<uint8_t>& bytelist, DirectX::ScratchImage& image) const
-    {
-        HRESULT hr;
-        DirectX::Blob data;
-        hr = DirectX::SaveToWICMemory(image.GetImages(), image.GetImageCount(), DirectX::WIC_FLAGS_NONE, GUID_ContainerFormatPng, data);
-        if (SUCCEEDED(hr))
+        if (newHeight == original.GetSize().y && newWidth == original.GetSize().x)
         {
-            if (BlobToBytes(data, bytelist))
-            {
-                return true;
-            }
-            else {
-                std::cout << "Blob was empty" << std::endl;
-                return false;
-            }
-        }
-        else {
-            std::cout << "Failed to parse image bytes" << std::endl;
-            return false;
+            texture = original;
+            return true;
         }
-    }
 
-    bool BytesToImage(std::vector<uint8_t> bytes, DirectX::ScratchImage& image) const
-    {
-        if (!bytes.empty())
+        TextureCache* cache = TextureCache::GetInstance();
+        TextureKey key = original.GetKey();
+        key.width = static_cast<size_t>(newWidth);
+        key.height = static_cast<size_t>(newHeight);
+        key.quality = quality;
+        TextureHandle baked = cache->Find(key);
+        if (!baked)
         {
-            HRESULT hr;
-            DirectX::ScratchImage tempImage;
-            DirectX::TexMetadata tempMeta;
-            hr = DirectX::LoadFromWICMemory(
-                bytes.data(),
-                bytes.size(),
-                DirectX::WIC_FLAGS_NONE,
-                &tempMeta,
-                tempImage
-            );
-            if (SUCCEEDED(hr))
-            {
-                image = std::move(tempImage);
-                return true;
-            }
-            else {
-                std::cout << "Failed to parse image bytes" << std::endl;
+            ImagePixels newPixels;
+            if (!original.GetPixels().Resize(key.width, key.height, quality, newPixels))
+                return false;
+            baked = cache->Insert(key, std::move(newPixels), false);
+            if (!baked)
                 return false;
-            }
-        }
-        else {
-            std::cout << "[ERROR] " << __FUNCTION__ << " Can't get an image from empty bytes" << std::endl;
-            return false;
         }
-
+        texture = std::move(baked);
+        return true;
     }
 
-    bool LoadFromFile(const wchar_t* path, DirectX::ScratchImage& image)
+    /// <summary>
+    /// Takes the texture of the image once the loader uploaded it
+    /// </summary>
+    void TakePending()
     {
-        if (fs::exists(path))
+        if (!pending)
+            return;
+
+        PendingImage::Status status = pending->status.load(std::memory_order_acquire);
+        if (status == PendingImage::Status::Ready)
         {
-            HRESULT hr;
-            DirectX::ScratchImage tempImage; // the temp image to store from the file
-            DirectX::TexMetadata tempMetadata;
+            original = pending->texture;
+            texture = original;
+            pending.reset();
 
-            // loading the image from the file
-            hr = DirectX::LoadFromWICFile(path, DirectX::WIC_FLAGS_NONE, &tempMetadata, tempImage);
-            if (SUCCEEDED(hr))
-            {
-                image = std::move(tempImage);
-                return true;
-            }
-            else {
-                std::cout << "Loading image from system failed , please check your path" << std::endl;
-                return false;
-            }
+            if (bake_size.x > 0 && bake_size.y > 0)
+                BakeTexture(bake_size.y, bake_size.x, bake_quality);
+            bake_size = ImVec2(0, 0);
         }
-        else {
-            std::cout << "Image doesnt exist , make sure the path is correct" << std::endl;
-            return false;
+        else if (status == PendingImage::Status::Failed)
+        {
+            std::cout << "[ERROR] | " << __FUNCTION__ << " | Failed to load the image in the background" << std::endl;
+            pending.reset();
         }
     }
 };
 
 #endif // !TESTCLASS_H
-
@@ -0,0 +1,264 @@
+#ifndef IMAGELOADER_H
+#define IMAGELOADER_H
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <d3d11.h>
+#include <objbase.h>
+#include <DirectXTex.h>
+#include <unordered_map>
+#include "imgui.h"
+#include "Profiler.h"
+#include "TextureCache.h"
+//#########################################################
+//################ IMAGE LOADER ###########################
+//#########################################################
+
+/// <summary>
+/// An image being loaded in the background, shared by the image waiting for it and the loader
+/// </summary>
+struct PendingImage {
+    enum class Status { Queued, Decoded, Ready, Failed };
+
+    std::wstring path;
+    uint64_t contentHash = 0;
+    ImagePixels pixels;
+    std::vector<ImagePixels> mips; // built by the worker too, unless the image goes to the atlas
+    size_t uploadBytes = 0; // of the pixels and their mips
+    TextureHandle texture; // set by the render thread once uploaded
+    std::atomic<Status> status = Status::Queued;
+};
+
+/// <summary>
+/// Decodes the images and builds their mips on worker threads and uploads them on the render thread, a few per frame, so loading them never
+/// stalls a frame for long. The images draw a placeholder until they are uploaded.
+/// </summary>
+class ImageLoader {
+public:
+    // bytes of pixels uploaded per frame, at least one image is uploaded each frame whatever its size
+    static constexpr size_t UPLOAD_BUDGET_BYTES = 4 * 1024 * 1024;
+    static constexpr unsigned MAX_WORKERS = 4;
+
+    static ImageLoader* instance;
+    static ImageLoader* GetInstance()
+    {
+        if (!instance)
+            instance = new ImageLoader();
+        return instance;
+    }
+
+    /// <summary>
+    /// Queues an image to be decoded by the workers, starting them the first time. Called by the render thread.
+    /// </summary>
+    /// <param name="path">Path of the image file</param>
+    /// <returns>The image being loaded, ready once its status is Ready, shared by the loads of the same path</returns>
+    std::shared_ptr<PendingImage> Load(const wchar_t* path)
+    {
+        std::weak_ptr<PendingImage>& loading = in_flight[TextureCache::NormalizePath(path)];
+        std::shared_ptr<PendingImage> sameFile = loading.lock();
+        if (sameFile && sameFile->status.load(std::memory_order_acquire) != PendingImage::Status::Failed)
+            return sameFile;
+
+        auto image = std::make_shared<PendingImage>();
+        image->path = path;
+        loading = image;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            if (workers.empty())
+                StartWorkers();
+            queue.push_back(image);
+        }
+        queue_signal.notify_one();
+        return image;
+    }
+
+    /// <summary>
+    /// Uploads the images decoded since the last frame, within the upload budget. Called by the render thread once per frame.
+    /// </summary>
+    void Update(ID3D11Device* device)
+    {
+        SCOPED_PROFILER("ImageLoader::Update");
+        if (!placeholder)
+            CreatePlaceholder(device);
+
+        // oldest first, the workers push on top
+        CompletedNode* reversed = nullptr;
+        for (CompletedNode* node = completed.exchange(nullptr, std::memory_order_acquire); node;)
+        {
+            CompletedNode* next = node->next;
+            node->next = reversed;
+            reversed = node;
+            node = next;
+        }
+        for (CompletedNode* node = reversed; node;)
+        {
+            CompletedNode* next = node->next;
+            uploads.push_back(std::move(node->image));
+            delete node;
+            node = next;
+        }
+
+        TextureCache* cache = TextureCache::GetInstance();
+        size_t uploadedBytes = 0;
+        while (!uploads.empty() && (uploadedBytes == 0 || uploadedBytes + uploads.front()->uploadBytes <= UPLOAD_BUDGET_BYTES))
+        {
+            std::shared_ptr<PendingImage> image = std::move(uploads.front());
+            uploads.pop_front();
+            // a reload of the same path may have replaced it meanwhile
+            auto loading = in_flight.find(TextureCache::NormalizePath(image->path.c_str()));
+            if (loading != in_flight.end() && loading->second.lock() == image)
+                in_flight.erase(loading);
+
+            // nobody waits for it anymore
+            if (image.use_count() == 1)
+                continue;
+
+            // another path with the same content may already be in the cache, Insert then only remembers this path for it
+            TextureKey key;
+            key.contentHash = image->contentHash;
+            if (!cache->Find(key))
+                uploadedBytes += image->uploadBytes;
+            image->texture = cache->Insert(key, std::move(image->pixels), true, image->path.c_str(), std::move(image->mips));
+            image->pixels = ImagePixels();
+            image->mips.clear();
+            image->status.store(image->texture ? PendingImage::Status::Ready : PendingImage::Status::Failed, std::memory_order_release);
+        }
+        PROF_GAUGE("Images waiting for upload", uploads.size());
+        PROF_GAUGE("Texture cache bytes", cache->GetUsedBytes());
+    }
+
+    /// <summary>
+    /// Texture drawn by the images that arent loaded yet
+    /// </summary>
+    ImTextureID GetPlaceholder()
+    {
+        return (ImTextureID)placeholder;
+    }
+
+    /// <summary>
+    /// Stops the workers and releases what wasnt uploaded. Called before the device is released.
+    /// </summary>
+    void Shutdown()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stopping = true;
+            queue.clear();
+        }
+        queue_signal.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+        workers.clear();
+
+        for (CompletedNode* node = completed.exchange(nullptr, std::memory_order_acquire); node;)
+        {
+            CompletedNode* next = node->next;
+            delete node;
+            node = next;
+        }
+        uploads.clear();
+        in_flight.clear();
+        if (placeholder) { placeholder->Release(); placeholder = nullptr; }
+    }
+
+private:
+    /// <summary>
+    /// Entry of the completion queue, a lock free stack the workers push the decoded images on
+    /// </summary>
+    struct CompletedNode {
+        std::shared_ptr<PendingImage> image;
+        CompletedNode* next;
+    };
+
+    void StartWorkers()
+    {
+        unsigned hardwareThreads = std::thread::hardware_concurrency();
+        unsigned count = hardwareThreads > 2 ? hardwareThreads - 1 : 1; // leave a core to the render thread
+        if (count > MAX_WORKERS)
+            count = MAX_WORKERS;
+        for (unsigned i = 0; i < count; i++)
+            workers.emplace_back(&ImageLoader::WorkerLoop, this);
+    }
+
+    void WorkerLoop()
+    {
+        PROF_THREAD_NAME("Image loader");
+        // WIC is a COM api, every thread using it needs COM
+        HRESULT comResult = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+
+        while (true)
+        {
+            std::shared_ptr<PendingImage> image;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_signal.wait(lock, [this]() { return stopping || !queue.empty(); });
+                if (stopping)
+                    break;
+                image = std::move(queue.front());
+                queue.pop_front();
+            }
+
+            SCOPED_PROFILER("Decode image");
+            std::vector<uint8_t> bytes;
+            bool decoded = TextureCache::ReadFile(image->path.c_str(), bytes);
+            if (decoded)
+            {
+                image->contentHash = TextureCache::HashBytes(bytes);
+                decoded = image->pixels.Decode(bytes);
+            }
+            if (!decoded)
+            {
+                image->status.store(PendingImage::Status::Failed, std::memory_order_release);
+                continue;
+            }
+            image->uploadBytes = image->pixels.data.size();
+            if (!ImageAtlas::CanPack(image->pixels))
+            {
+                SCOPED_PROFILER("Build mips");
+                image->mips = image->pixels.BuildMips();
+                for (const ImagePixels& mip : image->mips)
+                    image->uploadBytes += mip.data.size();
+            }
+            image->status.store(PendingImage::Status::Decoded, std::memory_order_relaxed);
+
+            CompletedNode* node = new CompletedNode{ std::move(image), completed.load(std::memory_order_relaxed) };
+            while (!completed.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+                ;
+        }
+
+        if (SUCCEEDED(comResult))
+            CoUninitialize();
+    }
+
+    void CreatePlaceholder(ID3D11Device* device)
+    {
+        // a single translucent grey pixel, stretched over the size of the image
+        ImagePixels pixels;
+        pixels.width = 1;
+        pixels.height = 1;
+        pixels.data = { 128, 128, 128, 96 };
+        placeholder = pixels.Upload(device);
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex queue_mutex;
+    std::condition_variable queue_signal;
+    std::deque<std::shared_ptr<PendingImage>> queue; // waiting to be decoded
+    bool stopping = false;
+
+    std::atomic<CompletedNode*> completed = nullptr; // decoded, pushed by the workers
+    std::deque<std::shared_ptr<PendingImage>> uploads; // decoded, waiting for the upload budget (render thread only)
+    std::unordered_map<std::wstring, std::weak_ptr<PendingImage>> in_flight; // by path, so a file is loaded once at a time (render thread only)
+    ID3D11ShaderResourceView* placeholder = nullptr;
+};
+
+ImageLoader* ImageLoader::instance = nullptr;
+
+#endif // !IMAGELOADER_H
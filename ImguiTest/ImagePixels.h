@@ -0,0 +1,230 @@
+#ifndef IMAGEPIXELS_H
+#define IMAGEPIXELS_H
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <d3d11.h>
+#include <DirectXTex.h>
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define IMAGEPIXELS_SSE2 1
+#endif
+//#########################################################
+//################ IMAGE PIXELS ###########################
+//#########################################################
+
+/// <summary>
+/// Filter of the resized copies of an image
+/// </summary>
+enum class ResizeQuality {
+    Point,  // nearest pixel, for pixel art
+    Linear,
+    Cubic,
+    Box,    // average of the pixels covered, the sharpest without aliasing when shrinking
+};
+
+/// <summary>
+/// Raw pixels of an image, the only representation of the images we keep in memory
+/// </summary>
+struct ImagePixels {
+    // format of the pixels, the one the imgui dx11 backend renders its own font texture with
+    static constexpr DXGI_FORMAT FORMAT = DXGI_FORMAT_R8G8B8A8_UNORM;
+    static constexpr size_t BYTES_PER_PIXEL = 4;
+
+    std::vector<uint8_t> data; // rows packed without padding
+    size_t width = 0;
+    size_t height = 0;
+
+    /// <summary>
+    /// Describes the pixels as a DirectXTex image, without copying them
+    /// </summary>
+    DirectX::Image GetView() const
+    {
+        DirectX::Image view = {};
+        view.width = width;
+        view.height = height;
+        view.format = FORMAT;
+        view.rowPitch = width * BYTES_PER_PIXEL;
+        view.slicePitch = data.size();
+        view.pixels = const_cast<uint8_t*>(data.data());
+        return view;
+    }
+
+    /// <summary>
+    /// Copies the first image of a decoded file, converting it to RGBA first if the file had another format
+    /// </summary>
+    /// <returns>Whether the pixels were stored</returns>
+    bool Store(const DirectX::ScratchImage& image)
+    {
+        const DirectX::Image* source = image.GetImage(0, 0, 0);
+        DirectX::ScratchImage converted;
+        if (source->format != FORMAT)
+        {
+            HRESULT hr = DirectX::Convert(*source, FORMAT, DirectX::TEX_FILTER_DEFAULT, DirectX::TEX_THRESHOLD_DEFAULT, converted);
+            if (FAILED(hr))
+            {
+                std::cout << "[ERROR] | " << __FUNCTION__ << " | Failed to convert the image to RGBA" << std::endl;
+                return false;
+            }
+            source = converted.GetImage(0, 0, 0);
+        }
+
+        // the rows of a ScratchImage can be padded, ours are packed
+        size_t rowSize = source->width * BYTES_PER_PIXEL;
+        data.resize(rowSize * source->height);
+        for (size_t row = 0; row < source->height; row++)
+        {
+            memcpy(data.data() + row * rowSize, source->pixels + row * source->rowPitch, rowSize);
+        }
+        width = source->width;
+        height = source->height;
+        return true;
+    }
+
+    /// <summary>
+    /// Decodes the content of an image file, only once, straight into the pixels
+    /// </summary>
+    /// <param name="bytes">Content of the file (any format WIC can decode)</param>
+    /// <returns>Whether the file was decoded</returns>
+    bool Decode(const std::vector<uint8_t>& bytes)
+    {
+        // the sRGB flag of pngs is ignored so the pixels stay as they are in the file (imgui renders everything
+        // without gamma correction)
+        DirectX::ScratchImage decoded;
+        HRESULT hr = DirectX::LoadFromWICMemory(bytes.data(), bytes.size(), DirectX::WIC_FLAGS_IGNORE_SRGB, nullptr, decoded);
+        if (FAILED(hr))
+        {
+            std::cout << "[ERROR] | " << __FUNCTION__ << " | Failed to decode the image" << std::endl;
+            return false;
+        }
+        return Store(decoded);
+    }
+
+    /// <summary>
+    /// Resizes the pixels directly, without going through any file format
+    /// </summary>
+    /// <param name="resized">Receives the pixels of the new size</param>
+    /// <returns>Whether the pixels were resized</returns>
+    bool Resize(size_t newWidth, size_t newHeight, ResizeQuality quality, ImagePixels& resized) const
+    {
+        DirectX::TEX_FILTER_FLAGS filter = DirectX::TEX_FILTER_DEFAULT;
+        switch (quality)
+        {
+        case ResizeQuality::Point: filter = DirectX::TEX_FILTER_POINT; break;
+        case ResizeQuality::Linear: filter = DirectX::TEX_FILTER_LINEAR; break;
+        case ResizeQuality::Cubic: filter = DirectX::TEX_FILTER_CUBIC; break;
+        case ResizeQuality::Box: filter = DirectX::TEX_FILTER_FANT; break; // WIC's box filter, for any ratio
+        }
+
+        DirectX::ScratchImage image;
+        HRESULT hr = DirectX::Resize(GetView(), newWidth, newHeight, filter, image);
+        if (FAILED(hr))
+        {
+            std::cout << "[ERROR] | " << __FUNCTION__ << " | Failed to resize the image" << std::endl;
+            return false;
+        }
+        return resized.Store(image);
+    }
+
+    /// <summary>
+    /// Halves the image with a 2x2 box filter, the sizes round down like the D3D mip chain: the last row or column of an odd
+    /// side is dropped, a side of 1 stays 1 and its texels are repeated
+    /// </summary>
+    /// <param name="half">Receives the image, at least 1x1</param>
+    void Downsample(ImagePixels& half) const
+    {
+        half.width = width > 1 ? width / 2 : 1;
+        half.height = height > 1 ? height / 2 : 1;
+        half.data.resize(half.width * half.height * BYTES_PER_PIXEL);
+
+        const size_t rowSize = width * BYTES_PER_PIXEL;
+        for (size_t y = 0; y < half.height; y++)
+        {
+            const uint8_t* row0 = data.data() + (y * 2) * rowSize;
+            const uint8_t* row1 = (y * 2 + 1 < height) ? row0 + rowSize : row0;
+            uint8_t* out = half.data.data() + y * half.width * BYTES_PER_PIXEL;
+
+            size_t x = 0;
+#ifdef IMAGEPIXELS_SSE2
+            // 2 pixels out of 4 per iteration, the channels are summed in 16 bits
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i rounding = _mm_set1_epi16(2);
+            for (; x + 2 <= half.width && x * 2 + 4 <= width; x += 2)
+            {
+                __m128i top = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + x * 2 * BYTES_PER_PIXEL));
+                __m128i bottom = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + x * 2 * BYTES_PER_PIXEL));
+                __m128i left = _mm_add_epi16(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero)); // pixels 0 and 1
+                __m128i right = _mm_add_epi16(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero)); // pixels 2 and 3
+                left = _mm_add_epi16(left, _mm_srli_si128(left, 8));
+                right = _mm_add_epi16(right, _mm_srli_si128(right, 8));
+                __m128i sums = _mm_unpacklo_epi64(left, right);
+                sums = _mm_srli_epi16(_mm_add_epi16(sums, rounding), 2);
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out + x * BYTES_PER_PIXEL), _mm_packus_epi16(sums, zero));
+            }
+#endif
+            for (; x < half.width; x++)
+            {
+                size_t x0 = x * 2;
+                size_t x1 = (x0 + 1 < width) ? x0 + 1 : x0;
+                for (size_t channel = 0; channel < BYTES_PER_PIXEL; channel++)
+                {
+                    unsigned sum = row0[x0 * BYTES_PER_PIXEL + channel] + row0[x1 * BYTES_PER_PIXEL + channel]
+                        + row1[x0 * BYTES_PER_PIXEL + channel] + row1[x1 * BYTES_PER_PIXEL + channel];
+                    out[x * BYTES_PER_PIXEL + channel] = static_cast<uint8_t>((sum + 2) / 4);
+                }
+            }
+        }
+    }
+
+    /// <summary>
+    /// Builds the levels below the image, each half the size of the previous one
+    /// </summary>
+    /// <param name="maxLevels">Levels of the whole chain, the image included, 0 to go down to 1x1</param>
+    std::vector<ImagePixels> BuildMips(size_t maxLevels = 0) const
+    {
+        std::vector<ImagePixels> mips;
+        while (maxLevels == 0 || mips.size() + 1 < maxLevels)
+        {
+            const ImagePixels& previous = mips.empty() ? *this : mips.back();
+            if (previous.width <= 1 && previous.height <= 1)
+                break;
+            ImagePixels mip;
+            previous.Downsample(mip);
+            mips.push_back(std::move(mip));
+        }
+        return mips;
+    }
+
+    /// <summary>
+    /// Creates the texture of the pixels, with the levels below them if given
+    /// </summary>
+    /// <param name="mips">Levels built by BuildMips, empty for a texture without mips</param>
+    /// <returns>The shader resource view of the texture, nullptr if it couldnt be created</returns>
+    ID3D11ShaderResourceView* Upload(ID3D11Device* device, const std::vector<ImagePixels>& mips = {}) const
+    {
+        DirectX::TexMetadata metadata = {};
+        metadata.width = width;
+        metadata.height = height;
+        metadata.depth = 1;
+        metadata.arraySize = 1;
+        metadata.mipLevels = 1 + mips.size();
+        metadata.format = FORMAT;
+        metadata.dimension = DirectX::TEX_DIMENSION_TEXTURE2D;
+
+        std::vector<DirectX::Image> levels;
+        levels.push_back(GetView());
+        for (const ImagePixels& mip : mips)
+            levels.push_back(mip.GetView());
+
+        ID3D11ShaderResourceView* srv = nullptr;
+        HRESULT hr = DirectX::CreateShaderResourceView(device, levels.data(), levels.size(), metadata, &srv);
+        if (FAILED(hr))
+        {
+            std::cout << "[ERROR] | " << __FUNCTION__ << " | Failed to create the shader resource view" << std::endl;
+            return nullptr;
+        }
+        return srv;
+    }
+};
+
+#endif // !IMAGEPIXELS_H
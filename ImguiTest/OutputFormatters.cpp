@@ -6,11 +6,47 @@
 #if JSON_OUTPUT
 #include <fstream>
 #include <iomanip>
+#include <string>
+#endif
+
+#if IMGUI_OUTPUT || CAPTURE_OUTPUT || TRACE_OUTPUT || SERVER_OUTPUT
+#include <cstring>
+#endif
+
+#if TRACE_OUTPUT
+#include <cstdio>
+#include <string>
+#endif
+
+#if HITCH_OUTPUT
+#include <algorithm>
+#include <cstdio>
+#endif
+
+#if SERVER_OUTPUT
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32")
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <climits>
+#include <cstdio>
 #endif
 
 #if IMGUI_OUTPUT
 #include "imgui.h"	// Imgui.h is assumed to be part of additional include directories (otherwise, IMGUI_OUTPUT can be turned off)
 #include <algorithm>
+#include <cmath>
+#include <cstdio>
 #endif
 
 
@@ -18,16 +54,123 @@ namespace Profiler
 {
 	namespace Formatters
 	{
+		namespace
+		{
+#if TIME_IN_NANOSECONDS
+			const char* TIME_UNIT = "ns";
+#else
+			const char* TIME_UNIT = "cycles";
+#endif
+
+			// Converts a duration in ticks of the profiler clock to the unit the formatters report times in.
+			double report_time(double ticks)
+			{
+#if TIME_IN_NANOSECONDS
+				return ticks * 1e9 / Clock::ticks_per_second();
+#else
+				return ticks;
+#endif
+			}
+
+			// Returns the sampler hits of a node and all its descendants.
+			unsigned long long subtree_hits(const ProfilingMgr::node* subtree)
+			{
+				unsigned long long hits = subtree->m_sampleHits;
+				for (const ProfilingMgr::node* child = subtree->first_child(); child; child = child->next_sibling())
+					hits += subtree_hits(child);
+				return hits;
+			}
+		}
+
 #if JSON_OUTPUT
 		void JsonFormatter::dump_to_json(const char* filePath)
 		{
 			std::ofstream file(filePath);
 			if (file.is_open())
 			{
-				ProfilingMgr::node* root = ProfilingMgr::get_instance().get_root();
-
 				json rootStats;
-				dump_node(rootStats, root->m_child);
+				ProfilingMgr::get_instance().begin_history_read();
+				rootStats["Clock"] = Clock::name();
+				rootStats["Time unit"] = TIME_UNIT;
+				rootStats["Overhead per scope"] = report_time(static_cast<double>(ProfilingMgr::get_instance().get_scope_overhead()));
+				rootStats["Overhead compensated"] = ProfilingMgr::get_instance().get_overhead_compensation();
+
+				// Dump the tree of every thread as an element of the "Threads" array
+				ProfilingMgr::thread_data* thread = ProfilingMgr::get_instance().get_thread_list();
+				while (thread)
+				{
+					json threadStats;
+					threadStats["1) Thread"] = thread->m_name ? thread->m_name : "Thread " + std::to_string(thread->m_index);
+
+					ProfilingMgr::node* sibTraverser = thread->m_root->first_child();
+					while (sibTraverser)
+					{
+						json childStats;
+						dump_node(childStats, sibTraverser);
+						threadStats["2) Children"].push_back(childStats);
+
+						sibTraverser = sibTraverser->next_sibling();
+					}
+
+					// Stats of every scope over all its call paths in the last frame
+					unsigned scopeCount = ProfilingMgr::get_instance().get_scope_count();
+					for (unsigned scopeIndex = 0; scopeIndex < scopeCount; ++scopeIndex)
+					{
+						const ProfilingMgr::scope_stats* lastFrame = thread->get_scope_stats(scopeIndex);
+						if (lastFrame == nullptr)
+							continue;
+
+						// Copied once, the thread may be rolling its next frame into it
+						const ProfilingMgr::scope_stats scope = *lastFrame;
+						if (scope.m_callCount == 0)
+							continue;
+
+						json scopeStats;
+						scopeStats["1) ID"] = ProfilingMgr::get_instance().get_scope(scopeIndex)->m_name;
+						scopeStats["2) Call count"] = scope.m_callCount;
+						scopeStats["3) Total time"] = report_time(static_cast<double>(scope.m_totalCycles));
+						scopeStats["4) Self time"] = report_time(static_cast<double>(scope.m_selfCycles));
+						scopeStats["5) Max time"] = report_time(static_cast<double>(scope.m_maxCycles));
+						threadStats["3) Scopes (last frame)"].push_back(scopeStats);
+					}
+
+					// Only reported when the scopes of the thread weren't well nested
+					if (thread->m_unmatchedExits > 0 || thread->m_depthOverflows > 0 || thread->m_stackRepairs > 0)
+					{
+						threadStats["4) Unmatched exits"] = thread->m_unmatchedExits;
+						threadStats["5) Depth overflows"] = thread->m_depthOverflows;
+						threadStats["6) Stack repairs"] = thread->m_stackRepairs;
+					}
+
+					rootStats["Threads"].push_back(threadStats);
+					thread = thread->m_next;
+				}
+
+				// Time series over the last frames (oldest first), to correlate the frame times with the channels
+				ProfilingMgr& mgr = ProfilingMgr::get_instance();
+				const ProfilingMgr::channel_history& frames = mgr.get_frame_history();
+				json& frameTimes = rootStats["Frame times"];
+				frameTimes = json::array();
+				for (unsigned age = frames.size(); age-- > 0;)
+					frameTimes.push_back(report_time(static_cast<double>(frames.value(age))));
+
+				rootStats["Channels"] = json::array();
+				for (unsigned channelIndex = 0; channelIndex < mgr.get_channel_count(); ++channelIndex)
+				{
+					const channel_descriptor* channel = mgr.get_channel(channelIndex);
+					const ProfilingMgr::channel_history& values = mgr.get_channel_history(channelIndex);
+
+					json channelJson;
+					channelJson["1) Name"] = channel->m_name;
+					channelJson["2) Kind"] = channel->m_kind == channel_kind::counter ? "counter" : "gauge";
+					json& valuesJson = channelJson["3) Values"];
+					valuesJson = json::array();
+					for (unsigned age = values.size(); age-- > 0;)
+						valuesJson.push_back(values.value(age));
+					rootStats["Channels"].push_back(channelJson);
+				}
+
+				ProfilingMgr::get_instance().end_history_read();
 
 				file << std::setw(4) << rootStats;// << randomStats;
 			}
@@ -41,76 +184,2323 @@ namespace Profiler
 			// Save the stats of the current node in "stats"
 			nodeJson["1) ID"] = nodeToDump->m_id;
 			nodeJson["2) Call count"] = nodeToDump->m_stats.m_callCount;
-			nodeJson["3) Total cycles"] = nodeToDump->m_stats.m_totalCycles;
+			nodeJson["3) Total time"] = report_time(static_cast<double>(nodeToDump->m_stats.m_totalCycles));
 
 			unsigned long long average = nodeToDump->m_stats.m_callCount == 0 ? 0 : nodeToDump->m_stats.m_totalCycles / static_cast<unsigned long long>(nodeToDump->m_stats.m_callCount);
-			nodeJson["4) Average cycles"] = average;
+			nodeJson["4) Average time"] = report_time(static_cast<double>(average));
 
-			nodeJson["5) Max cycles"] = nodeToDump->m_stats.m_maxCycles;
-			nodeJson["6) Min cycles"] = nodeToDump->m_stats.m_minCycles;
+			nodeJson["5) Max time"] = report_time(static_cast<double>(nodeToDump->m_stats.m_maxCycles));
+			nodeJson["6) Min time"] = nodeToDump->m_stats.m_callCount == 0 ? 0.0 : report_time(static_cast<double>(nodeToDump->m_stats.m_minCycles));
 
 			float percentage = nodeToDump->m_parent->m_stats.m_totalCycles == 0 ? 100.0f : (100.0f * static_cast<float>(nodeToDump->m_stats.m_totalCycles) / nodeToDump->m_parent->m_stats.m_totalCycles);
 			nodeJson["7) % with respect to parent"] = percentage;
 
+			// Statistics over the last frames
+			ProfilingMgr::history_summary history = nodeToDump->m_history.summarize();
+			json& historyJson = nodeJson["9) History"];
+			historyJson["Frames"] = history.m_frames;
+			historyJson["Mean time per frame"] = report_time(history.m_meanCycles);
+			historyJson["P50 time per frame"] = report_time(static_cast<double>(history.m_p50Cycles));
+			historyJson["P95 time per frame"] = report_time(static_cast<double>(history.m_p95Cycles));
+			historyJson["P99 time per frame"] = report_time(static_cast<double>(history.m_p99Cycles));
+			historyJson["Max time per frame"] = report_time(static_cast<double>(history.m_maxCycles));
+			historyJson["Max time per call"] = report_time(static_cast<double>(history.m_maxCallCycles));
+			historyJson["Mean calls per frame"] = history.m_meanCalls;
+			historyJson["Mean self time per frame"] = report_time(history.m_meanSelfCycles);
+			historyJson["Self time last frame"] = report_time(static_cast<double>(nodeToDump->m_history.self_cycles(0)));
+			historyJson["Child calls last frame"] = nodeToDump->m_history.child_calls(0);
+			historyJson["Allocations last frame"] = nodeToDump->m_history.alloc_count(0);
+			historyJson["Allocated bytes last frame"] = nodeToDump->m_history.alloc_bytes(0);
+
+			// Oldest first, the samples the analyzer compares runs with
+			json& frameTimes = historyJson["Time per frame"];
+			frameTimes = json::array();
+			for (unsigned age = nodeToDump->m_history.size(); age-- > 0;)
+				frameTimes.push_back(report_time(static_cast<double>(nodeToDump->m_history.total_cycles(age))));
+
+			nodeJson["10) Sample hits (self)"] = nodeToDump->m_sampleHits;
+			nodeJson["11) Sample hits (total)"] = subtree_hits(nodeToDump);
+
 			// Save the stats of each child node in "childStats" and add it to "stats" as an element of an array
-			ProfilingMgr::node* sibTraverser = nodeToDump->m_child;
+			ProfilingMgr::node* sibTraverser = nodeToDump->first_child();
 			while (sibTraverser)
 			{
 				json childStats;
 				dump_node(childStats, sibTraverser);
 				nodeJson["8) Children"].push_back(childStats);
 
-				sibTraverser = sibTraverser->m_sibling;
+				sibTraverser = sibTraverser->next_sibling();
 			}
 		}
 #endif
 
 
 #if IMGUI_OUTPUT
+		namespace
+		{
+			const float LANE_HEIGHT = 18.0f;					// Height of the spans of the flame graph and the timeline
+			const float MIN_LABEL_WIDTH = 24.0f;				// Narrower spans are drawn without their name
+			const double MAX_ZOOM = 1e6;
+			const size_t MAX_PENDING_SPANS = 1 << 20;			// Per thread, in case PROF_NEW_FRAME() is never called
+			const double HOTSPOT_REFRESH_SECONDS = 0.5;			// The hot spots table is refreshed (and re-sorted) at this rate
+
+			// User ids of the columns of the hot spots table, used by the sort specs.
+			enum hotspot_column
+			{
+				HOTSPOT_SCOPE,
+				HOTSPOT_THREAD,
+				HOTSPOT_CALLS,
+				HOTSPOT_TOTAL,
+				HOTSPOT_SELF,
+				HOTSPOT_AVERAGE,
+				HOTSPOT_MAX,
+				HOTSPOT_PARENT
+			};
+
+			// Color of the spans of a scope, so that the same scope keeps its color across views and frames.
+			ImU32 scope_color(unsigned scopeIndex)
+			{
+				float hue = static_cast<float>((scopeIndex * 0x9E3779B9u) >> 8) / static_cast<float>(1 << 24);
+				return ImColor::HSV(hue, 0.45f, 0.8f);
+			}
+
+			const char* thread_label(const ProfilingMgr::thread_data& thread, char* label, size_t size)
+			{
+				if (thread.m_name)
+					snprintf(label, size, "%s%s", thread.m_name, thread.m_finished ? " (finished)" : "");
+				else
+					snprintf(label, size, "Thread %u%s", thread.m_index, thread.m_finished ? " (finished)" : "");
+				return label;
+			}
+
+			// Allocator ImGui was using before ImGuiFormatter::hook_allocator, which the hook forwards to.
+			ImGuiMemAllocFunc s_previousAlloc = nullptr;
+			ImGuiMemFreeFunc s_previousFree = nullptr;
+			void* s_previousUserData = nullptr;
+
+			channel_descriptor s_allocChannel("ImGui allocations", channel_kind::counter);
+			channel_descriptor s_allocBytesChannel("ImGui allocated bytes", channel_kind::counter);
+			channel_descriptor s_freeChannel("ImGui frees", channel_kind::counter);
+
+			void* profiled_alloc(size_t size, void*)
+			{
+				ProfilingMgr& mgr = ProfilingMgr::get_instance();
+				mgr.count_allocation(size);
+				mgr.add_to_counter(s_allocChannel, 1);
+				mgr.add_to_counter(s_allocBytesChannel, static_cast<long long>(size));
+				return s_previousAlloc(size, s_previousUserData);
+			}
+
+			void profiled_free(void* ptr, void*)
+			{
+				if (ptr)
+					ProfilingMgr::get_instance().add_to_counter(s_freeChannel, 1);
+				s_previousFree(ptr, s_previousUserData);
+			}
+
+			// Draws a span as a filled rect, with its name clipped to the rect if it is wide enough.
+			void draw_span(ImDrawList* drawList, float x0, float x1, float y, ImU32 color, const char* name)
+			{
+				drawList->AddRectFilled(ImVec2(x0, y), ImVec2(x1, y + LANE_HEIGHT - 1.0f), color);
+				if (x1 - x0 >= MIN_LABEL_WIDTH)
+				{
+					ImVec4 clip(x0 + 2.0f, y, x1 - 2.0f, y + LANE_HEIGHT);
+					drawList->AddText(nullptr, 0.0f, ImVec2(x0 + 3.0f, y + 1.0f), IM_COL32_BLACK, name, nullptr, 0.0f, &clip);
+				}
+			}
+		}
+
+		ImGuiFormatter::~ImGuiFormatter()
+		{
+			set_timeline_enabled(false);
+		}
+
 		void ImGuiFormatter::on_gui()
 		{
 			if (!ImGui::Begin("PROFILER DATA (per frame)"))
 			{
+				set_timeline_enabled(false);
 				ImGui::End();
 				return;
 			}
 
-			ProfilingMgr::node* root = Profiler::ProfilingMgr::get_instance().get_root();
+			ImGui::Text("Clock: %s (%.3f GHz) | Times in %s", Clock::name(), Clock::ticks_per_second() * 1e-9, TIME_UNIT);
+
+			ProfilingMgr& mgr = ProfilingMgr::get_instance();
+			bool sampling = mgr.is_sampling();
+			if (ImGui::Checkbox("Sampling (1 ms)", &sampling))
+			{
+				if (sampling)
+					mgr.start_sampling(1000);
+				else
+					mgr.stop_sampling();
+			}
+
+			bool compensate = mgr.get_overhead_compensation();
+			ImGui::SameLine();
+			if (ImGui::Checkbox("Compensate overhead", &compensate))
+				mgr.set_overhead_compensation(compensate);
+			if (ImGui::IsItemHovered())
+				ImGui::SetTooltip("Measured at startup: %.1f %s per scope, %.1f %s of it inside the scope",
+					report_time(static_cast<double>(mgr.get_scope_overhead())), TIME_UNIT,
+					report_time(static_cast<double>(mgr.get_self_overhead())), TIME_UNIT);
+
+			// One checkbox per category used by the scopes, once there is more than the default one
+			category_mask usedCategories = mgr.get_used_categories();
+			if (usedCategories & ~CATEGORY_DEFAULT)
+			{
+				category_mask enabledCategories = mgr.get_enabled_categories();
+				ImGui::TextUnformatted("Categories:");
+				for (unsigned bit = 0; bit < sizeof(category_mask) * 8; ++bit)
+				{
+					category_mask category = 1u << bit;
+					if ((usedCategories & category) == 0)
+						continue;
+
+					char label[32];
+					const char* name = mgr.get_category_name(category);
+					if (name == nullptr)
+						snprintf(label, sizeof(label), category == CATEGORY_DEFAULT ? "Default" : "Category %u", bit);
+
+					bool enabled = (enabledCategories & category) != 0;
+					ImGui::SameLine();
+					if (ImGui::Checkbox(name ? name : label, &enabled))
+						mgr.set_enabled_categories(enabled ? enabledCategories | category : enabledCategories & ~category);
+				}
+			}
+
+			// The trees of the other threads keep rolling meanwhile
+			bool timelineVisible = false;
+			mgr.begin_history_read();
+			if (ImGui::BeginTabBar("Views"))
+			{
+				if (ImGui::BeginTabItem("Tree"))
+				{
+					draw_tree();
+					ImGui::EndTabItem();
+				}
+				if (ImGui::BeginTabItem("Hot spots"))
+				{
+					draw_hotspots();
+					ImGui::EndTabItem();
+				}
+				if (ImGui::BeginTabItem("Flame graph"))
+				{
+					draw_flame_graph();
+					ImGui::EndTabItem();
+				}
+				if (ImGui::BeginTabItem("Timeline"))
+				{
+					timelineVisible = true;
+					draw_timeline();
+					ImGui::EndTabItem();
+				}
+				if (ImGui::BeginTabItem("Counters"))
+				{
+					draw_counters();
+					ImGui::EndTabItem();
+				}
+				ImGui::EndTabBar();
+			}
+			mgr.end_history_read();
 
-			dump_node(root->m_child);
+			// Only record events while somebody looks at them
+			set_timeline_enabled(timelineVisible);
 
 			ImGui::End();
 		}
 
-		void ImGuiFormatter::dump_node(ProfilingMgr::node* nodeToDump)
+		// Receives the events of one thread on the pump thread, and turns them into spans.
+		void ImGuiFormatter::on_events(const ProfilingMgr::thread_data& thread, const ProfilingMgr::event* events, unsigned count)
 		{
-			if (nodeToDump == nullptr)
+			pending_spans& pending = m_pending[&thread];
+			for (unsigned i = 0; i < count; ++i)
+			{
+				const ProfilingMgr::event& e = events[i];
+				if (e.is_enter())
+				{
+					pending.m_open.push_back({ e.m_time, 0, e.m_scope, static_cast<unsigned>(pending.m_open.size()) });
+				}
+				else if (e.is_exit())
+				{
+					// Scopes entered before the timeline was opened have no span
+					if (pending.m_open.empty())
+						continue;
+
+					span closed = pending.m_open.back();
+					pending.m_open.pop_back();
+					closed.m_end = e.m_time;
+					pending.m_closed.push_back(closed);
+				}
+				else if (e.is_frame())
+				{
+					// The other threads publish the events of a frame once they notice that it ended, so a frame is
+					// only handed to the GUI once the next one ended too.
+					if (m_frameStartCount == 2)
+						publish_frame(m_frameStarts[0], m_frameStarts[1]);
+					else
+						m_frameStartCount++;
+
+					m_frameStarts[0] = m_frameStarts[1];
+					m_frameStarts[1] = e.m_time;
+				}
+			}
+
+			if (pending.m_closed.size() > MAX_PENDING_SPANS)
+				pending.m_closed.clear();
+		}
+
+		void ImGuiFormatter::on_flush()
+		{
+		}
+
+		// Instance used by the DUMP_TO_IMGUI macro, which keeps the state of the views between frames.
+		ImGuiFormatter& ImGuiFormatter::get_instance()
+		{
+			static ImGuiFormatter instance;
+			return instance;
+		}
+
+		// Makes ImGui allocate through the profiler, which counts the allocations in the current scope of the calling
+		// thread and in the "ImGui allocations"/"ImGui allocated bytes"/"ImGui frees" counters before forwarding them
+		// to the allocator ImGui was using. Must be called before ImGui::CreateContext.
+		void ImGuiFormatter::hook_allocator()
+		{
+			if (s_previousAlloc)
 				return;
 
-			if (ImGui::CollapsingHeader(nodeToDump->m_id))
+			ImGui::GetAllocatorFunctions(&s_previousAlloc, &s_previousFree, &s_previousUserData);
+			ImGui::SetAllocatorFunctions(profiled_alloc, profiled_free);
+		}
+
+		// Hands the spans overlapping [start, end) to the GUI thread, then drops the ones that end before end.
+		// Runs on the pump thread.
+		void ImGuiFormatter::publish_frame(unsigned long long start, unsigned long long end)
+		{
+			m_buildingFrame.m_start = start;
+			m_buildingFrame.m_end = end;
+			m_buildingFrame.m_threads.resize(m_pending.size());
+
+			unsigned threadIndex = 0;
+			for (auto& pending : m_pending)
 			{
-				ImGui::Text("Call count: %u", nodeToDump->m_stats.m_callCount);
-				ImGui::Text("Total cycles: %llu", nodeToDump->m_stats.m_totalCycles);
-				unsigned long long average = nodeToDump->m_stats.m_callCount == 0 ? 0 : nodeToDump->m_stats.m_totalCycles / static_cast<unsigned long long>(nodeToDump->m_stats.m_callCount);
-				ImGui::Text("Avg cycles per call: %llu", average);
-				ImGui::Text("Max cycles: %llu", nodeToDump->m_stats.m_maxCycles);
-				ImGui::Text("Min cycles: %llu", nodeToDump->m_stats.m_minCycles);
-				float percentage = nodeToDump->m_parent->m_stats.m_totalCycles == 0 ? 100.0f : (100.0f * static_cast<float>(nodeToDump->m_stats.m_totalCycles) / nodeToDump->m_parent->m_stats.m_totalCycles);
-				ImGui::Text("%% with respect to parent: %f", percentage);
+				thread_spans& thread = m_buildingFrame.m_threads[threadIndex++];
+				thread.m_thread = pending.first;
+				thread.m_depthCount = 0;
+				m_frameSpans.clear();
+
+				for (const span& closed : pending.second.m_closed)
+				{
+					if (closed.m_end > start && closed.m_start < end)
+					{
+						m_frameSpans.push_back(closed);
+						thread.m_depthCount = std::max(thread.m_depthCount, closed.m_depth + 1);
+					}
+				}
+
+				// Scopes still open after the frame (e.g. the one around the main loop) cover the rest of it. They come
+				// after any closed span of the same depth, so the exit order of each depth is kept.
+				for (span open : pending.second.m_open)
+				{
+					if (open.m_start < end)
+					{
+						open.m_end = end;
+						m_frameSpans.push_back(open);
+						thread.m_depthCount = std::max(thread.m_depthCount, open.m_depth + 1);
+					}
+				}
+
+				// Group the spans by depth (counting sort). Spans of one depth don't overlap, so the exit order is also
+				// the start order, which lets the GUI binary search the visible ones.
+				thread.m_depthStarts.assign(thread.m_depthCount + 1, 0);
+				for (const span& s : m_frameSpans)
+					thread.m_depthStarts[s.m_depth + 1]++;
+				for (unsigned depth = 0; depth < thread.m_depthCount; ++depth)
+					thread.m_depthStarts[depth + 1] += thread.m_depthStarts[depth];
+
+				thread.m_spans.resize(m_frameSpans.size());
+				m_depthFill.assign(thread.m_depthStarts.begin(), thread.m_depthStarts.end() - 1);
+				for (const span& s : m_frameSpans)
+					thread.m_spans[m_depthFill[s.m_depth]++] = s;
+
+				std::vector<span>& closed = pending.second.m_closed;
+				closed.erase(std::remove_if(closed.begin(), closed.end(), [end](const span& s) { return s.m_end <= end; }), closed.end());
+			}
+
+			std::sort(m_buildingFrame.m_threads.begin(), m_buildingFrame.m_threads.end(),
+					  [](const thread_spans& a, const thread_spans& b) { return a.m_thread->m_index < b.m_thread->m_index; });
+
+			std::lock_guard<std::mutex> lock(m_frameMutex);
+			std::swap(m_buildingFrame, m_readyFrame);
+			m_readyVersion++;
+		}
+
+		// Registers or unregisters the formatter as an event sink.
+		void ImGuiFormatter::set_timeline_enabled(bool enabled)
+		{
+			if (enabled == m_timelineEnabled)
+				return;
+
+			m_timelineEnabled = enabled;
+			if (enabled)
+			{
+				ProfilingMgr::get_instance().add_event_sink(this);
+				return;
+			}
+
+			// Once removed the pump doesn't use the formatter anymore, so its state can be reset from here
+			ProfilingMgr::get_instance().remove_event_sink(this);
+			m_pending.clear();
+			m_frameStartCount = 0;
+			std::lock_guard<std::mutex> lock(m_frameMutex);
+			m_readyFrame.m_end = 0;
+			m_shownFrame.m_end = 0;
+		}
+
+		void ImGuiFormatter::draw_tree()
+		{
+			// One collapsing header per thread, each with the tree of that thread
+			ProfilingMgr::thread_data* thread = Profiler::ProfilingMgr::get_instance().get_thread_list();
+			while (thread)
+			{
+				ImGui::PushID(thread);
+
+				char label[64];
+				if (ImGui::CollapsingHeader(thread_label(*thread, label, sizeof(label)), ImGuiTreeNodeFlags_DefaultOpen))
+				{
+					m_threadSamples = thread->m_sampleCount;
+					if (m_threadSamples > 0)
+						ImGui::Text("Samples: %llu (%.1f%% outside profiled scopes)", m_threadSamples, 100.0 * thread->m_root->m_sampleHits / m_threadSamples);
+					if (thread->m_root->m_history.alloc_count(0) > 0)
+						ImGui::Text("Allocations outside profiled scopes (last frame): %u (%llu bytes)", thread->m_root->m_history.alloc_count(0), thread->m_root->m_history.alloc_bytes(0));
+					if (thread->m_unmatchedExits > 0 || thread->m_depthOverflows > 0 || thread->m_stackRepairs > 0)
+					{
+						ImGui::TextColored(ImVec4(1.0f, 0.6f, 0.2f, 1.0f), "Unmatched exits: %llu, depth overflows: %llu, stack repairs: %llu", thread->m_unmatchedExits, thread->m_depthOverflows, thread->m_stackRepairs);
+						if (ImGui::IsItemHovered())
+							ImGui::SetTooltip("Scopes of this thread that weren't well nested. Their times were recovered as well as possible.");
+					}
+
+					ProfilingMgr::node* sibTraverser = thread->m_root->first_child();
+					while (sibTraverser)
+					{
+						ImGui::Indent(30.0f);
+						dump_node(sibTraverser);
+						sibTraverser = sibTraverser->next_sibling();
+						ImGui::Unindent(30.0f);
+					}
+				}
+
+				ImGui::PopID();
+				thread = thread->m_next;
+			}
+		}
+
+		// One plot per channel over the last frames, below a plot of the frame times, so that spikes can be matched by
+		// hovering the same frame in each plot.
+		void ImGuiFormatter::draw_counters()
+		{
+			ProfilingMgr& mgr = ProfilingMgr::get_instance();
+			const ProfilingMgr::channel_history& frames = mgr.get_frame_history();
 
-				int valuesCount = static_cast<int>(std::clamp(nodeToDump->m_stats.m_callCount, 1u, CALLS_RECORDED));
-				int offset = m_valOffset++ % valuesCount;
-				ImGui::PlotLines("Cycles on previous calls", nodeToDump->m_stats.m_previousCycles, valuesCount, offset);
+			// Oldest frame on the left
+			auto frameTime = [](void* data, int idx)
+			{
+				const ProfilingMgr::channel_history* history = static_cast<const ProfilingMgr::channel_history*>(data);
+				return static_cast<float>(report_time(static_cast<double>(history->value(history->size() - 1 - idx))));
+			};
+			auto channelValue = [](void* data, int idx)
+			{
+				const ProfilingMgr::channel_history* history = static_cast<const ProfilingMgr::channel_history*>(data);
+				return static_cast<float>(history->value(history->size() - 1 - idx));
+			};
+
+			if (frames.size() == 0)
+			{
+				ImGui::TextDisabled("No frames recorded yet (see PROF_NEW_FRAME)");
+				return;
+			}
+
+			ImGui::Text("Frame time: %.0f %s (last frame)", report_time(static_cast<double>(frames.value(0))), TIME_UNIT);
+			ImGui::PlotLines("##Frame time", frameTime, const_cast<ProfilingMgr::channel_history*>(&frames), static_cast<int>(frames.size()), 0, nullptr, FLT_MAX, FLT_MAX, ImVec2(-1.0f, 50.0f));
+
+			unsigned channelCount = mgr.get_channel_count();
+			if (channelCount == 0)
+				ImGui::TextDisabled("No counters or gauges (see PROF_COUNTER/PROF_GAUGE)");
+
+			for (unsigned channelIndex = 0; channelIndex < channelCount; ++channelIndex)
+			{
+				const channel_descriptor* channel = mgr.get_channel(channelIndex);
+				const ProfilingMgr::channel_history& values = mgr.get_channel_history(channelIndex);
+
+				long long maxValue = values.size() > 0 ? values.value(0) : 0;
+				double sum = 0.0;
+				for (unsigned age = 0; age < values.size(); ++age)
+				{
+					maxValue = std::max(maxValue, values.value(age));
+					sum += static_cast<double>(values.value(age));
+				}
+
+				ImGui::PushID(static_cast<int>(channelIndex));
 				ImGui::Separator();
+				ImGui::Text("%s (%s): last %lld | mean %.1f | max %lld", channel->m_name, channel->m_kind == channel_kind::counter ? "per frame" : "gauge",
+							values.value(0), values.size() > 0 ? sum / values.size() : 0.0, maxValue);
+				ImGui::PlotLines("##Values", channelValue, const_cast<ProfilingMgr::channel_history*>(&values), static_cast<int>(values.size()), 0, nullptr, FLT_MAX, FLT_MAX, ImVec2(-1.0f, 50.0f));
+				ImGui::PopID();
 			}
+		}
 
-			ProfilingMgr::node* sibTraverser = nodeToDump->m_child;
-			while (sibTraverser)
+		// Flat table with one row per node of every thread, sortable by any of its columns. Rows are only rebuilt when
+		// nodes are added to the trees, and their stats are refreshed (and re-sorted) a few times per second, so that
+		// the table can be read. Only the visible rows are laid out.
+		void ImGuiFormatter::draw_hotspots()
+		{
+			unsigned nodeCount = 0;
+			for (ProfilingMgr::thread_data* thread = ProfilingMgr::get_instance().get_thread_list(); thread; thread = thread->m_next)
+				nodeCount += thread->m_pool.size();
+
+			bool byScopeChanged = ImGui::Checkbox("Group by scope", &m_hotspotsByScope);
+			ImGui::SameLine();
+			ImGui::Checkbox("Freeze", &m_hotspotsFrozen);
+			ImGui::SameLine();
+
+			bool refreshed = false;
+			double time = ImGui::GetTime();
+			bool refreshDue = !m_hotspotsFrozen && time - m_hotspotRefreshTime >= HOTSPOT_REFRESH_SECONDS;
+			if (m_hotspotsByScope)
 			{
-				ImGui::Indent(30.0f);
-				dump_node(sibTraverser);
-				sibTraverser = sibTraverser->m_sibling;
-				ImGui::Unindent(30.0f);
+				// The stats per scope are flat arrays, so the rows are simply rebuilt
+				if (byScopeChanged || refreshDue)
+				{
+					collect_scope_hotspots();
+					m_hotspotRefreshTime = time;
+					refreshed = true;
+				}
+			}
+			else if (byScopeChanged || nodeCount != m_hotspotNodeCount)
+			{
+				collect_hotspots();
+				m_hotspotNodeCount = nodeCount;
+				refresh_hotspots();
+				m_hotspotRefreshTime = time;
+				refreshed = true;
+			}
+			else if (refreshDue)
+			{
+				refresh_hotspots();
+				m_hotspotRefreshTime = time;
+				refreshed = true;
+			}
+
+			ImGui::TextDisabled("%u %s | Last frame, in %s", static_cast<unsigned>(m_hotspots.size()), m_hotspotsByScope ? "scopes" : "call paths", TIME_UNIT);
+
+			ImGuiTableFlags flags = ImGuiTableFlags_Sortable | ImGuiTableFlags_SortMulti | ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersOuter |
+									ImGuiTableFlags_BordersV | ImGuiTableFlags_Resizable | ImGuiTableFlags_Reorderable | ImGuiTableFlags_Hideable |
+									ImGuiTableFlags_ScrollY | ImGuiTableFlags_SizingFixedFit;
+			if (!ImGui::BeginTable("HotSpots", 8, flags, ImGui::GetContentRegionAvail()))
+				return;
+
+			ImGui::TableSetupScrollFreeze(1, 1);
+			ImGui::TableSetupColumn("Scope", ImGuiTableColumnFlags_WidthStretch, 0.0f, HOTSPOT_SCOPE);
+			ImGui::TableSetupColumn("Thread", ImGuiTableColumnFlags_None, 0.0f, HOTSPOT_THREAD);
+			ImGui::TableSetupColumn("Calls", ImGuiTableColumnFlags_PreferSortDescending, 0.0f, HOTSPOT_CALLS);
+			ImGui::TableSetupColumn("Total", ImGuiTableColumnFlags_PreferSortDescending, 0.0f, HOTSPOT_TOTAL);
+			ImGui::TableSetupColumn("Self", ImGuiTableColumnFlags_PreferSortDescending | ImGuiTableColumnFlags_DefaultSort, 0.0f, HOTSPOT_SELF);
+			ImGui::TableSetupColumn("Average", ImGuiTableColumnFlags_PreferSortDescending, 0.0f, HOTSPOT_AVERAGE);
+			ImGui::TableSetupColumn("Max", ImGuiTableColumnFlags_PreferSortDescending, 0.0f, HOTSPOT_MAX);
+			ImGui::TableSetupColumn("% of parent", ImGuiTableColumnFlags_PreferSortDescending, 0.0f, HOTSPOT_PARENT);
+			ImGui::TableHeadersRow();
+
+			// Sort only when the order asked for or the values changed
+			ImGuiTableSortSpecs* sortSpecs = ImGui::TableGetSortSpecs();
+			if (sortSpecs && (sortSpecs->SpecsDirty || refreshed))
+			{
+				sort_hotspots(sortSpecs);
+				sortSpecs->SpecsDirty = false;
+			}
+
+			ImGuiListClipper clipper;
+			clipper.Begin(static_cast<int>(m_hotspots.size()));
+			while (clipper.Step())
+			{
+				for (int rowIndex = clipper.DisplayStart; rowIndex < clipper.DisplayEnd; ++rowIndex)
+				{
+					const hotspot_row& row = m_hotspots[rowIndex];
+					ImGui::TableNextRow();
+
+					ImGui::TableNextColumn();
+					ImGui::TextUnformatted(hotspot_name(row));
+					if (ImGui::IsItemHovered() && row.m_node == nullptr)
+					{
+						const scope_descriptor* scope = ProfilingMgr::get_instance().get_scope(row.m_scopeIndex);
+						ImGui::SetTooltip("%s:%u", scope->m_file, scope->m_line);
+					}
+					else if (ImGui::IsItemHovered())
+					{
+						// Call path, from the outermost scope
+						ImGui::BeginTooltip();
+						const ProfilingMgr::node* path[64];
+						int pathLength = 0;
+						for (const ProfilingMgr::node* node = row.m_node; node->m_parent && pathLength < 64; node = node->m_parent)
+							path[pathLength++] = node;
+						for (int i = pathLength - 1; i >= 0; --i)
+							ImGui::Text("%*s%s", 2 * (pathLength - 1 - i), "", path[i]->m_id);
+						ImGui::EndTooltip();
+					}
+
+					char label[64];
+					ImGui::TableNextColumn();
+					ImGui::TextUnformatted(thread_label(*row.m_thread, label, sizeof(label)));
+					ImGui::TableNextColumn();
+					ImGui::Text("%u", row.m_callCount);
+					ImGui::TableNextColumn();
+					ImGui::Text("%.0f", report_time(static_cast<double>(row.m_totalCycles)));
+					ImGui::TableNextColumn();
+					ImGui::Text("%.0f", report_time(static_cast<double>(row.m_selfCycles)));
+					ImGui::TableNextColumn();
+					ImGui::Text("%.0f", report_time(static_cast<double>(row.m_averageCycles)));
+					ImGui::TableNextColumn();
+					ImGui::Text("%.0f", report_time(static_cast<double>(row.m_maxCycles)));
+					ImGui::TableNextColumn();
+					if (row.m_node)
+						ImGui::Text("%.1f", row.m_parentPercentage);
+					else
+						ImGui::TextDisabled("-");
+				}
+			}
+
+			ImGui::EndTable();
+		}
+
+		// Rebuilds the rows of the hot spots table from the trees. Only needed when nodes were added.
+		void ImGuiFormatter::collect_hotspots()
+		{
+			m_hotspots.clear();
+
+			std::vector<const ProfilingMgr::node*> pending;
+			for (ProfilingMgr::thread_data* thread = ProfilingMgr::get_instance().get_thread_list(); thread; thread = thread->m_next)
+			{
+				pending.assign(1, thread->m_root);
+				while (!pending.empty())
+				{
+					const ProfilingMgr::node* parent = pending.back();
+					pending.pop_back();
+
+					for (const ProfilingMgr::node* child = parent->first_child(); child; child = child->next_sibling())
+					{
+						hotspot_row row = {};
+						row.m_node = child;
+						row.m_scopeIndex = child->m_scopeIndex;
+						row.m_thread = thread;
+						m_hotspots.push_back(row);
+						pending.push_back(child);
+					}
+				}
+			}
+		}
+
+		// Updates the stats of the rows from their nodes, without walking the trees.
+		void ImGuiFormatter::refresh_hotspots()
+		{
+			for (hotspot_row& row : m_hotspots)
+			{
+				const ProfilingMgr::node_history& history = row.m_node->m_history;
+				row.m_callCount = history.call_count(0);
+				row.m_totalCycles = history.total_cycles(0);
+				row.m_selfCycles = history.self_cycles(0);
+				row.m_maxCycles = history.max_cycles(0);
+				row.m_averageCycles = row.m_callCount == 0 ? 0 : row.m_totalCycles / row.m_callCount;
+
+				unsigned long long parentCycles = row.m_node->m_parent->m_history.total_cycles(0);
+				row.m_parentPercentage = parentCycles == 0 ? 100.0f : 100.0f * static_cast<float>(row.m_totalCycles) / parentCycles;
+			}
+		}
+
+		// Rebuilds the rows of the hot spots table from the stats per scope of every thread.
+		void ImGuiFormatter::collect_scope_hotspots()
+		{
+			m_hotspots.clear();
+
+			for (ProfilingMgr::thread_data* thread = ProfilingMgr::get_instance().get_thread_list(); thread; thread = thread->m_next)
+			{
+				unsigned scopeCount = ProfilingMgr::get_instance().get_scope_count();
+				for (unsigned scopeIndex = 0; scopeIndex < scopeCount; ++scopeIndex)
+				{
+					const ProfilingMgr::scope_stats* lastFrame = thread->get_scope_stats(scopeIndex);
+					if (lastFrame == nullptr)
+						continue;
+
+					// Copied once, the thread may be rolling its next frame into it
+					const ProfilingMgr::scope_stats scope = *lastFrame;
+					if (scope.m_callCount == 0)
+						continue;
+
+					hotspot_row row = {};
+					row.m_scopeIndex = scopeIndex;
+					row.m_thread = thread;
+					row.m_callCount = scope.m_callCount;
+					row.m_totalCycles = scope.m_totalCycles;
+					row.m_selfCycles = scope.m_selfCycles;
+					row.m_maxCycles = scope.m_maxCycles;
+					row.m_averageCycles = scope.m_totalCycles / scope.m_callCount;
+					m_hotspots.push_back(row);
+				}
+			}
+		}
+
+		// Name of the scope of a row of the hot spots table.
+		const char* ImGuiFormatter::hotspot_name(const hotspot_row& row)
+		{
+			return row.m_node ? row.m_node->m_id : ProfilingMgr::get_instance().get_scope(row.m_scopeIndex)->m_name;
+		}
+
+		void ImGuiFormatter::sort_hotspots(const ImGuiTableSortSpecs* sortSpecs)
+		{
+			auto compare = [sortSpecs](const hotspot_row& a, const hotspot_row& b)
+			{
+				for (int i = 0; i < sortSpecs->SpecsCount; ++i)
+				{
+					const ImGuiTableColumnSortSpecs& spec = sortSpecs->Specs[i];
+					int order = 0;
+					switch (spec.ColumnUserID)
+					{
+					case HOTSPOT_SCOPE:		order = std::strcmp(hotspot_name(a), hotspot_name(b)); break;
+					case HOTSPOT_THREAD:	order = (a.m_thread->m_index > b.m_thread->m_index) - (a.m_thread->m_index < b.m_thread->m_index); break;
+					case HOTSPOT_CALLS:		order = (a.m_callCount > b.m_callCount) - (a.m_callCount < b.m_callCount); break;
+					case HOTSPOT_TOTAL:		order = (a.m_totalCycles > b.m_totalCycles) - (a.m_totalCycles < b.m_totalCycles); break;
+					case HOTSPOT_SELF:		order = (a.m_selfCycles > b.m_selfCycles) - (a.m_selfCycles < b.m_selfCycles); break;
+					case HOTSPOT_AVERAGE:	order = (a.m_averageCycles > b.m_averageCycles) - (a.m_averageCycles < b.m_averageCycles); break;
+					case HOTSPOT_MAX:		order = (a.m_maxCycles > b.m_maxCycles) - (a.m_maxCycles < b.m_maxCycles); break;
+					case HOTSPOT_PARENT:	order = (a.m_parentPercentage > b.m_parentPercentage) - (a.m_parentPercentage < b.m_parentPercentage); break;
+					}
+
+					if (order != 0)
+						return spec.SortDirection == ImGuiSortDirection_Ascending ? order < 0 : order > 0;
+				}
+
+				// Keep the order of equal rows stable across refreshes
+				if (a.m_node != b.m_node)
+					return a.m_node < b.m_node;
+				return a.m_scopeIndex != b.m_scopeIndex ? a.m_scopeIndex < b.m_scopeIndex : a.m_thread->m_index < b.m_thread->m_index;
+			};
+
+			std::sort(m_hotspots.begin(), m_hotspots.end(), compare);
+		}
+
+		// Creates the canvas of a view and applies the zoom (mouse wheel) and pan (dragging) to it.
+		// Double clicking resets the view.
+		void ImGuiFormatter::begin_view(const char* id, view_state& view)
+		{
+			ImVec2 available = ImGui::GetContentRegionAvail();
+			m_canvasX = ImGui::GetCursorScreenPos().x;
+			m_canvasWidth = std::max(available.x, 1.0f);
+
+			// The button captures the mouse, so that dragging doesn't move the window
+			ImGui::InvisibleButton(id, ImVec2(m_canvasWidth, std::max(view.m_height, 1.0f)));
+
+			ImGuiIO& io = ImGui::GetIO();
+			if (ImGui::IsItemHovered() && io.MouseWheel != 0.0f)
+			{
+				// Keep the position under the mouse in place
+				double mouse = (io.MousePos.x - m_canvasX) / m_canvasWidth;
+				double position = view.m_offset + mouse / view.m_zoom;
+				view.m_zoom = std::clamp(view.m_zoom * std::pow(1.25, static_cast<double>(io.MouseWheel)), 1.0, MAX_ZOOM);
+				view.m_offset = position - mouse / view.m_zoom;
+			}
+			if (ImGui::IsItemActive() && ImGui::IsMouseDragging(ImGuiMouseButton_Left))
+				view.m_offset -= io.MouseDelta.x / m_canvasWidth / view.m_zoom;
+			if (ImGui::IsItemHovered() && ImGui::IsMouseDoubleClicked(ImGuiMouseButton_Left))
+				view = view_state();
+
+			view.m_offset = std::clamp(view.m_offset, 0.0, 1.0 - 1.0 / view.m_zoom);
+		}
+
+		// Flame graph of the last frame of every thread, with the same scale for all of them so that they can be
+		// compared. The width of each node is its total time over the last frame.
+		void ImGuiFormatter::draw_flame_graph()
+		{
+			ProfilingMgr& mgr = ProfilingMgr::get_instance();
+
+			// The longest thread takes the full width
+			unsigned long long longestThread = 0;
+			for (ProfilingMgr::thread_data* thread = mgr.get_thread_list(); thread; thread = thread->m_next)
+			{
+				unsigned long long threadCycles = 0;
+				for (const ProfilingMgr::node* child = thread->m_root->first_child(); child; child = child->next_sibling())
+					threadCycles += child->m_history.total_cycles(0);
+				longestThread = std::max(longestThread, threadCycles);
+			}
+
+			if (longestThread == 0)
+			{
+				ImGui::TextUnformatted("Waiting for a complete frame...");
+				return;
+			}
+
+			ImGui::BeginChild("FlameGraph", ImVec2(0.0f, 0.0f), false, ImGuiWindowFlags_NoScrollWithMouse);
+			ImVec2 origin = ImGui::GetCursorScreenPos();
+			begin_view("FlameCanvas", m_flameView);
+
+			ImDrawList* drawList = ImGui::GetWindowDrawList();
+			double pixelsPerTick = m_flameView.m_zoom * m_canvasWidth / static_cast<double>(longestThread);
+			double left = m_canvasX - m_flameView.m_offset * m_flameView.m_zoom * m_canvasWidth;
+			m_hoveredNode = nullptr;
+
+			float top = origin.y;
+			for (ProfilingMgr::thread_data* thread = mgr.get_thread_list(); thread; thread = thread->m_next)
+			{
+				char label[64];
+				drawList->AddText(ImVec2(origin.x, top), ImGui::GetColorU32(ImGuiCol_Text), thread_label(*thread, label, sizeof(label)));
+				top += ImGui::GetTextLineHeightWithSpacing();
+
+				double x = left;
+				unsigned depthCount = 0;
+				for (const ProfilingMgr::node* child = thread->m_root->first_child(); child; child = child->next_sibling())
+				{
+					depthCount = std::max(depthCount, draw_flame_node(child, x, pixelsPerTick, 0, top));
+					x += child->m_history.total_cycles(0) * pixelsPerTick;
+				}
+
+				top += depthCount * LANE_HEIGHT + ImGui::GetStyle().ItemSpacing.y;
+			}
+			m_flameView.m_height = top - origin.y;
+
+			if (m_hoveredNode)
+			{
+				const ProfilingMgr::node* hovered = m_hoveredNode;
+				unsigned long long cycles = hovered->m_history.total_cycles(0);
+				unsigned long long parentCycles = hovered->m_parent->m_history.total_cycles(0);
+				ImGui::BeginTooltip();
+				ImGui::TextUnformatted(hovered->m_id);
+				if (hovered->m_scope)
+					ImGui::TextDisabled("%s:%u", hovered->m_scope->m_file, hovered->m_scope->m_line);
+				ImGui::Text("Last frame: %.0f %s in %u calls", report_time(static_cast<double>(cycles)), TIME_UNIT, hovered->m_history.call_count(0));
+				ImGui::Text("Self: %.0f %s", report_time(static_cast<double>(hovered->m_history.self_cycles(0))), TIME_UNIT);
+				if (parentCycles > 0)
+					ImGui::Text("%.1f%% of parent", 100.0 * cycles / parentCycles);
+				ImGui::EndTooltip();
+			}
+
+			ImGui::EndChild();
+		}
+
+		// Draws a node of the flame graph and its children, left-aligned at x. Returns the depth of the deepest
+		// node drawn. Sets m_hoveredNode if the mouse is over one of them.
+		unsigned ImGuiFormatter::draw_flame_node(const ProfilingMgr::node* nodeToDraw, double x, double pixelsPerTick, unsigned depth, float top)
+		{
+			double width = nodeToDraw->m_history.total_cycles(0) * pixelsPerTick;
+
+			// Neither the node nor its children can be seen
+			if (width < 1.0)
+				return depth;
+
+			// Off-screen nodes are still traversed, so that the height of the graph doesn't change while panning
+			ImDrawList* drawList = ImGui::GetWindowDrawList();
+			ImVec2 clipMin = drawList->GetClipRectMin();
+			ImVec2 clipMax = drawList->GetClipRectMax();
+			float y = top + depth * LANE_HEIGHT;
+			if (x <= clipMax.x && x + width >= clipMin.x && y <= clipMax.y && y + LANE_HEIGHT >= clipMin.y)
+			{
+				float x0 = static_cast<float>(std::max(x, static_cast<double>(clipMin.x)));
+				float x1 = static_cast<float>(std::min(x + width, static_cast<double>(clipMax.x)));
+				draw_span(drawList, x0, x1, y, scope_color(nodeToDraw->m_scopeIndex), nodeToDraw->m_id);
+
+				ImVec2 mouse = ImGui::GetIO().MousePos;
+				if (ImGui::IsItemHovered() && mouse.x >= x0 && mouse.x < x1 && mouse.y >= y && mouse.y < y + LANE_HEIGHT)
+					m_hoveredNode = nodeToDraw;
+			}
+
+			unsigned deepest = depth + 1;
+			for (const ProfilingMgr::node* child = nodeToDraw->first_child(); child; child = child->next_sibling())
+			{
+				deepest = std::max(deepest, draw_flame_node(child, x, pixelsPerTick, depth + 1, top));
+				x += child->m_history.total_cycles(0) * pixelsPerTick;
+			}
+			return deepest;
+		}
+
+		// Timeline of the last complete frame, one track per thread and one lane per depth.
+		void ImGuiFormatter::draw_timeline()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_frameMutex);
+				if (m_shownVersion != m_readyVersion)
+				{
+					std::swap(m_shownFrame, m_readyFrame);
+					m_shownVersion = m_readyVersion;
+				}
+			}
+
+			if (m_shownFrame.m_end == 0)
+			{
+				ImGui::TextUnformatted("Waiting for a complete frame...");
+				return;
+			}
+
+			double frameTicks = static_cast<double>(m_shownFrame.m_end - m_shownFrame.m_start);
+			ImGui::Text("Frame: %.3f ms | Mouse wheel to zoom, drag to pan, double click to reset", Clock::to_ms(m_shownFrame.m_end - m_shownFrame.m_start));
+
+			ImGui::BeginChild("Timeline", ImVec2(0.0f, 0.0f), false, ImGuiWindowFlags_NoScrollWithMouse);
+			ImVec2 origin = ImGui::GetCursorScreenPos();
+			begin_view("TimelineCanvas", m_timelineView);
+
+			// Screen position of the frame start, and scale
+			double left = m_canvasX - m_timelineView.m_offset * m_timelineView.m_zoom * m_canvasWidth;
+			double pixelsPerTick = m_timelineView.m_zoom * m_canvasWidth / frameTicks;
+			double frameStart = static_cast<double>(m_shownFrame.m_start);
+			auto ticksToScreen = [=](unsigned long long time)
+			{
+				return static_cast<float>(left + (static_cast<double>(time) - frameStart) * pixelsPerTick);
+			};
+			auto screenToTicks = [=](float x)
+			{
+				double time = frameStart + (x - left) / pixelsPerTick;
+				return time <= 0.0 ? 0ull : static_cast<unsigned long long>(time);
+			};
+
+			ImDrawList* drawList = ImGui::GetWindowDrawList();
+			ImVec2 clipMin = drawList->GetClipRectMin();
+			ImVec2 clipMax = drawList->GetClipRectMax();
+			ImVec2 mouse = ImGui::GetIO().MousePos;
+			bool canvasHovered = ImGui::IsItemHovered();
+			ProfilingMgr& mgr = ProfilingMgr::get_instance();
+			const span* hovered = nullptr;
+
+			float top = origin.y;
+			for (const thread_spans& thread : m_shownFrame.m_threads)
+			{
+				char label[64];
+				drawList->AddText(ImVec2(origin.x, top), ImGui::GetColorU32(ImGuiCol_Text), thread_label(*thread.m_thread, label, sizeof(label)));
+				top += ImGui::GetTextLineHeightWithSpacing();
+
+				// Whole track scrolled out of sight
+				float bottom = top + thread.m_depthCount * LANE_HEIGHT;
+				if (bottom < clipMin.y || top > clipMax.y)
+				{
+					top = bottom + ImGui::GetStyle().ItemSpacing.y;
+					continue;
+				}
+
+				for (unsigned depth = 0; depth < thread.m_depthCount; ++depth)
+				{
+					float y = top + depth * LANE_HEIGHT;
+					if (y + LANE_HEIGHT < clipMin.y || y > clipMax.y)
+						continue;
+
+					// The spans of a depth are sorted and don't overlap, so the visible ones are found with binary
+					// searches. After a sub-pixel span, the rest of its pixel is skipped the same way, so the cost
+					// depends on the visible pixels rather than on the amount of spans.
+					const span* first = thread.m_spans.data() + thread.m_depthStarts[depth];
+					const span* last = thread.m_spans.data() + thread.m_depthStarts[depth + 1];
+					auto endsBefore = [](const span& s, unsigned long long time) { return s.m_end <= time; };
+					const span* it = std::lower_bound(first, last, screenToTicks(clipMin.x), endsBefore);
+					unsigned long long visibleEnd = screenToTicks(clipMax.x);
+
+					while (it != last && it->m_start < visibleEnd)
+					{
+						float x0 = std::max(ticksToScreen(it->m_start), clipMin.x);
+						float x1 = std::min(ticksToScreen(it->m_end), clipMax.x);
+						const span* drawn = it;
+
+						if (x1 - x0 < 1.0f)
+						{
+							// Mark the pixel, then jump to the first span that ends after it
+							x1 = x0 + 1.0f;
+							drawList->AddRectFilled(ImVec2(x0, y), ImVec2(x1, y + LANE_HEIGHT - 1.0f), scope_color(it->m_scope));
+							it = std::lower_bound(it + 1, last, screenToTicks(x1), endsBefore);
+						}
+						else
+						{
+							draw_span(drawList, x0, x1, y, scope_color(it->m_scope), mgr.get_scope(it->m_scope)->m_name);
+							++it;
+						}
+
+						if (canvasHovered && mouse.x >= x0 && mouse.x < x1 && mouse.y >= y && mouse.y < y + LANE_HEIGHT)
+							hovered = drawn;
+					}
+				}
+
+				top = bottom + ImGui::GetStyle().ItemSpacing.y;
+			}
+			m_timelineView.m_height = top - origin.y;
+
+			if (hovered)
+			{
+				const scope_descriptor* scope = mgr.get_scope(hovered->m_scope);
+				ImGui::BeginTooltip();
+				ImGui::TextUnformatted(scope->m_name);
+				ImGui::TextDisabled("%s:%u", scope->m_file, scope->m_line);
+				ImGui::Text("Duration: %.0f %s", report_time(static_cast<double>(hovered->m_end - hovered->m_start)), TIME_UNIT);
+				if (hovered->m_start >= m_shownFrame.m_start)
+					ImGui::Text("Start: %.3f ms into the frame", Clock::to_ms(hovered->m_start - m_shownFrame.m_start));
+				else
+					ImGui::TextUnformatted("Started before the frame");
+				ImGui::EndTooltip();
+			}
+
+			ImGui::EndChild();
+		}
+
+		void ImGuiFormatter::dump_node(ProfilingMgr::node* nodeToDump)
+		{
+			if (nodeToDump == nullptr)
+				return;
+
+			if (ImGui::CollapsingHeader(nodeToDump->m_id))
+			{
+				ImGui::Text("Call count: %u", nodeToDump->m_stats.m_callCount);
+				ImGui::Text("Total %s: %.0f", TIME_UNIT, report_time(static_cast<double>(nodeToDump->m_stats.m_totalCycles)));
+				unsigned long long average = nodeToDump->m_stats.m_callCount == 0 ? 0 : nodeToDump->m_stats.m_totalCycles / static_cast<unsigned long long>(nodeToDump->m_stats.m_callCount);
+				ImGui::Text("Avg %s per call: %.0f", TIME_UNIT, report_time(static_cast<double>(average)));
+				ImGui::Text("Max %s: %.0f", TIME_UNIT, report_time(static_cast<double>(nodeToDump->m_stats.m_maxCycles)));
+				ImGui::Text("Min %s: %.0f", TIME_UNIT, nodeToDump->m_stats.m_callCount == 0 ? 0.0 : report_time(static_cast<double>(nodeToDump->m_stats.m_minCycles)));
+				float percentage = nodeToDump->m_parent->m_stats.m_totalCycles == 0 ? 100.0f : (100.0f * static_cast<float>(nodeToDump->m_stats.m_totalCycles) / nodeToDump->m_parent->m_stats.m_totalCycles);
+				ImGui::Text("%% with respect to parent: %f", percentage);
+
+				if (m_threadSamples > 0)
+				{
+					unsigned long long totalHits = subtree_hits(nodeToDump);
+					ImGui::Text("Samples: self %llu (%.1f%%) | total %llu (%.1f%%)", nodeToDump->m_sampleHits, 100.0 * nodeToDump->m_sampleHits / m_threadSamples,
+								totalHits, 100.0 * totalHits / m_threadSamples);
+				}
+
+				// The samples are written in a circular way, so once full the oldest one is the next to be overwritten
+				unsigned sampleCount = nodeToDump->m_stats.m_sampleCount;
+				int valuesCount = static_cast<int>(std::clamp(sampleCount, 1u, CALLS_RECORDED));
+				int offset = sampleCount > CALLS_RECORDED ? static_cast<int>(sampleCount % CALLS_RECORDED) : 0;
+				auto callTime = [](void* data, int idx)
+				{
+					return static_cast<float>(report_time(static_cast<const float*>(data)[idx]));
+				};
+				ImGui::PlotLines("Time of previous calls", callTime, nodeToDump->m_stats.m_previousCycles, valuesCount, offset);
+
+				ProfilingMgr::history_summary history = nodeToDump->m_history.summarize();
+				ImGui::Text("Last %u frames: mean %.0f | p50 %.0f | p95 %.0f | p99 %.0f | max %.0f %s", history.m_frames,
+							report_time(history.m_meanCycles), report_time(static_cast<double>(history.m_p50Cycles)),
+							report_time(static_cast<double>(history.m_p95Cycles)), report_time(static_cast<double>(history.m_p99Cycles)),
+							report_time(static_cast<double>(history.m_maxCycles)), TIME_UNIT);
+				ImGui::Text("Slowest call: %.0f %s | Mean calls per frame: %.2f", report_time(static_cast<double>(history.m_maxCallCycles)), TIME_UNIT, history.m_meanCalls);
+
+				// Time not spent in the children. Each call of a child also adds the overhead of the profiler to it.
+				unsigned long long lastSelf = nodeToDump->m_history.self_cycles(0);
+				unsigned long long lastTotal = nodeToDump->m_history.total_cycles(0);
+				ImGui::Text("Self (last frame): %.0f %s | In children: %.0f %s | Child calls: %u | Mean self: %.0f %s",
+							report_time(static_cast<double>(lastSelf)), TIME_UNIT, report_time(static_cast<double>(lastTotal - std::min(lastSelf, lastTotal))), TIME_UNIT,
+							nodeToDump->m_history.child_calls(0), report_time(history.m_meanSelfCycles), TIME_UNIT);
+				if (nodeToDump->m_history.alloc_count(0) > 0)
+					ImGui::Text("Allocations (last frame): %u (%llu bytes)", nodeToDump->m_history.alloc_count(0), nodeToDump->m_history.alloc_bytes(0));
+
+				// Oldest frame on the left
+				const ProfilingMgr::node_history& frames = nodeToDump->m_history;
+				auto frameTime = [](void* data, int idx)
+				{
+					const ProfilingMgr::node_history* history = static_cast<const ProfilingMgr::node_history*>(data);
+					return static_cast<float>(report_time(static_cast<double>(history->total_cycles(history->size() - 1 - idx))));
+				};
+				ImGui::PlotLines("Time of previous frames", frameTime, const_cast<ProfilingMgr::node_history*>(&frames), static_cast<int>(frames.size()));
+				ImGui::Separator();
+			}
+
+			ProfilingMgr::node* sibTraverser = nodeToDump->first_child();
+			while (sibTraverser)
+			{
+				ImGui::Indent(30.0f);
+				dump_node(sibTraverser);
+				sibTraverser = sibTraverser->next_sibling();
+				ImGui::Unindent(30.0f);
+			}
+		}
+#endif
+
+
+#if CAPTURE_OUTPUT || SERVER_OUTPUT
+		// Forgets everything written so far, for a new stream.
+		void RecordEncoder::reset()
+		{
+			m_writtenScopes.clear();
+			m_writtenChannels.clear();
+			m_threads.clear();
+		}
+
+		void RecordEncoder::write_varint(std::vector<unsigned char>& out, unsigned long long value)
+		{
+			while (value >= 0x80)
+			{
+				out.push_back(static_cast<unsigned char>(value | 0x80));
+				value >>= 7;
+			}
+			out.push_back(static_cast<unsigned char>(value));
+		}
+
+		// Zigzag encoding, so that small negative values stay short.
+		void RecordEncoder::write_zigzag(std::vector<unsigned char>& out, long long value)
+		{
+			write_varint(out, (static_cast<unsigned long long>(value) << 1) ^ static_cast<unsigned long long>(value >> 63));
+		}
+
+		void RecordEncoder::write_bytes(std::vector<unsigned char>& out, const void* bytes, size_t size)
+		{
+			const unsigned char* begin = static_cast<const unsigned char*>(bytes);
+			out.insert(out.end(), begin, begin + size);
+		}
+
+		// Writes the 'T' record of a thread the first time it is seen.
+		void RecordEncoder::write_thread(std::vector<unsigned char>& out, const ProfilingMgr::thread_data& thread)
+		{
+			if (!m_threads.emplace(&thread, 0).second)
+				return;
+
+			size_t nameLength = thread.m_name ? std::strlen(thread.m_name) : 0;
+			out.push_back('T');
+			write_varint(out, thread.m_index);
+			write_varint(out, nameLength);
+			write_bytes(out, thread.m_name, nameLength);
+		}
+
+		// Writes the 'S' record of a scope index the first time it is seen.
+		void RecordEncoder::write_scope(std::vector<unsigned char>& out, unsigned scopeIndex)
+		{
+			if (scopeIndex < m_writtenScopes.size() && m_writtenScopes[scopeIndex])
+				return;
+
+			if (scopeIndex >= m_writtenScopes.size())
+				m_writtenScopes.resize(scopeIndex + 1, false);
+			m_writtenScopes[scopeIndex] = true;
+
+			const scope_descriptor* scope = ProfilingMgr::get_instance().get_scope(scopeIndex);
+			size_t nameLength = std::strlen(scope->m_name);
+			size_t fileLength = std::strlen(scope->m_file);
+			out.push_back('S');
+			write_varint(out, scopeIndex);
+			write_varint(out, nameLength);
+			write_bytes(out, scope->m_name, nameLength);
+			write_varint(out, fileLength);
+			write_bytes(out, scope->m_file, fileLength);
+			write_varint(out, scope->m_line);
+		}
+
+		// Writes the 'C' record of a channel index the first time it is seen.
+		void RecordEncoder::write_channel(std::vector<unsigned char>& out, unsigned channelIndex)
+		{
+			if (channelIndex < m_writtenChannels.size() && m_writtenChannels[channelIndex])
+				return;
+
+			if (channelIndex >= m_writtenChannels.size())
+				m_writtenChannels.resize(channelIndex + 1, false);
+			m_writtenChannels[channelIndex] = true;
+
+			const channel_descriptor* channel = ProfilingMgr::get_instance().get_channel(channelIndex);
+			size_t nameLength = std::strlen(channel->m_name);
+			out.push_back('C');
+			write_varint(out, channelIndex);
+			write_varint(out, static_cast<unsigned>(channel->m_kind));
+			write_varint(out, nameLength);
+			write_bytes(out, channel->m_name, nameLength);
+		}
+
+		// Writes the 'E' record of a chunk of events of a thread, preceded by the records of the thread, scopes and
+		// channels it uses that weren't written yet. Returns the position of the 'E' record in the buffer.
+		size_t RecordEncoder::write_events(std::vector<unsigned char>& out, const ProfilingMgr::thread_data& thread, const ProfilingMgr::event* events, unsigned count)
+		{
+			// The thread, scopes and channels must appear in the stream before the events that use them
+			write_thread(out, thread);
+			for (unsigned i = 0; i < count; ++i)
+			{
+				if (events[i].is_enter())
+					write_scope(out, events[i].m_scope);
+				else if (events[i].is_channel())
+					write_channel(out, events[i].m_scope);
+			}
+
+			size_t recordPosition = out.size();
+			out.push_back('E');
+			write_varint(out, thread.m_index);
+			write_varint(out, count);
+
+			unsigned long long& lastTime = m_threads[&thread];
+			for (unsigned i = 0; i < count; ++i)
+			{
+				const ProfilingMgr::event& e = events[i];
+				if (e.is_channel())
+				{
+					write_varint(out, 3);
+					write_varint(out, e.m_scope);
+					write_zigzag(out, e.channel_value());
+					continue;
+				}
+
+				unsigned long long delta = e.m_time > lastTime ? e.m_time - lastTime : 0;
+				lastTime = e.m_time > lastTime ? e.m_time : lastTime;
+
+				if (e.is_enter())
+				{
+					write_varint(out, delta << 2);
+					write_varint(out, e.m_scope);
+				}
+				else if (e.is_exit())
+				{
+					write_varint(out, delta << 2 | 1);
+				}
+				else
+				{
+					write_varint(out, delta << 2 | 2);
+				}
+			}
+			return recordPosition;
+		}
+#endif
+
+
+#if CAPTURE_OUTPUT
+		CaptureFormatter::~CaptureFormatter()
+		{
+			stop_capture();
+		}
+
+		// Opens the file and starts receiving events. Returns false if the file couldn't be opened or a capture
+		// is already running.
+		bool CaptureFormatter::start_capture(const char* filePath)
+		{
+			if (m_file)
+				return false;
+
+#ifdef _MSC_VER
+			// fopen is deprecated under /sdl, fopen_s leaves m_file null on failure
+			fopen_s(&m_file, filePath, "wb");
+#else
+			m_file = std::fopen(filePath, "wb");
+#endif
+			if (m_file == nullptr)
+				return false;
+
+			m_fileOffset = 0;
+			m_buffer.clear();
+			m_encoder.reset();
+			m_frames.clear();
+			m_lastFrameTime = 0;
+
+			// Header
+			double ticksPerSecond = Clock::ticks_per_second();
+			unsigned long long frequencyBits;
+			std::memcpy(&frequencyBits, &ticksPerSecond, sizeof(frequencyBits));
+			RecordEncoder::write_bytes(m_buffer, "PRFC", 4);
+			for (unsigned i = 0; i < 4; ++i)
+				m_buffer.push_back(static_cast<unsigned char>(VERSION >> (8 * i)));
+			for (unsigned i = 0; i < 8; ++i)
+				m_buffer.push_back(static_cast<unsigned char>(frequencyBits >> (8 * i)));
+
+			ProfilingMgr::get_instance().add_event_sink(this);
+			return true;
+		}
+
+		// Stops receiving events, writes the frame index and closes the file.
+		void CaptureFormatter::stop_capture()
+		{
+			if (m_file == nullptr)
+				return;
+
+			// Receives the last events and flushes them
+			ProfilingMgr::get_instance().remove_event_sink(this);
+
+			unsigned long long indexOffset = m_fileOffset + m_buffer.size();
+			m_buffer.push_back('I');
+			RecordEncoder::write_varint(m_buffer, m_frames.size());
+			for (const frame_entry& frame : m_frames)
+			{
+				RecordEncoder::write_varint(m_buffer, frame.m_offset);
+				RecordEncoder::write_varint(m_buffer, frame.m_time);
+			}
+
+			for (unsigned i = 0; i < 8; ++i)
+				m_buffer.push_back(static_cast<unsigned char>(indexOffset >> (8 * i)));
+			RecordEncoder::write_bytes(m_buffer, "PRFE", 4);
+
+			on_flush();
+			std::fclose(m_file);
+			m_file = nullptr;
+		}
+
+		bool CaptureFormatter::is_capturing() const
+		{
+			return m_file != nullptr;
+		}
+
+		void CaptureFormatter::on_events(const ProfilingMgr::thread_data& thread, const ProfilingMgr::event* events, unsigned count)
+		{
+			unsigned long long recordOffset = m_fileOffset + m_encoder.write_events(m_buffer, thread, events, count);
+
+			// The frame index points at the records holding the frame starts
+			for (unsigned i = 0; i < count; ++i)
+			{
+				const ProfilingMgr::event& e = events[i];
+				if (!e.is_frame())
+					continue;
+
+				frame_entry frame;
+				frame.m_offset = recordOffset;
+				frame.m_time = m_frames.empty() ? e.m_time : e.m_time - m_lastFrameTime;
+				m_frames.push_back(frame);
+				m_lastFrameTime = e.m_time;
+			}
+		}
+
+		void CaptureFormatter::on_flush()
+		{
+			if (m_file == nullptr || m_buffer.empty())
+				return;
+
+			std::fwrite(m_buffer.data(), 1, m_buffer.size(), m_file);
+			m_fileOffset += m_buffer.size();
+			m_buffer.clear();
+		}
+
+		// Instance used by the START_CAPTURE/STOP_CAPTURE macros.
+		CaptureFormatter& CaptureFormatter::get_instance()
+		{
+			static CaptureFormatter instance;
+			return instance;
+		}
+#endif
+
+
+#if TRACE_OUTPUT
+		TraceFormatter::~TraceFormatter()
+		{
+			stop_trace();
+		}
+
+		// Opens the file and starts receiving events. Returns false if the file couldn't be opened or a trace
+		// is already running.
+		bool TraceFormatter::start_trace(const char* filePath)
+		{
+			if (m_file)
+				return false;
+
+#ifdef _MSC_VER
+			fopen_s(&m_file, filePath, "wb");
+#else
+			m_file = std::fopen(filePath, "wb");
+#endif
+			if (m_file == nullptr)
+				return false;
+
+			m_used = 0;
+			m_firstEvent = true;
+			m_startTime = Clock::now();
+			m_depths.clear();
+			m_frameCount = 0;
+			m_lastFrameTime = m_startTime;
+
+			const char* header = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+			std::fputs(header, m_file);
+
+			ProfilingMgr::get_instance().add_event_sink(this);
+			return true;
+		}
+
+		// Stops receiving events, closes the JSON array and the file.
+		void TraceFormatter::stop_trace()
+		{
+			if (m_file == nullptr)
+				return;
+
+			// Receives the last events and flushes them
+			ProfilingMgr::get_instance().remove_event_sink(this);
+
+			flush_buffer();
+			std::fputs("\n]}\n", m_file);
+			std::fclose(m_file);
+			m_file = nullptr;
+		}
+
+		bool TraceFormatter::is_tracing() const
+		{
+			return m_file != nullptr;
+		}
+
+		void TraceFormatter::on_events(const ProfilingMgr::thread_data& thread, const ProfilingMgr::event* events, unsigned count)
+		{
+			// First time this thread is seen, name its track
+			auto depthIt = m_depths.find(&thread);
+			if (depthIt == m_depths.end())
+			{
+				depthIt = m_depths.emplace(&thread, 0u).first;
+
+				char name[64];
+				if (thread.m_name)
+					snprintf(name, sizeof(name), "%s", thread.m_name);
+				else
+					snprintf(name, sizeof(name), "Thread %u", thread.m_index);
+
+				std::string args = "\"args\":{\"name\":\"";
+				for (const char* c = name; *c; ++c)
+				{
+					if (*c == '"' || *c == '\\')
+						args += '\\';
+					args += *c;
+				}
+				args += "\"},";
+				write_event("M", "thread_name", thread.m_index, m_startTime, args.c_str());
+			}
+
+			unsigned& depth = depthIt->second;
+			for (unsigned i = 0; i < count; ++i)
+			{
+				const ProfilingMgr::event& e = events[i];
+				if (e.is_enter())
+				{
+					write_event("B", ProfilingMgr::get_instance().get_scope(e.m_scope)->m_name, thread.m_index, e.m_time);
+					depth++;
+				}
+				else if (e.is_exit())
+				{
+					// Scopes entered before the trace started have no begin event
+					if (depth == 0)
+						continue;
+
+					write_event("E", nullptr, thread.m_index, e.m_time);
+					depth--;
+				}
+				else if (e.is_frame())
+				{
+					char name[32];
+					snprintf(name, sizeof(name), "Frame %u", m_frameCount++);
+					write_event("i", name, thread.m_index, e.m_time, "\"s\":\"g\",");
+					m_lastFrameTime = e.m_time;
+				}
+				else
+				{
+					// Counter track with the value of the frame that ended at the last frame start
+					char args[64];
+					snprintf(args, sizeof(args), "\"args\":{\"value\":%lld},", e.channel_value());
+					write_event("C", ProfilingMgr::get_instance().get_channel(e.m_scope)->m_name, thread.m_index, m_lastFrameTime, args);
+				}
+			}
+		}
+
+		void TraceFormatter::on_flush()
+		{
+			flush_buffer();
+		}
+
+		// Instance used by the START_TRACE/STOP_TRACE macros.
+		TraceFormatter& TraceFormatter::get_instance()
+		{
+			static TraceFormatter instance;
+			return instance;
+		}
+
+		// Formats one trace event into the buffer, flushing it first if the event might not fit.
+		void TraceFormatter::write_event(const char* phase, const char* name, unsigned thread, unsigned long long time, const char* extra)
+		{
+			// Worst case of the fixed part of an event (the name is flushed separately if needed)
+			const unsigned maxFixedSize = 256;
+			if (m_used + maxFixedSize > BUFFER_SIZE)
+				flush_buffer();
+
+			if (!m_firstEvent)
+				m_buffer[m_used++] = ',';
+			m_firstEvent = false;
+
+			double microseconds = time > m_startTime ? Clock::to_ns(time - m_startTime) * 1e-3 : 0.0;
+			m_used += snprintf(m_buffer + m_used, BUFFER_SIZE - m_used, "{\"ph\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,%s",
+							   phase, thread, microseconds, extra);
+
+			if (name)
+			{
+				write_raw("\"name\":\"");
+				write_escaped(name);
+				write_raw("\"");
+			}
+			else
+			{
+				m_used--;	// Remove the trailing comma
+			}
+
+			write_raw("}");
+		}
+
+		// Copies a string into the buffer as the contents of a JSON string.
+		void TraceFormatter::write_escaped(const char* text)
+		{
+			for (; *text; ++text)
+			{
+				// Room for the longest escape sequence
+				if (m_used + 6 > BUFFER_SIZE)
+					flush_buffer();
+
+				unsigned char c = static_cast<unsigned char>(*text);
+				if (c == '"' || c == '\\')
+				{
+					m_buffer[m_used++] = '\\';
+					m_buffer[m_used++] = static_cast<char>(c);
+				}
+				else if (c < 0x20)
+				{
+					m_used += snprintf(m_buffer + m_used, BUFFER_SIZE - m_used, "\\u%04x", c);
+				}
+				else
+				{
+					m_buffer[m_used++] = static_cast<char>(c);
+				}
+			}
+		}
+
+		// Copies JSON text into the buffer as it is.
+		void TraceFormatter::write_raw(const char* text)
+		{
+			size_t length = std::strlen(text);
+			if (m_used + length > BUFFER_SIZE)
+				flush_buffer();
+
+			std::memcpy(m_buffer + m_used, text, length);
+			m_used += static_cast<unsigned>(length);
+		}
+
+		void TraceFormatter::flush_buffer()
+		{
+			if (m_file && m_used > 0)
+				std::fwrite(m_buffer, 1, m_used, m_file);
+			m_used = 0;
+		}
+#endif
+
+
+#if HITCH_OUTPUT
+		namespace
+		{
+			// Writes a string as a JSON string, quotes included.
+			void write_json_string(std::FILE* file, const char* text)
+			{
+				std::fputc('"', file);
+				for (; *text; ++text)
+				{
+					unsigned char c = static_cast<unsigned char>(*text);
+					if (c == '"' || c == '\\')
+						std::fprintf(file, "\\%c", c);
+					else if (c < 0x20)
+						std::fprintf(file, "\\u%04x", c);
+					else
+						std::fputc(c, file);
+				}
+				std::fputc('"', file);
+			}
+
+			// Writes the times of count frames as a JSON array.
+			void write_times(std::FILE* file, const unsigned long long* cycles, unsigned count)
+			{
+				std::fputc('[', file);
+				for (unsigned i = 0; i < count; ++i)
+					std::fprintf(file, i == 0 ? "%.0f" : ",%.0f", report_time(static_cast<double>(cycles[i])));
+				std::fputc(']', file);
+			}
+		}
+
+		HitchFormatter::~HitchFormatter()
+		{
+			stop();
+		}
+
+		// Sets the frame budget and starts capturing the frames over it. The files are named filePrefix followed by
+		// the index of the frame and ".json". Returns false if the captures are already armed.
+		bool HitchFormatter::start(double budgetMilliseconds, const char* filePrefix, unsigned framesToKeep)
+		{
+			if (m_armed)
+				return false;
+
+			// The writer reads the frames from the histories after new_frame() returned, so leave it the other half of
+			// the ring buffers to get to them before they are overwritten
+			ProfilingMgr& mgr = ProfilingMgr::get_instance();
+			m_filePrefix = filePrefix;
+			m_framesToKeep = std::max(1u, std::min(framesToKeep, mgr.get_history_length() / 2));
+			m_captureCount = 0;
+			m_nextFrame = 0;
+			m_armed = true;
+
+			m_hasRequest = false;
+			m_stopping = false;
+			m_writer = std::thread(&HitchFormatter::writer_loop, this);
+
+			mgr.set_frame_budget(budgetMilliseconds);
+			mgr.set_budget_listener(this);
+			return true;
+		}
+
+		// Stops capturing, waiting for the file being written (if any).
+		void HitchFormatter::stop()
+		{
+			if (!m_armed)
+				return;
+
+			ProfilingMgr::get_instance().set_budget_listener(nullptr);
+			m_armed = false;
+			{
+				std::lock_guard<std::mutex> lock(m_requestMutex);
+				m_stopping = true;
+			}
+			m_requestSignal.notify_one();
+			m_writer.join();
+		}
+
+		bool HitchFormatter::is_armed() const
+		{
+			return m_armed;
+		}
+
+		// Returns the number of files written (or being written) since start.
+		unsigned HitchFormatter::get_capture_count() const
+		{
+			return m_captureCount;
+		}
+
+		// Only hands the frame to the writer thread, which copies the history itself: nothing here depends on the size
+		// of the trees.
+		void HitchFormatter::on_budget_exceeded(unsigned long long frameIndex, unsigned long long frameCycles, unsigned long long budgetCycles)
+		{
+			if (frameIndex < m_nextFrame || m_writing.load(std::memory_order_acquire))
+				return;
+
+			// The frames of this capture don't trigger another one
+			m_nextFrame = frameIndex + m_framesToKeep;
+			m_captureCount++;
+			m_writing.store(true, std::memory_order_relaxed);
+			{
+				std::lock_guard<std::mutex> lock(m_requestMutex);
+				m_request.m_frameIndex = frameIndex;
+				m_request.m_frameCycles = frameCycles;
+				m_request.m_budgetCycles = budgetCycles;
+				m_hasRequest = true;
+			}
+			m_requestSignal.notify_one();
+		}
+
+		// Instance used by the START_HITCH_CAPTURE/STOP_HITCH_CAPTURE macros.
+		HitchFormatter& HitchFormatter::get_instance()
+		{
+			static HitchFormatter instance;
+			return instance;
+		}
+
+		// Waits for the captures requested by on_budget_exceeded and writes them, until stop(). A capture requested
+		// right before stop() is still written.
+		void HitchFormatter::writer_loop()
+		{
+			while (true)
+			{
+				capture_request request;
+				{
+					std::unique_lock<std::mutex> lock(m_requestMutex);
+					m_requestSignal.wait(lock, [this]() { return m_hasRequest || m_stopping; });
+					if (!m_hasRequest)
+						break;
+					request = m_request;
+					m_hasRequest = false;
+				}
+
+				m_snapshot.m_filePath = m_filePrefix + std::to_string(request.m_frameIndex) + ".json";
+				m_snapshot.m_frameIndex = request.m_frameIndex;
+				m_snapshot.m_frameCycles = request.m_frameCycles;
+				m_snapshot.m_budgetCycles = request.m_budgetCycles;
+
+				// The histories aren't reallocated to a new length while they are copied
+				ProfilingMgr& mgr = ProfilingMgr::get_instance();
+				mgr.begin_history_read();
+				bool copied = copy_history();
+				mgr.end_history_read();
+				if (copied)
+					write_snapshot();
+				m_writing.store(false, std::memory_order_release);
+			}
+		}
+
+		// Copies the frames of the history up to m_snapshot.m_frameIndex into m_snapshot. Returns false if they
+		// already left the ring buffers. Runs on the writer thread.
+		//
+		// The histories keep being pushed while they are read: the frames are found by their index rather than their
+		// age, and each copy is started again if the sequence number of the histories shows a push in the middle of it.
+		// The vectors of m_snapshot are reused from one capture to the next.
+		bool HitchFormatter::copy_history()
+		{
+			ProfilingMgr& mgr = ProfilingMgr::get_instance();
+			const unsigned long long frameIndex = m_snapshot.m_frameIndex;
+
+			// Frame times and channels, pushed together by new_frame()
+			while (true)
+			{
+				unsigned sequence = mgr.get_channel_sequence();
+				if (sequence & 1)
+				{
+					std::this_thread::yield();
+					continue;
+				}
+
+				const ProfilingMgr::channel_history& frameTimes = mgr.get_frame_history();
+				unsigned long long firstAge = mgr.get_sampled_frame() - frameIndex;
+				if (firstAge >= frameTimes.size())
+					return false;
+
+				unsigned age = static_cast<unsigned>(firstAge);
+				m_snapshot.m_frames = std::min(m_framesToKeep, frameTimes.size() - age);
+				m_snapshot.m_frameTimes.clear();
+				for (unsigned i = m_snapshot.m_frames; i-- > 0;)
+					m_snapshot.m_frameTimes.push_back(frameTimes.value(age + i));
+
+				unsigned channelCount = mgr.get_channel_count();
+				m_snapshot.m_channels.resize(channelCount);
+				for (unsigned channelIndex = 0; channelIndex < channelCount; ++channelIndex)
+				{
+					const ProfilingMgr::channel_history& values = mgr.get_channel_history(channelIndex);
+					snapshot_channel& channel = m_snapshot.m_channels[channelIndex];
+					channel.m_name = mgr.get_channel(channelIndex)->m_name;
+					channel.m_values.clear();
+					for (unsigned i = m_snapshot.m_frames; i-- > 0;)
+						channel.m_values.push_back(values.value(age + i));
+				}
+
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (mgr.get_channel_sequence() == sequence)
+					break;
+			}
+
+			// Trees of the threads, each rolled by its own thread. Frame frameIndex is in the first roll stamped after it.
+			size_t threadCount = 0;
+			for (ProfilingMgr::thread_data* thread = mgr.get_thread_list(); thread; thread = thread->m_next)
+			{
+				if (threadCount == m_snapshot.m_threads.size())
+					m_snapshot.m_threads.emplace_back();
+				snapshot_thread& threadSnapshot = m_snapshot.m_threads[threadCount++];
+				threadSnapshot.m_name = thread->m_name ? thread->m_name : "Thread " + std::to_string(thread->m_index);
+
+				while (true)
+				{
+					unsigned sequence = thread->m_rollSequence.load(std::memory_order_acquire);
+					if (sequence & 1)
+					{
+						std::this_thread::yield();
+						continue;
+					}
+
+					const ProfilingMgr::channel_history& rolls = thread->m_rollFrames;
+					unsigned firstAge = 0;
+					while (firstAge + 1 < rolls.size() && static_cast<unsigned long long>(rolls.value(firstAge + 1)) > frameIndex)
+						firstAge++;
+
+					threadSnapshot.m_nodes.clear();
+					threadSnapshot.m_totalCycles.clear();
+					threadSnapshot.m_selfCycles.clear();
+					threadSnapshot.m_callCounts.clear();
+					for (const ProfilingMgr::node* child = thread->m_root->first_child(); child; child = child->next_sibling())
+						copy_node(threadSnapshot, child, 0, firstAge);
+
+					std::atomic_thread_fence(std::memory_order_acquire);
+					if (thread->m_rollSequence.load(std::memory_order_relaxed) == sequence)
+						break;
+				}
+			}
+			m_snapshot.m_threads.resize(threadCount);
+			return true;
+		}
+
+		// Copies m_snapshot.m_frames frames of a node and its descendants, from the given age back.
+		void HitchFormatter::copy_node(snapshot_thread& thread, const ProfilingMgr::node* nodeToCopy, unsigned depth, unsigned firstAge)
+		{
+			thread.m_nodes.push_back({ nodeToCopy->m_id, depth });
+			const ProfilingMgr::node_history& history = nodeToCopy->m_history;
+			for (unsigned i = m_snapshot.m_frames; i-- > 0;)
+			{
+				thread.m_totalCycles.push_back(history.total_cycles(firstAge + i));
+				thread.m_selfCycles.push_back(history.self_cycles(firstAge + i));
+				thread.m_callCounts.push_back(history.call_count(firstAge + i));
+			}
+
+			for (const ProfilingMgr::node* child = nodeToCopy->first_child(); child; child = child->next_sibling())
+				copy_node(thread, child, depth + 1, firstAge);
+		}
+
+		// Writes m_snapshot to its file. Runs on the writer thread.
+		void HitchFormatter::write_snapshot() const
+		{
+			std::FILE* file = nullptr;
+#ifdef _MSC_VER
+			fopen_s(&file, m_snapshot.m_filePath.c_str(), "wb");
+#else
+			file = std::fopen(m_snapshot.m_filePath.c_str(), "wb");
+#endif
+			if (file == nullptr)
+				return;
+
+			const snapshot& shot = m_snapshot;
+			std::fprintf(file, "{\n\"Clock\": ");
+			write_json_string(file, Clock::name());
+			std::fprintf(file, ",\n\"Time unit\": \"%s\",\n\"Frame\": %llu,\n\"Frame time\": %.0f,\n\"Budget\": %.0f,\n\"Frames\": %u,\n",
+						 TIME_UNIT, shot.m_frameIndex, report_time(static_cast<double>(shot.m_frameCycles)),
+						 report_time(static_cast<double>(shot.m_budgetCycles)), shot.m_frames);
+
+			// Oldest frame first in every array, so the last value is the frame over budget
+			std::fprintf(file, "\"Frame times\": ");
+			std::fputc('[', file);
+			for (unsigned i = 0; i < shot.m_frames; ++i)
+				std::fprintf(file, i == 0 ? "%.0f" : ",%.0f", report_time(static_cast<double>(shot.m_frameTimes[i])));
+			std::fprintf(file, "],\n\"Threads\": [");
+
+			for (size_t threadIndex = 0; threadIndex < shot.m_threads.size(); ++threadIndex)
+			{
+				const snapshot_thread& thread = shot.m_threads[threadIndex];
+				std::fprintf(file, threadIndex == 0 ? "\n{\"Thread\": " : ",\n{\"Thread\": ");
+				write_json_string(file, thread.m_name.c_str());
+				std::fprintf(file, ", \"Scopes\": [");
+
+				for (size_t nodeIndex = 0; nodeIndex < thread.m_nodes.size(); ++nodeIndex)
+				{
+					size_t first = nodeIndex * shot.m_frames;
+					std::fprintf(file, nodeIndex == 0 ? "\n\t{\"ID\": " : ",\n\t{\"ID\": ");
+					write_json_string(file, thread.m_nodes[nodeIndex].m_name);
+					std::fprintf(file, ", \"Depth\": %u, \"Total time\": ", thread.m_nodes[nodeIndex].m_depth);
+					write_times(file, thread.m_totalCycles.data() + first, shot.m_frames);
+					std::fprintf(file, ", \"Self time\": ");
+					write_times(file, thread.m_selfCycles.data() + first, shot.m_frames);
+					std::fprintf(file, ", \"Call count\": [");
+					for (unsigned i = 0; i < shot.m_frames; ++i)
+						std::fprintf(file, i == 0 ? "%u" : ",%u", thread.m_callCounts[first + i]);
+					std::fprintf(file, "]}");
+				}
+				std::fprintf(file, "]}");
+			}
+
+			std::fprintf(file, "],\n\"Channels\": [");
+			for (size_t channelIndex = 0; channelIndex < shot.m_channels.size(); ++channelIndex)
+			{
+				const snapshot_channel& channel = shot.m_channels[channelIndex];
+				std::fprintf(file, channelIndex == 0 ? "\n{\"Name\": " : ",\n{\"Name\": ");
+				write_json_string(file, channel.m_name);
+				std::fprintf(file, ", \"Values\": [");
+				for (unsigned i = 0; i < shot.m_frames; ++i)
+					std::fprintf(file, i == 0 ? "%lld" : ",%lld", channel.m_values[i]);
+				std::fprintf(file, "]}");
+			}
+			std::fprintf(file, "]\n}\n");
+			std::fclose(file);
+		}
+#endif
+
+
+#if SERVER_OUTPUT
+		namespace
+		{
+			const int POLL_MILLISECONDS = 5;				// Longest wait of the server thread before checking for a new frame
+
+#ifdef _WIN32
+			using native_socket = SOCKET;
+			const int SEND_FLAGS = 0;
+
+			void close_socket(std::uintptr_t socket)
+			{
+				closesocket(static_cast<native_socket>(socket));
+			}
+
+			// Waits until the socket is ready for the given events. Returns a positive value if it is, 0 on timeout and a
+			// negative value on error (including a closed connection).
+			int wait_socket(std::uintptr_t socket, short events)
+			{
+				WSAPOLLFD entry = {};
+				entry.fd = static_cast<native_socket>(socket);
+				entry.events = events;
+				int ready = WSAPoll(&entry, 1, POLL_MILLISECONDS);
+				return ready > 0 && (entry.revents & (POLLERR | POLLNVAL)) ? -1 : ready;
+			}
+#else
+			using native_socket = int;
+#ifdef MSG_NOSIGNAL
+			const int SEND_FLAGS = MSG_NOSIGNAL;			// A viewer that disconnected mustn't kill the application with SIGPIPE
+#else
+			const int SEND_FLAGS = 0;
+#endif
+
+			void close_socket(std::uintptr_t socket)
+			{
+				close(static_cast<native_socket>(socket));
+			}
+
+			// Waits until the socket is ready for the given events. Returns a positive value if it is, 0 on timeout and a
+			// negative value on error (including a closed connection).
+			int wait_socket(std::uintptr_t socket, short events)
+			{
+				pollfd entry = {};
+				entry.fd = static_cast<native_socket>(socket);
+				entry.events = events;
+				int ready = poll(&entry, 1, POLL_MILLISECONDS);
+				return ready > 0 && (entry.revents & (POLLERR | POLLNVAL)) ? -1 : ready;
+			}
+#endif
+		}
+
+		ServerFormatter::~ServerFormatter()
+		{
+			stop();
+		}
+
+		// Starts listening on 127.0.0.1 (0 picks a free port, see get_port). Returns false if the socket couldn't
+		// be opened or the server is already running.
+		bool ServerFormatter::start(unsigned short port)
+		{
+			if (m_running)
+				return false;
+
+			sockaddr_in address = {};
+			address.sin_family = AF_INET;
+			address.sin_port = htons(port);
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			m_socketPath.clear();
+			return listen_on(&address, sizeof(address), AF_INET);
+		}
+
+#ifndef _WIN32
+		// Starts listening on a Unix domain socket created at the given path (replacing a stale socket there).
+		// Returns false if the socket couldn't be opened, another kind of file exists at the path or the server is
+		// already running.
+		bool ServerFormatter::start_local(const char* socketPath)
+		{
+			sockaddr_un address = {};
+			if (m_running || std::strlen(socketPath) >= sizeof(address.sun_path))
+				return false;
+
+			// Only a socket left by a previous run is removed, never a file that happens to have that path
+			struct stat info;
+			if (lstat(socketPath, &info) == 0)
+			{
+				if (!S_ISSOCK(info.st_mode) || unlink(socketPath) != 0)
+					return false;
+			}
+
+			address.sun_family = AF_UNIX;
+			std::strcpy(address.sun_path, socketPath);
+			m_socketPath = socketPath;
+			return listen_on(&address, sizeof(address), AF_UNIX);
+		}
+#endif
+
+		// Disconnects the viewer and stops the background thread.
+		void ServerFormatter::stop()
+		{
+			if (!m_running)
+				return;
+
+			m_running = false;
+			m_thread.join();
+
+			close_socket(m_listenSocket);
+			m_listenSocket = INVALID_HANDLE;
+			m_port = 0;
+#ifdef _WIN32
+			WSACleanup();
+#else
+			if (!m_socketPath.empty())
+				unlink(m_socketPath.c_str());
+#endif
+		}
+
+		bool ServerFormatter::is_running() const
+		{
+			return m_running;
+		}
+
+		// Returns whether a viewer is connected.
+		bool ServerFormatter::has_viewer() const
+		{
+			return m_connected;
+		}
+
+		// Returns the TCP port listened on (0 for a Unix domain socket or when stopped).
+		unsigned short ServerFormatter::get_port() const
+		{
+			return m_port;
+		}
+
+		// Copies the last frame of the trees and the channels for the viewer, if one is connected and wants the
+		// frames. Call once per frame, after PROF_NEW_FRAME().
+		void ServerFormatter::serve_frame()
+		{
+			if (!m_wantsFrames.load(std::memory_order_acquire))
+				return;
+
+			ProfilingMgr& mgr = ProfilingMgr::get_instance();
+			mgr.begin_history_read();
+			m_buildingFrame.m_frameIndex = mgr.get_frame_index();
+
+			// The histories keep being pushed by the threads that own them while they are read, so each copy is started
+			// again if their sequence number shows a push in the middle of it (as in HitchFormatter::copy_history)
+			while (true)
+			{
+				unsigned sequence = mgr.get_channel_sequence();
+				if (sequence & 1)
+				{
+					std::this_thread::yield();
+					continue;
+				}
+
+				m_buildingFrame.m_frameCycles = mgr.get_frame_history().value(0);
+				m_buildingFrame.m_channels.resize(mgr.get_channel_count());
+				for (unsigned channelIndex = 0; channelIndex < m_buildingFrame.m_channels.size(); ++channelIndex)
+					m_buildingFrame.m_channels[channelIndex] = mgr.get_channel_history(channelIndex).value(0);
+
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (mgr.get_channel_sequence() == sequence)
+					break;
+			}
+
+			// Each tree is rolled by its own thread (e.g. the image loaders), whenever it starts its next frame
+			m_buildingFrame.m_nodes.clear();
+			for (ProfilingMgr::thread_data* thread = mgr.get_thread_list(); thread; thread = thread->m_next)
+			{
+				size_t firstNode = m_buildingFrame.m_nodes.size();
+				while (true)
+				{
+					unsigned sequence = thread->m_rollSequence.load(std::memory_order_acquire);
+					if (sequence & 1)
+					{
+						std::this_thread::yield();
+						continue;
+					}
+
+					m_buildingFrame.m_nodes.erase(m_buildingFrame.m_nodes.begin() + firstNode, m_buildingFrame.m_nodes.end());
+					for (const ProfilingMgr::node* child = thread->m_root->first_child(); child; child = child->next_sibling())
+						copy_node(thread, child);
+
+					std::atomic_thread_fence(std::memory_order_acquire);
+					if (thread->m_rollSequence.load(std::memory_order_relaxed) == sequence)
+						break;
+				}
+			}
+			mgr.end_history_read();
+
+			// Replaces the previous frame if the server thread didn't take it yet
+			std::lock_guard<std::mutex> lock(m_frameMutex);
+			std::swap(m_readyFrame, m_buildingFrame);
+			m_frameReady = true;
+		}
+
+		void ServerFormatter::on_events(const ProfilingMgr::thread_data& thread, const ProfilingMgr::event* events, unsigned count)
+		{
+			std::lock_guard<std::mutex> lock(m_bufferMutex);
+			if (m_overflowed)
+				return;
+
+			m_encoder.write_events(m_pending, thread, events, count);
+
+			// The server thread drops the viewer, the events are lost anyway
+			if (m_pending.size() >= MAX_PENDING_BYTES)
+			{
+				m_overflowed = true;
+				m_pending.clear();
+			}
+		}
+
+		void ServerFormatter::on_flush()
+		{
+			// The server thread sends the pending bytes on its own
+		}
+
+		// Instance used by the START_SERVER/STOP_SERVER/SERVE_FRAME macros.
+		ServerFormatter& ServerFormatter::get_instance()
+		{
+			static ServerFormatter instance;
+			return instance;
+		}
+
+		// Opens the listening socket from a filled address and starts the background thread.
+		bool ServerFormatter::listen_on(const void* address, unsigned addressSize, int family)
+		{
+#ifdef _WIN32
+			WSADATA wsaData;
+			if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+				return false;
+#endif
+
+			native_socket listenSocket = socket(family, SOCK_STREAM, 0);
+			bool listening = static_cast<std::uintptr_t>(listenSocket) != INVALID_HANDLE;
+
+#ifndef _WIN32
+			// Lets the server be restarted right away on the same port (on Windows this would let others steal it)
+			int reuse = 1;
+			if (listening && family == AF_INET)
+				setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#endif
+
+			listening = listening
+				&& bind(listenSocket, static_cast<const sockaddr*>(address), addressSize) == 0
+				&& listen(listenSocket, 1) == 0;
+
+			sockaddr_in boundAddress = {};
+			socklen_t boundSize = sizeof(boundAddress);
+			if (listening && family == AF_INET)
+				listening = getsockname(listenSocket, reinterpret_cast<sockaddr*>(&boundAddress), &boundSize) == 0;
+
+			if (!listening)
+			{
+				if (static_cast<std::uintptr_t>(listenSocket) != INVALID_HANDLE)
+					close_socket(static_cast<std::uintptr_t>(listenSocket));
+#ifdef _WIN32
+				WSACleanup();
+#endif
+				return false;
+			}
+
+			m_port = family == AF_INET ? ntohs(boundAddress.sin_port) : 0;
+			m_listenSocket = static_cast<std::uintptr_t>(listenSocket);
+			m_running = true;
+			m_thread = std::thread(&ServerFormatter::server_loop, this);
+			return true;
+		}
+
+		// Copies the last frame of a node and its descendants into m_buildingFrame.
+		void ServerFormatter::copy_node(const ProfilingMgr::thread_data* thread, const ProfilingMgr::node* nodeToCopy)
+		{
+			frame_node copy;
+			copy.m_node = nodeToCopy;
+			copy.m_parent = nodeToCopy->m_parent != thread->m_root ? nodeToCopy->m_parent : nullptr;
+			copy.m_thread = thread;
+			copy.m_callCount = nodeToCopy->m_history.call_count(0);
+			copy.m_totalCycles = nodeToCopy->m_history.total_cycles(0);
+			copy.m_selfCycles = nodeToCopy->m_history.self_cycles(0);
+			m_buildingFrame.m_nodes.push_back(copy);
+
+			for (const ProfilingMgr::node* child = nodeToCopy->first_child(); child; child = child->next_sibling())
+				copy_node(thread, child);
+		}
+
+		// Body of the background thread.
+		void ServerFormatter::server_loop()
+		{
+			frame_snapshot frame;
+			while (m_running)
+			{
+				// Wait for a viewer
+				if (m_clientSocket == INVALID_HANDLE)
+				{
+					if (wait_socket(m_listenSocket, POLLIN) <= 0)
+						continue;
+
+					native_socket client = accept(static_cast<native_socket>(m_listenSocket), nullptr, nullptr);
+					if (static_cast<std::uintptr_t>(client) == INVALID_HANDLE)
+						continue;
+
+#if !defined(_WIN32) && defined(SO_NOSIGPIPE)
+					int noSigPipe = 1;
+					setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+					m_clientSocket = static_cast<std::uintptr_t>(client);
+					begin_connection();
+				}
+
+				// The wait for commands also paces the loop
+				int readable = wait_socket(m_clientSocket, POLLIN);
+				if (readable < 0 || (readable > 0 && !read_commands()))
+				{
+					end_connection();
+					continue;
+				}
+
+				bool hasFrame = false;
+				{
+					std::lock_guard<std::mutex> lock(m_frameMutex);
+					if (m_frameReady)
+					{
+						std::swap(frame, m_readyFrame);
+						m_frameReady = false;
+						hasFrame = true;
+					}
+				}
+
+				bool overflowed;
+				{
+					std::lock_guard<std::mutex> lock(m_bufferMutex);
+					if (hasFrame)
+						write_frame(frame);
+					overflowed = m_overflowed;
+					m_sending.swap(m_pending);
+				}
+
+				if (overflowed || !send_pending())
+					end_connection();
+			}
+
+			if (m_clientSocket != INVALID_HANDLE)
+				end_connection();
+		}
+
+		// Resets the state of a new connection and queues the header.
+		void ServerFormatter::begin_connection()
+		{
+			m_nodes.clear();
+			m_sentChannels.clear();
+			m_nextNodeId = 1;
+			m_sending.clear();
+
+			{
+				std::lock_guard<std::mutex> lock(m_bufferMutex);
+				m_pending.clear();
+				m_overflowed = false;
+				m_encoder.reset();
+
+				double ticksPerSecond = Clock::ticks_per_second();
+				unsigned long long frequencyBits;
+				std::memcpy(&frequencyBits, &ticksPerSecond, sizeof(frequencyBits));
+				RecordEncoder::write_bytes(m_pending, "PRFS", 4);
+				for (unsigned i = 0; i < 4; ++i)
+					m_pending.push_back(static_cast<unsigned char>(VERSION >> (8 * i)));
+				for (unsigned i = 0; i < 8; ++i)
+					m_pending.push_back(static_cast<unsigned char>(frequencyBits >> (8 * i)));
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_frameMutex);
+				m_frameReady = false;
+			}
+
+			m_connected = true;
+			m_wantsFrames.store(true, std::memory_order_release);
+		}
+
+		// Closes the connection of the viewer and stops receiving events.
+		void ServerFormatter::end_connection()
+		{
+			m_connected = false;
+			m_wantsFrames = false;
+			if (m_eventsEnabled)
+			{
+				ProfilingMgr::get_instance().remove_event_sink(this);
+				m_eventsEnabled = false;
+			}
+
+			close_socket(m_clientSocket);
+			m_clientSocket = INVALID_HANDLE;
+
+			std::lock_guard<std::mutex> lock(m_bufferMutex);
+			m_pending.clear();
+		}
+
+		// Applies the command bytes received from the viewer. Returns false if the viewer disconnected.
+		bool ServerFormatter::read_commands()
+		{
+			char commands[64];
+			int received = recv(static_cast<native_socket>(m_clientSocket), commands, sizeof(commands), 0);
+			if (received <= 0)
+				return false;
+
+			for (int i = 0; i < received; ++i)
+			{
+				if (commands[i] == 'E' && !m_eventsEnabled)
+				{
+					m_wantsFrames = false;
+					ProfilingMgr::get_instance().add_event_sink(this);
+					m_eventsEnabled = true;
+				}
+				else if (commands[i] == 'F' && m_eventsEnabled)
+				{
+					ProfilingMgr::get_instance().remove_event_sink(this);
+					m_eventsEnabled = false;
+					m_wantsFrames = true;
+				}
+			}
+			return true;
+		}
+
+		// Sends the queued bytes. Returns false if the viewer disconnected.
+		bool ServerFormatter::send_pending()
+		{
+			size_t sent = 0;
+			while (sent < m_sending.size())
+			{
+				// A viewer that stopped reading mustn't block stop()
+				if (!m_running)
+					return false;
+
+				int writable = wait_socket(m_clientSocket, POLLOUT);
+				if (writable < 0)
+					return false;
+				if (writable == 0)
+					continue;
+
+				int chunk = static_cast<int>(std::min<size_t>(m_sending.size() - sent, INT_MAX));
+				int written = send(static_cast<native_socket>(m_clientSocket), reinterpret_cast<const char*>(m_sending.data() + sent), chunk, SEND_FLAGS);
+				if (written <= 0)
+					return false;
+				sent += written;
+			}
+
+			m_sending.clear();
+			return true;
+		}
+
+		// Encodes a frame as deltas from the previous one. Called with m_bufferMutex locked.
+		void ServerFormatter::write_frame(const frame_snapshot& frame)
+		{
+			// Describe the new nodes and channels first, parents come before their children
+			std::vector<unsigned> changedNodes;
+			for (unsigned i = 0; i < frame.m_nodes.size(); ++i)
+			{
+				const frame_node& copy = frame.m_nodes[i];
+				auto found = m_nodes.find(copy.m_node);
+				if (found == m_nodes.end())
+				{
+					node_state state;
+					state.m_id = m_nextNodeId++;
+					found = m_nodes.emplace(copy.m_node, state).first;
+
+					m_encoder.write_thread(m_pending, *copy.m_thread);
+					m_encoder.write_scope(m_pending, copy.m_node->m_scopeIndex);
+					m_pending.push_back('N');
+					RecordEncoder::write_varint(m_pending, copy.m_thread->m_index);
+					RecordEncoder::write_varint(m_pending, state.m_id);
+					RecordEncoder::write_varint(m_pending, copy.m_parent ? m_nodes[copy.m_parent].m_id : 0);
+					RecordEncoder::write_varint(m_pending, copy.m_node->m_scopeIndex);
+				}
+
+				const node_state& sent = found->second;
+				if (copy.m_callCount != sent.m_callCount || copy.m_totalCycles != sent.m_totalCycles || copy.m_selfCycles != sent.m_selfCycles)
+					changedNodes.push_back(i);
+			}
+
+			if (m_sentChannels.size() < frame.m_channels.size())
+				m_sentChannels.resize(frame.m_channels.size(), 0);
+
+			unsigned changedChannels = 0;
+			for (unsigned channelIndex = 0; channelIndex < frame.m_channels.size(); ++channelIndex)
+			{
+				if (frame.m_channels[channelIndex] != m_sentChannels[channelIndex])
+				{
+					m_encoder.write_channel(m_pending, channelIndex);
+					changedChannels++;
+				}
+			}
+
+			m_pending.push_back('F');
+			RecordEncoder::write_varint(m_pending, frame.m_frameIndex);
+			RecordEncoder::write_varint(m_pending, frame.m_frameCycles);
+
+			RecordEncoder::write_varint(m_pending, changedNodes.size());
+			for (unsigned i : changedNodes)
+			{
+				const frame_node& copy = frame.m_nodes[i];
+				node_state& sent = m_nodes[copy.m_node];
+				RecordEncoder::write_varint(m_pending, sent.m_id);
+				RecordEncoder::write_zigzag(m_pending, static_cast<long long>(copy.m_callCount) - static_cast<long long>(sent.m_callCount));
+				RecordEncoder::write_zigzag(m_pending, static_cast<long long>(copy.m_totalCycles - sent.m_totalCycles));
+				RecordEncoder::write_zigzag(m_pending, static_cast<long long>(copy.m_selfCycles - sent.m_selfCycles));
+				sent.m_callCount = copy.m_callCount;
+				sent.m_totalCycles = copy.m_totalCycles;
+				sent.m_selfCycles = copy.m_selfCycles;
+			}
+
+			RecordEncoder::write_varint(m_pending, changedChannels);
+			for (unsigned channelIndex = 0; channelIndex < frame.m_channels.size(); ++channelIndex)
+			{
+				long long value = frame.m_channels[channelIndex];
+				if (value == m_sentChannels[channelIndex])
+					continue;
+
+				RecordEncoder::write_varint(m_pending, channelIndex);
+				RecordEncoder::write_zigzag(m_pending, static_cast<long long>(static_cast<unsigned long long>(value) - static_cast<unsigned long long>(m_sentChannels[channelIndex])));
+				m_sentChannels[channelIndex] = value;
 			}
 		}
 #endif
@@ -7,8 +7,36 @@
 
 #define JSON_OUTPUT  0		// Set to 1/0 to enable/disable json output formatting
 #define IMGUI_OUTPUT 1		// Set to 1/0 to enable/disable imgui output formatting
+#define CAPTURE_OUTPUT 1	// Set to 1/0 to enable/disable binary capture files
+#define TRACE_OUTPUT 1		// Set to 1/0 to enable/disable Chrome trace event (chrome://tracing, Perfetto UI) files
+#define HITCH_OUTPUT 1		// Set to 1/0 to enable/disable the automatic captures of the frames over budget
+#define SERVER_OUTPUT 1		// Set to 1/0 to enable/disable serving the profiling data to a viewer over a local socket
+#define TIME_IN_NANOSECONDS 1	// Set to 1/0 to report times in nanoseconds/raw ticks of the profiler clock
 
 
+#if CAPTURE_OUTPUT || TRACE_OUTPUT || HITCH_OUTPUT
+#include <cstdio>
+#endif
+
+#if HITCH_OUTPUT || SERVER_OUTPUT
+#include <string>
+#endif
+
+#if SERVER_OUTPUT
+#include <cstdint>
+#endif
+
+#if IMGUI_OUTPUT
+#include <mutex>
+
+struct ImGuiTableSortSpecs;
+#endif
+
+#if IMGUI_OUTPUT || CAPTURE_OUTPUT || TRACE_OUTPUT || SERVER_OUTPUT
+#include <unordered_map>
+#include <vector>
+#endif
+
 #if JSON_OUTPUT
 #include <json.hpp>	// Json.hpp from Nlohman json library is assumed to be part of additional include directories (otherwise, JSON_OUTPUT can be turned off)
 using json = nlohmann::json;
@@ -40,26 +68,609 @@ namespace Profiler
 
 
 #if IMGUI_OUTPUT
-		class ImGuiFormatter
+		// Draws the profiling data with ImGui, in five tabs: the tree of every thread, a sortable table of the hot spots,
+		// a flame graph of the last frame, a timeline with the scopes of every thread over the last complete frame and
+		// the counters/gauges next to the frame times.
+		// The table only lays out the visible rows, and the flame graph and the timeline
+		// are drawn directly with the draw list, skipping what is off-screen or narrower than a pixel, so they stay
+		// cheap with thousands of spans. The timeline receives the events from the event pump while its tab is open.
+		class ImGuiFormatter : public ProfilingMgr::event_sink
 		{
 		public:
+			~ImGuiFormatter();
+
 			void on_gui();	// Assumes ImGui library is initialized, and this is being called as part of the ImGui application code
+
+			void on_events(const ProfilingMgr::thread_data& thread, const ProfilingMgr::event* events, unsigned count) override;
+			void on_flush() override;
+
+			// Instance used by the DUMP_TO_IMGUI macro, which keeps the state of the views between frames.
+			static ImGuiFormatter& get_instance();
+
+			// Makes ImGui allocate through the profiler, which counts the allocations per scope and per frame.
+			// Must be called before ImGui::CreateContext.
+			static void hook_allocator();
+
 		private:
+			// Instance of a scope, with the times of the profiler clock.
+			struct span
+			{
+				unsigned long long m_start;
+				unsigned long long m_end;
+				unsigned m_scope;
+				unsigned m_depth;								// Number of scopes of the thread that enclose this one
+			};
+
+			// Spans of one thread that overlap the time window of a frame.
+			struct thread_spans
+			{
+				const ProfilingMgr::thread_data* m_thread = nullptr;
+				std::vector<span> m_spans;						// Grouped by depth, each depth sorted by time
+				std::vector<unsigned> m_depthStarts;			// Index of the first span of each depth, plus the end
+				unsigned m_depthCount = 0;
+			};
+
+			struct timeline_frame
+			{
+				unsigned long long m_start = 0;
+				unsigned long long m_end = 0;
+				std::vector<thread_spans> m_threads;			// Sorted by thread index
+			};
+
+			// Spans of one thread not yet handed to the GUI, built by the pump thread.
+			struct pending_spans
+			{
+				std::vector<span> m_closed;
+				std::vector<span> m_open;						// Stack of the scopes entered and not exited yet
+			};
+
+			// Horizontal zoom and pan of a view, as fractions of its full width.
+			struct view_state
+			{
+				double m_zoom = 1.0;							// The view shows 1 / m_zoom of its full width
+				double m_offset = 0.0;							// Fraction of the full width at the left border
+				float m_height = 0.0f;							// Height of the contents on the last frame
+			};
+
+			// Row of the hot spots table: one node (call path) or one scope (all its call paths) of one thread, with
+			// the stats of the last frame.
+			struct hotspot_row
+			{
+				const ProfilingMgr::node* m_node;				// nullptr for the rows of a scope
+				unsigned m_scopeIndex;
+				const ProfilingMgr::thread_data* m_thread;
+				unsigned m_callCount;
+				unsigned long long m_totalCycles;
+				unsigned long long m_selfCycles;				// Not spent in the children
+				unsigned long long m_averageCycles;
+				unsigned long long m_maxCycles;
+				float m_parentPercentage;
+			};
+
+			void draw_tree();
+			void draw_hotspots();
+			void draw_flame_graph();
+			void draw_timeline();
+			void draw_counters();
+
 			void dump_node(ProfilingMgr::node* nodeToDump);
 
-			int m_valOffset = 0;
+			// Rebuilds the rows of the hot spots table from the trees. Only needed when nodes were added.
+			void collect_hotspots();
+
+			// Updates the stats of the rows from their nodes, without walking the trees.
+			void refresh_hotspots();
+
+			// Rebuilds the rows of the hot spots table from the stats per scope of every thread.
+			void collect_scope_hotspots();
+
+			void sort_hotspots(const ImGuiTableSortSpecs* sortSpecs);
+
+			// Name of the scope of a row of the hot spots table.
+			static const char* hotspot_name(const hotspot_row& row);
+
+			// Draws a node of the flame graph and its children, left-aligned at x. Returns the depth of the deepest
+			// node drawn. Sets m_hoveredNode if the mouse is over one of them.
+			unsigned draw_flame_node(const ProfilingMgr::node* nodeToDraw, double x, double pixelsPerTick, unsigned depth, float top);
+
+			// Creates the canvas of a view and applies the zoom (mouse wheel) and pan (dragging) to it.
+			// Double clicking resets the view.
+			void begin_view(const char* id, view_state& view);
+
+			// Registers or unregisters the formatter as an event sink.
+			void set_timeline_enabled(bool enabled);
+
+			// Hands the spans overlapping [start, end) to the GUI thread, then drops the ones that end before end.
+			// Runs on the pump thread.
+			void publish_frame(unsigned long long start, unsigned long long end);
+
+			// GUI thread
+			unsigned long long m_threadSamples = 0;				// Samples taken of the thread whose tree is being dumped
+			std::vector<hotspot_row> m_hotspots;
+			unsigned m_hotspotNodeCount = 0;					// Nodes of all the trees when the rows were collected
+			double m_hotspotRefreshTime = -1.0;					// ImGui time of the last refresh of the rows
+			bool m_hotspotsFrozen = false;
+			bool m_hotspotsByScope = false;						// One row per scope instead of one per call path
+			view_state m_flameView;
+			view_state m_timelineView;
+			float m_canvasX = 0.0f;								// Screen rect of the canvas of the view being drawn
+			float m_canvasWidth = 1.0f;
+			const ProfilingMgr::node* m_hoveredNode = nullptr;
+			timeline_frame m_shownFrame;
+			unsigned m_shownVersion = 0;
+			bool m_timelineEnabled = false;
+
+			// Pump thread
+			std::unordered_map<const ProfilingMgr::thread_data*, pending_spans> m_pending;
+			unsigned long long m_frameStarts[2] = {};			// Starts of the last two frames, the first one is complete
+			unsigned m_frameStartCount = 0;
+			timeline_frame m_buildingFrame;
+			std::vector<span> m_frameSpans;						// Spans of the frame being published, in exit order
+			std::vector<unsigned> m_depthFill;					// Next free index of each depth while grouping m_frameSpans
+
+			// Shared. The frames are swapped, so that no spans are copied.
+			std::mutex m_frameMutex;
+			timeline_frame m_readyFrame;
+			unsigned m_readyVersion = 0;
 		};
 
-#define DUMP_TO_IMGUI() Profiler::Formatters::ImGuiFormatter dumper; dumper.on_gui();
+#define DUMP_TO_IMGUI() Profiler::Formatters::ImGuiFormatter::get_instance().on_gui();
+#define PROF_HOOK_IMGUI_ALLOCATOR() Profiler::Formatters::ImGuiFormatter::hook_allocator();
 
 #else
 #define DUMP_TO_IMGUI()
+#define PROF_HOOK_IMGUI_ALLOCATOR()
 #endif	// IMGUI_OUTPUT
 
+
+
+#if CAPTURE_OUTPUT || SERVER_OUTPUT
+		// Encodes the records shared by the capture files and the server stream (see the layout of CaptureFormatter)
+		// into a buffer given by the caller. Remembers the scopes, channels and threads already described and the time
+		// of the last event of each thread, so that a stream describes each of them once and the deltas carry over
+		// from one 'E' record to the next.
+		class RecordEncoder
+		{
+		public:
+			// Forgets everything written so far, for a new stream.
+			void reset();
+
+			static void write_varint(std::vector<unsigned char>& out, unsigned long long value);
+
+			// Zigzag encoding, so that small negative values stay short.
+			static void write_zigzag(std::vector<unsigned char>& out, long long value);
+
+			static void write_bytes(std::vector<unsigned char>& out, const void* bytes, size_t size);
+
+			// Writes the 'T' record of a thread the first time it is seen.
+			void write_thread(std::vector<unsigned char>& out, const ProfilingMgr::thread_data& thread);
+
+			// Writes the 'S' record of a scope index the first time it is seen.
+			void write_scope(std::vector<unsigned char>& out, unsigned scopeIndex);
+
+			// Writes the 'C' record of a channel index the first time it is seen.
+			void write_channel(std::vector<unsigned char>& out, unsigned channelIndex);
+
+			// Writes the 'E' record of a chunk of events of a thread, preceded by the records of the thread, scopes and
+			// channels it uses that weren't written yet. Returns the position of the 'E' record in the buffer.
+			size_t write_events(std::vector<unsigned char>& out, const ProfilingMgr::thread_data& thread, const ProfilingMgr::event* events, unsigned count);
+
+		private:
+			std::vector<bool> m_writtenScopes;					// Scope indices whose record is already written
+			std::vector<bool> m_writtenChannels;				// Channel indices whose record is already written
+			std::unordered_map<const ProfilingMgr::thread_data*, unsigned long long> m_threads;	// Time of the last event written per thread
+		};
+#endif
+
+
+#if CAPTURE_OUTPUT
+		// Streams the events of every thread to a binary capture file. The events are encoded and written by the
+		// event pump thread, so capturing only costs the event recording on the profiled threads.
+		//
+		// File layout (integers marked as varint use LEB128, the rest are little endian):
+		//	Header:		"PRFC" | u32 version | f64 clock ticks per second
+		//	Records:	one tag byte followed by its fields
+		//		'S'		scope:	varint scope index | varint name length | characters | varint file length | characters |
+		//					varint line
+		//		'C'		channel: varint channel index | varint kind (0 = counter, 1 = gauge) | varint name length |
+		//					characters
+		//		'T'		thread:	varint thread index | varint name length | characters (empty if unnamed)
+		//		'E'		events:	varint thread index | varint count | events
+		//					each event is varint (delta << 2 | kind) where delta is the ticks since the previous event of
+		//					the same thread and kind is 0 = enter, 1 = exit, 2 = frame start, 3 = channel value. Enters are
+		//					followed by the varint index of their scope. Channel values have a delta of 0 and are followed
+		//					by the varint channel index and the zigzag varint value of the frame that ended at the
+		//					preceding frame start.
+		//		'I'		frame index: varint frame count | per frame: varint file offset of the 'E' record holding the
+		//					frame start | varint ticks since the previous frame start
+		//	Footer:		u64 file offset of the 'I' record | "PRFE"
+		class CaptureFormatter : public ProfilingMgr::event_sink
+		{
+		public:
+			static const unsigned VERSION = 3;
+
+			~CaptureFormatter();
+
+			// Opens the file and starts receiving events. Returns false if the file couldn't be opened or a capture
+			// is already running.
+			bool start_capture(const char* filePath);
+
+			// Stops receiving events, writes the frame index and closes the file.
+			void stop_capture();
+
+			bool is_capturing() const;
+
+			void on_events(const ProfilingMgr::thread_data& thread, const ProfilingMgr::event* events, unsigned count) override;
+			void on_flush() override;
+
+			// Instance used by the START_CAPTURE/STOP_CAPTURE macros.
+			static CaptureFormatter& get_instance();
+
+		private:
+			struct frame_entry
+			{
+				unsigned long long m_offset;
+				unsigned long long m_time;
+			};
+
+			std::FILE* m_file = nullptr;
+			unsigned long long m_fileOffset = 0;				// Bytes already written to the file
+			std::vector<unsigned char> m_buffer;				// Encoded records not yet written
+			RecordEncoder m_encoder;
+			std::vector<frame_entry> m_frames;
+			unsigned long long m_lastFrameTime = 0;
+		};
+
+#define START_CAPTURE(filePath) Profiler::Formatters::CaptureFormatter::get_instance().start_capture(filePath);
+#define STOP_CAPTURE() Profiler::Formatters::CaptureFormatter::get_instance().stop_capture();
+
+#else
+#define START_CAPTURE(filePath)
+#define STOP_CAPTURE()
+#endif	// CAPTURE_OUTPUT
+
+
+
+#if TRACE_OUTPUT
+		// Streams the events of every thread to a Chrome trace event JSON file, which can be opened with the Perfetto UI
+		// or chrome://tracing. Each scope instance becomes a begin/end pair with its real timestamps, each thread a
+		// track, the frame starts of PROF_NEW_FRAME() global instant events and the counters/gauges counter tracks with
+		// one value per frame. The text is formatted into a fixed size buffer on the event pump thread and written
+		// whenever it fills up.
+		class TraceFormatter : public ProfilingMgr::event_sink
+		{
+		public:
+			static const unsigned BUFFER_SIZE = 64 * 1024;
+
+			~TraceFormatter();
+
+			// Opens the file and starts receiving events. Returns false if the file couldn't be opened or a trace
+			// is already running.
+			bool start_trace(const char* filePath);
+
+			// Stops receiving events, closes the JSON array and the file.
+			void stop_trace();
+
+			bool is_tracing() const;
+
+			void on_events(const ProfilingMgr::thread_data& thread, const ProfilingMgr::event* events, unsigned count) override;
+			void on_flush() override;
+
+			// Instance used by the START_TRACE/STOP_TRACE macros.
+			static TraceFormatter& get_instance();
+
+		private:
+			// Formats one trace event into the buffer, flushing it first if the event might not fit.
+			void write_event(const char* phase, const char* name, unsigned thread, unsigned long long time, const char* extra = "");
+
+			// Copies a string into the buffer as the contents of a JSON string.
+			void write_escaped(const char* text);
+
+			// Copies JSON text into the buffer as it is.
+			void write_raw(const char* text);
+
+			void flush_buffer();
+
+			std::FILE* m_file = nullptr;
+			char m_buffer[BUFFER_SIZE];
+			unsigned m_used = 0;								// Bytes of m_buffer in use
+			bool m_firstEvent = true;							// Whether the next event is the first of the array (no comma)
+			unsigned long long m_startTime = 0;					// Clock ticks of the start of the trace (timestamp 0)
+			std::unordered_map<const ProfilingMgr::thread_data*, unsigned> m_depths;	// Open scopes per thread
+			unsigned m_frameCount = 0;
+			unsigned long long m_lastFrameTime = 0;				// Clock ticks of the last frame start, the time of the counter events
+		};
+
+#define START_TRACE(filePath) Profiler::Formatters::TraceFormatter::get_instance().start_trace(filePath);
+#define STOP_TRACE() Profiler::Formatters::TraceFormatter::get_instance().stop_trace();
+
+#else
+#define START_TRACE(filePath)
+#define STOP_TRACE()
+#endif	// TRACE_OUTPUT
+
+
+
+#if HITCH_OUTPUT
+		// Writes the last frames of the history to a JSON file whenever a frame takes longer than the frame budget, so
+		// that rare hitches are caught without anybody watching. The thread that calls PROF_NEW_FRAME() only hands the
+		// index of the frame to a background thread, which reads the ring buffers of the history while they are still
+		// holding the frames and writes the file, so that the capture doesn't cause another hitch. Each capture freezes
+		// the ones after it until its file is written and framesToKeep frames have passed, so a slow stretch of frames
+		// produces one file instead of one per frame.
+		class HitchFormatter : public ProfilingMgr::budget_listener
+		{
+		public:
+			~HitchFormatter();
+
+			// Sets the frame budget and starts capturing the frames over it. The files are named filePrefix followed by
+			// the index of the frame and ".json". Returns false if the captures are already armed.
+			bool start(double budgetMilliseconds, const char* filePrefix, unsigned framesToKeep = 120);
+
+			// Stops capturing, waiting for the file being written (if any).
+			void stop();
+
+			bool is_armed() const;
+
+			// Returns the number of files written (or being written) since start.
+			unsigned get_capture_count() const;
+
+			void on_budget_exceeded(unsigned long long frameIndex, unsigned long long frameCycles, unsigned long long budgetCycles) override;
+
+			// Instance used by the START_HITCH_CAPTURE/STOP_HITCH_CAPTURE macros.
+			static HitchFormatter& get_instance();
+
+		private:
+			// Node of a tree, in depth-first order.
+			struct snapshot_node
+			{
+				const char* m_name;
+				unsigned m_depth;								// 0 for the children of the root
+			};
+
+			// History of the nodes of one thread, with the values of each node stored one after the other, oldest first.
+			struct snapshot_thread
+			{
+				std::string m_name;
+				std::vector<snapshot_node> m_nodes;
+				std::vector<unsigned long long> m_totalCycles;
+				std::vector<unsigned long long> m_selfCycles;
+				std::vector<unsigned> m_callCounts;
+			};
+
+			struct snapshot_channel
+			{
+				const char* m_name;
+				std::vector<long long> m_values;				// Oldest first
+			};
+
+			struct snapshot
+			{
+				std::string m_filePath;
+				unsigned long long m_frameIndex = 0;
+				unsigned long long m_frameCycles = 0;
+				unsigned long long m_budgetCycles = 0;
+				unsigned m_frames = 0;							// Frames held by every history of the snapshot
+				std::vector<long long> m_frameTimes;			// Oldest first
+				std::vector<snapshot_thread> m_threads;
+				std::vector<snapshot_channel> m_channels;
+			};
+
+			// Frame over budget handed to the writer thread.
+			struct capture_request
+			{
+				unsigned long long m_frameIndex = 0;
+				unsigned long long m_frameCycles = 0;
+				unsigned long long m_budgetCycles = 0;
+			};
+
+			// Copies m_snapshot.m_frames frames of a node and its descendants, from the given age back.
+			void copy_node(snapshot_thread& thread, const ProfilingMgr::node* nodeToCopy, unsigned depth, unsigned firstAge);
+
+			// Copies the frames of the history up to m_snapshot.m_frameIndex into m_snapshot. Returns false if they
+			// already left the ring buffers. Runs on the writer thread.
+			bool copy_history();
+
+			// Writes m_snapshot to its file. Runs on the writer thread.
+			void write_snapshot() const;
+
+			// Waits for the captures requested by on_budget_exceeded and writes them, until stop().
+			void writer_loop();
+
+			std::string m_filePrefix;
+			unsigned m_framesToKeep = 0;
+			bool m_armed = false;
+			unsigned m_captureCount = 0;
+			unsigned long long m_nextFrame = 0;					// First frame that may trigger a capture
+			snapshot m_snapshot;								// Owned by the writer thread, reused by every capture
+			std::thread m_writer;								// Runs while the captures are armed
+			std::mutex m_requestMutex;
+			std::condition_variable m_requestSignal;
+			capture_request m_request;							// Under m_requestMutex
+			bool m_hasRequest = false;							// Under m_requestMutex
+			bool m_stopping = false;							// Under m_requestMutex
+			std::atomic<bool> m_writing = false;				// Set from the request of a capture until its file is written
+		};
+
+#define START_HITCH_CAPTURE(budgetMilliseconds, filePrefix) Profiler::Formatters::HitchFormatter::get_instance().start(budgetMilliseconds, filePrefix);
+#define STOP_HITCH_CAPTURE() Profiler::Formatters::HitchFormatter::get_instance().stop();
+
+#else
+#define START_HITCH_CAPTURE(budgetMilliseconds, filePrefix)
+#define STOP_HITCH_CAPTURE()
+#endif	// HITCH_OUTPUT
+
+
+
+#if SERVER_OUTPUT
+		// Serves the profiling data to one viewer at a time over a localhost TCP socket (or a Unix domain socket), so
+		// that the data of a headless or remote instance can be looked at without drawing the profiler inside the
+		// frames being measured. The last frame of the trees is copied by serve_frame() on the thread that calls
+		// PROF_NEW_FRAME(); everything else (encoding, sending, accepting viewers) happens on a background thread.
+		// Only the latest frame is kept, so a slow viewer skips frames instead of slowing the application down.
+		//
+		// The server uses the record format of the capture files (see CaptureFormatter), so a viewer can share its
+		// decoder with a capture reader:
+		//	Header:		"PRFS" | u32 version | f64 clock ticks per second, sent once per connection
+		//	Records:	'S', 'C', 'T' and 'E' as in the capture files, plus
+		//		'N'		node: varint thread index | varint node id | varint parent id (0 for the root) | varint scope index
+		//		'F'		frame: varint frame index | varint frame ticks | varint node count | per node: varint node id |
+		//					zigzag varint call count delta | zigzag varint total ticks delta | zigzag varint self ticks
+		//					delta | varint channel count | per channel: varint channel index | zigzag varint value delta
+		//	The deltas are taken from the previous 'F' record of the connection (from 0 for the first one), and the
+		//	nodes and channels that didn't change are left out. Node ids are unique over all the threads and start at 1.
+		// The viewer selects what it receives by sending a command byte at any time: 'F' for the frames (default) or
+		// 'E' for the event streams of every thread. Viewers that can't keep up with the events are disconnected.
+		class ServerFormatter : public ProfilingMgr::event_sink
+		{
+		public:
+			static const unsigned VERSION = 1;
+			static const unsigned short DEFAULT_PORT = 28077;
+			static const size_t MAX_PENDING_BYTES = 16 * 1024 * 1024;	// Unsent events that disconnect the viewer
+			static const std::uintptr_t INVALID_HANDLE = ~static_cast<std::uintptr_t>(0);
+
+			~ServerFormatter();
+
+			// Starts listening on 127.0.0.1 (0 picks a free port, see get_port). Returns false if the socket couldn't
+			// be opened or the server is already running.
+			bool start(unsigned short port = DEFAULT_PORT);
+
+#ifndef _WIN32
+			// Starts listening on a Unix domain socket created at the given path (replacing a stale socket there).
+			// Returns false if the socket couldn't be opened, another kind of file exists at the path or the server is
+			// already running.
+			bool start_local(const char* socketPath);
+#endif
+
+			// Disconnects the viewer and stops the background thread.
+			void stop();
+
+			bool is_running() const;
+
+			// Returns whether a viewer is connected.
+			bool has_viewer() const;
+
+			// Returns the TCP port listened on (0 for a Unix domain socket or when stopped).
+			unsigned short get_port() const;
+
+			// Copies the last frame of the trees and the channels for the viewer, if one is connected and wants the
+			// frames. Call once per frame, after PROF_NEW_FRAME().
+			void serve_frame();
+
+			void on_events(const ProfilingMgr::thread_data& thread, const ProfilingMgr::event* events, unsigned count) override;
+			void on_flush() override;
+
+			// Instance used by the START_SERVER/STOP_SERVER/SERVE_FRAME macros.
+			static ServerFormatter& get_instance();
+
+		private:
+			// Stats of a node over the last frame.
+			struct frame_node
+			{
+				const ProfilingMgr::node* m_node;
+				const ProfilingMgr::node* m_parent;				// nullptr for the children of the root
+				const ProfilingMgr::thread_data* m_thread;
+				unsigned m_callCount;
+				unsigned long long m_totalCycles;
+				unsigned long long m_selfCycles;
+			};
+
+			struct frame_snapshot
+			{
+				unsigned long long m_frameIndex = 0;
+				unsigned long long m_frameCycles = 0;
+				std::vector<frame_node> m_nodes;				// Parents before children
+				std::vector<long long> m_channels;				// Indexed by channel index
+			};
+
+			// Last values sent for a node, the base of the next deltas.
+			struct node_state
+			{
+				unsigned m_id;
+				unsigned m_callCount = 0;
+				unsigned long long m_totalCycles = 0;
+				unsigned long long m_selfCycles = 0;
+			};
+
+			// Opens the listening socket from a filled address and starts the background thread.
+			bool listen_on(const void* address, unsigned addressSize, int family);
+
+			// Copies the last frame of a node and its descendants into m_buildingFrame.
+			void copy_node(const ProfilingMgr::thread_data* thread, const ProfilingMgr::node* nodeToCopy);
+
+			// Body of the background thread.
+			void server_loop();
+
+			// Resets the state of a new connection and queues the header.
+			void begin_connection();
+
+			// Closes the connection of the viewer and stops receiving events.
+			void end_connection();
+
+			// Applies the command bytes received from the viewer. Returns false if the viewer disconnected.
+			bool read_commands();
+
+			// Sends the queued bytes. Returns false if the viewer disconnected.
+			bool send_pending();
+
+			// Encodes a frame as deltas from the previous one. Called with m_bufferMutex locked.
+			void write_frame(const frame_snapshot& frame);
+
+
+			// Owned by the thread that started the server
+			std::thread m_thread;
+			std::atomic<bool> m_running = false;
+			std::string m_socketPath;							// Removed when stopping, empty for TCP
+			unsigned short m_port = 0;
+
+			// Background thread. The sockets hold a SOCKET or a file descriptor.
+			std::uintptr_t m_listenSocket = INVALID_HANDLE;
+			std::uintptr_t m_clientSocket = INVALID_HANDLE;
+			bool m_eventsEnabled = false;						// Registered as an event sink for the viewer
+			std::unordered_map<const ProfilingMgr::node*, node_state> m_nodes;
+			std::vector<long long> m_sentChannels;				// Last values sent, by channel index
+			unsigned m_nextNodeId = 1;
+			std::vector<unsigned char> m_sending;				// Bytes being sent, taken from m_pending
+
+			// Shared with the thread calling serve_frame()
+			std::atomic<bool> m_connected = false;
+			std::atomic<bool> m_wantsFrames = false;			// The viewer receives the frames
+			std::mutex m_frameMutex;
+			frame_snapshot m_readyFrame;
+			bool m_frameReady = false;
+			frame_snapshot m_buildingFrame;						// Only used by serve_frame(), kept to reuse its storage
+
+			// Shared with the event pump thread
+			std::mutex m_bufferMutex;
+			std::vector<unsigned char> m_pending;				// Encoded records not sent yet
+			bool m_overflowed = false;							// m_pending reached MAX_PENDING_BYTES, the viewer is dropped
+			RecordEncoder m_encoder;							// Writes to m_pending
+		};
+
+#define START_SERVER(port) Profiler::Formatters::ServerFormatter::get_instance().start(port);
+#define STOP_SERVER() Profiler::Formatters::ServerFormatter::get_instance().stop();
+#define SERVE_FRAME() Profiler::Formatters::ServerFormatter::get_instance().serve_frame();
+
+#else
+#define START_SERVER(port)
+#define STOP_SERVER()
+#define SERVE_FRAME()
+#endif	// SERVER_OUTPUT
+
 	}
 }
 
 #else
 	#define DUMP_TO_JSON(filePath)
 	#define DUMP_TO_IMGUI()
+	#define PROF_HOOK_IMGUI_ALLOCATOR()
+	#define START_CAPTURE(filePath)
+	#define STOP_CAPTURE()
+	#define START_TRACE(filePath)
+	#define STOP_TRACE()
+	#define START_HITCH_CAPTURE(budgetMilliseconds, filePrefix)
+	#define STOP_HITCH_CAPTURE()
+	#define START_SERVER(port)
+	#define STOP_SERVER()
+	#define SERVE_FRAME()
 #endif	// USE_PROFILER
\ No newline at end of file
@@ -11,25 +11,159 @@
 #include "Profiler.h"
 
 #if USE_PROFILER
-#include <intrin.h>		// __rdtsc
+#include "ProfilerClock.h"
+#include <algorithm>		// std::max, std::nth_element
+#include <chrono>		// std::chrono::steady_clock
+#include <cmath>		// std::ceil
+#include <cstring>		// std::strcmp
 #include <limits>		// std::numeric_limits
+#include <new>			// placement new
+#include <stdexcept>		// std::length_error
 
 
 
 namespace Profiler
 {
-	// Default ctor. Records the cycles passed since the CPU started.
-	ScopedProfiler::ScopedProfiler(const char* id)
+	namespace
 	{
-		ProfilingMgr::get_instance().enter(id);
+		// Hands the chunk being filled by a thread over to the pump, if it has any event.
+		void publish_events(ProfilingMgr::thread_data* data)
+		{
+			ProfilingMgr::event_chunk* chunk = data->m_eventChunk;
+			if (chunk == nullptr || chunk->m_count == 0)
+				return;
+
+			chunk->m_next = data->m_publishedChunks.load(std::memory_order_relaxed);
+			while (!data->m_publishedChunks.compare_exchange_weak(chunk->m_next, chunk, std::memory_order_release, std::memory_order_relaxed))
+			{
+			}
+
+			data->m_eventChunk = nullptr;
+		}
+
+
+		// Marks the profiling state of a thread as finished when the thread exits.
+		struct thread_exit_marker
+		{
+			~thread_exit_marker()
+			{
+				if (m_data)
+				{
+					publish_events(m_data);
+					m_data->m_finished.store(true, std::memory_order_release);
+				}
+			}
+
+			ProfilingMgr::thread_data* m_data = nullptr;
+		};
+
+		thread_local ProfilingMgr::thread_data* t_threadData = nullptr;	// Profiling state of the calling thread
+		thread_local thread_exit_marker t_threadExitMarker;
+
+		// Hash of a scope index for the child index tables. Indices are dense, so they are spread with a Fibonacci
+		// multiplication.
+		inline unsigned hash_scope(unsigned scopeIndex)
+		{
+			return static_cast<unsigned>((scopeIndex * 0x9E3779B97F4A7C15ull) >> 32);
+		}
+
+		// Scope of the root node of every thread. Always has index 0.
+		Profiler::scope_descriptor s_rootScope("Root", __FILE__, __LINE__);
+
+		// Scope of the node reporting the overhead of the profiler of each thread.
+		Profiler::scope_descriptor s_overheadScope("<profiler overhead>", __FILE__, __LINE__);
+
+		// Scope timed by ProfilingMgr::measure_overhead.
+		Profiler::scope_descriptor s_calibrationScope("<profiler calibration>", __FILE__, __LINE__);
+	}
+
+	// Categories being profiled: the enabled categories while the profiler is active, 0 otherwise. Constant
+	// initialized, so the scopes entered during the static initialization already see it.
+	std::atomic<category_mask> g_activeCategories(CATEGORY_ALL);
+
+	namespace Clock
+	{
+		namespace
+		{
+			std::atomic<double> s_ticksPerSecond = 0.0;
+		}
+
+		// Measures the frequency of the backend. Only the time stamp counter needs it, since its frequency depends
+		// on the machine; it is measured against the steady clock for a few milliseconds. Calling it again repeats
+		// the measurement. The profiler calls it once at startup.
+		void calibrate()
+		{
+#if PROFILER_CLOCK == PROFILER_CLOCK_RDTSC
+			using steady = std::chrono::steady_clock;
+			const auto duration = std::chrono::milliseconds(20);
+
+			// Busy wait instead of sleeping, so that the measurement isn't affected by the wake up latency
+			steady::time_point startTime = steady::now();
+			unsigned long long startTicks = now();
+			steady::time_point endTime = steady::now();
+			while (endTime - startTime < duration)
+				endTime = steady::now();
+			unsigned long long endTicks = now();
+
+			double seconds = std::chrono::duration<double>(endTime - startTime).count();
+			s_ticksPerSecond.store(static_cast<double>(endTicks - startTicks) / seconds, std::memory_order_relaxed);
+#elif PROFILER_CLOCK == PROFILER_CLOCK_MONOTONIC_RAW
+			s_ticksPerSecond.store(1e9, std::memory_order_relaxed);
+#else
+			using period = std::chrono::steady_clock::period;
+			s_ticksPerSecond.store(static_cast<double>(period::den) / static_cast<double>(period::num), std::memory_order_relaxed);
+#endif
+		}
+
+		// Returns the amount of ticks per second of the backend (calibrating it on first use).
+		double ticks_per_second()
+		{
+			double frequency = s_ticksPerSecond.load(std::memory_order_relaxed);
+			if (frequency == 0.0)
+			{
+				calibrate();
+				frequency = s_ticksPerSecond.load(std::memory_order_relaxed);
+			}
+			return frequency;
+		}
+
+		// Converts a duration in ticks to nanoseconds.
+		double to_ns(unsigned long long ticks)
+		{
+			return static_cast<double>(ticks) * 1e9 / ticks_per_second();
+		}
+
+		// Converts a duration in ticks to milliseconds.
+		double to_ms(unsigned long long ticks)
+		{
+			return static_cast<double>(ticks) * 1e3 / ticks_per_second();
+		}
+
+		// Returns the name of the selected backend, for the formatters.
+		const char* name()
+		{
+#if PROFILER_CLOCK == PROFILER_CLOCK_RDTSC
+			return "rdtsc";
+#elif PROFILER_CLOCK == PROFILER_CLOCK_MONOTONIC_RAW
+			return "CLOCK_MONOTONIC_RAW";
+#else
+			return "steady_clock";
+#endif
+		}
+	}
+
+
+
+	// Enters the scope of a ScopedProfiler whose category is being profiled.
+	unsigned ScopedProfiler::enter(scope_descriptor& scope)
+	{
+		return ProfilingMgr::get_instance().enter(scope);
 	}
 
-	// Dtor. Records the cycles passed since the CPU started. Subtracts this
-	// with the constructor recording to get the cycles that have passed since
-	// construction of this object.
-	ScopedProfiler::~ScopedProfiler()
+	// Exits the scope of a ScopedProfiler that entered it.
+	void ScopedProfiler::exit(unsigned token)
 	{
-		ProfilingMgr::get_instance().exit();
+		ProfilingMgr::get_instance().exit(token);
 	}
 
 
@@ -42,90 +176,185 @@ namespace Profiler
 	}
 
 
-	// Default ctor. Creates the root node.
+	// Default ctor. Calibrates the clock so that it doesn't happen in the middle of a frame.
 	ProfilingMgr::ProfilingMgr()
 	{
-		m_root = create_node("Root");
-		m_currentNode = m_root;
+		Clock::calibrate();
+
+		// The scopes of the profiler are not registered by name, so that user scopes with the same names get their own index
+		{
+			std::lock_guard<std::mutex> lock(m_scopeMutex);
+			s_rootScope.m_index.store(add_scope(&s_rootScope), std::memory_order_relaxed);
+			s_overheadScope.m_index.store(add_scope(&s_overheadScope), std::memory_order_relaxed);
+			s_calibrationScope.m_index.store(add_scope(&s_calibrationScope), std::memory_order_relaxed);
+		}
+
+		measure_overhead();
 	}
 
-	// Dtor. Frees the memory of the tree.
+	// Dtor. Frees the memory of the trees of every registered thread.
 	ProfilingMgr::~ProfilingMgr()
 	{
-		free_tree(m_root);
-		m_currentNode = nullptr;
+		// Stop delivering events before the threads they belong to are freed
+		std::unique_lock<std::mutex> lock(m_sinkMutex);
+		m_sinks.clear();
+		m_recordEvents.store(false, std::memory_order_relaxed);
+		m_pumpRunning = false;
+		lock.unlock();
+		m_pumpWakeUp.notify_all();
+		if (m_pumpThread.joinable())
+			m_pumpThread.join();
+
+		stop_sampling();
+
+		thread_data* data = m_threadList.exchange(nullptr);
+		while (data)
+		{
+			thread_data* next = data->m_next;
+			delete data;	// Releases the node pool of the thread
+			data = next;
+		}
+
+		for (std::atomic<const scope_descriptor*>* page : m_scopePages)
+			delete[] page;
 	}
 
 
-	// Gets called when a block of code to be profiled with id passed as parameter is entered and starts profiling it.
-	void ProfilingMgr::enter(const char* id)
+	// Gets called when a block of code to be profiled with the scope passed as parameter is entered and starts profiling it.
+	// Whether the scope is profiled at all is decided by the caller (see ScopedProfiler), so that it can pair the exit.
+	// Returns the token to pass to exit().
+	unsigned ProfilingMgr::enter(scope_descriptor& scope)
 	{
-		if (!m_profilerActive)
-			return;
+		unsigned scopeIndex = scope.m_index.load(std::memory_order_relaxed);
+		if (scopeIndex == scope_descriptor::INVALID_INDEX)
+			scopeIndex = get_scope_index(scope);
 
-		// If recursive function, increase the recursion level
-		if (m_currentNode->m_id == id)
+		thread_data* data = get_thread_data();
+
+		// In events mode the tree is built by the pump thread, only append the event
+		if (m_recordingMode.load(std::memory_order_relaxed) == recording_mode::events)
 		{
-			m_currentNode->m_stats.m_recursionLevel++;
-			return;
+			if (data->m_frameIndex != m_frameIndex.load(std::memory_order_relaxed))
+			{
+				data->m_frameIndex = m_frameIndex.load(std::memory_order_relaxed);
+				publish_events(data);
+			}
+
+			record_event(data, Clock::now(), event_type::enter, scopeIndex);
+			return data->m_eventDepth++;
 		}
 
-		// Otherwise check to see if this id already exists as a child of the current node
-		node* child = m_currentNode->find_child_node(id);
+		// Apply a frame started by another thread before recording anything new
+		if (data->m_frameIndex != m_frameIndex.load(std::memory_order_relaxed))
+			roll_frame(data);
 
-		// If it doesn't exist, create a node for it
-		if (child == nullptr)
+		unsigned token = static_cast<unsigned>(data->m_scopeStack.size());
+		node* child = enter_node(data, scopeIndex);
+		data->m_scopeSerial++;
+
+		// Record the CPU cycles as late as possible, so that the lookup isn't part of the measurement
+		unsigned long long startCycles = Clock::now();
+		if (child)
 		{
-			child = create_node(id);
-			m_currentNode->add_child(child);
+			child->m_stats.m_startCycles = startCycles;
+			child->m_stats.m_startSerial = data->m_scopeSerial;
 		}
 
-		m_currentNode = child;
+		if (m_recordEvents.load(std::memory_order_relaxed))
+			record_event(data, startCycles, event_type::enter, scopeIndex);
 
-		// Increase the call count and record the CPU cycles
-		child->m_stats.m_callCount++;
-		child->m_stats.m_startCycles = __rdtsc();
+		return token;
 	}
 
 
 	// Gets called when the current block of code that is being profiled exits, and records statistics about the number
-	// of calls, cycles passed etc.
-	void ProfilingMgr::exit()
+	// of calls, cycles passed etc. Scopes entered after the one of the token and not exited yet (a missing exit) are
+	// closed first; a token whose scope was already closed is ignored.
+	void ProfilingMgr::exit(unsigned token)
 	{
-		if (!m_profilerActive)
-			return;
+		unsigned long long endCycles = Clock::now();
+		thread_data* data = get_thread_data();
 
-		// If it's a recursive function, simply reduce the recursion level
-		if (m_currentNode->m_stats.m_recursionLevel > 0)
+		if (m_recordingMode.load(std::memory_order_relaxed) == recording_mode::events)
 		{
-			m_currentNode->m_stats.m_recursionLevel--;
+			if (token >= data->m_eventDepth)
+			{
+				data->m_unmatchedExits++;
+				return;
+			}
+
+			// The pump replays the events with a stack too, so it gets the exits of the scopes left open
+			for (; data->m_eventDepth > token; data->m_eventDepth--)
+			{
+				if (data->m_eventDepth > token + 1)
+					data->m_unmatchedExits++;
+				record_event(data, endCycles, event_type::exit);
+			}
 			return;
 		}
-		
-		// Otherwise, record CPU cycles and return to parent
-		unsigned long long cyclesTaken = __rdtsc() - m_currentNode->m_stats.m_startCycles;
 
-		// Record on the array of samples the cycles taken for the current call of this node's scope/function
-		m_currentNode->m_stats.m_previousCycles[m_currentNode->m_stats.m_callCount % CALLS_RECORDED] = static_cast<float>(cyclesTaken);
+		if (token >= data->m_scopeStack.size())
+		{
+			data->m_unmatchedExits++;
+			return;
+		}
 
-		// Update the maximum and minimum number of cycles
-		if (cyclesTaken > m_currentNode->m_stats.m_maxCycles)
-			m_currentNode->m_stats.m_maxCycles = cyclesTaken;
-		if (cyclesTaken < m_currentNode->m_stats.m_minCycles)
-			m_currentNode->m_stats.m_minCycles = cyclesTaken;
+		bool recordEvents = m_recordEvents.load(std::memory_order_relaxed);
+		while (data->m_scopeStack.size() > token)
+		{
+			if (data->m_scopeStack.size() > token + 1)
+				data->m_unmatchedExits++;
 
-		m_currentNode->m_stats.m_totalCycles += cyclesTaken;
-		m_currentNode = m_currentNode->m_parent;
+			exit_node(data, endCycles, true);
+			if (recordEvents)
+				record_event(data, endCycles, event_type::exit);
+		}
 	}
 
 
-	// Marks the start of a frame. As a result, resets all the statistics of all the nodes.
+	// Marks the start of a frame. As a result, resets all the statistics of all the nodes of the calling thread.
+	// Other threads reset their own trees the next time they enter a scope.
 	void ProfilingMgr::new_frame()
 	{
 		if (!m_profilerActive)
 			return;
 
-		reset_tree_stats(m_root);
+		thread_data* data = get_thread_data();
+		unsigned long long frameStart = Clock::now();
+		if (m_recordEvents.load(std::memory_order_relaxed))
+			record_event(data, frameStart, event_type::frame);
+
+		unsigned long long frameCycles = sample_channels(data, frameStart);
+		unsigned long long frameIndex = m_frameIndex.fetch_add(1, std::memory_order_relaxed);
+
+		if (m_recordingMode.load(std::memory_order_relaxed) == recording_mode::events)
+		{
+			data->m_frameIndex = m_frameIndex.load(std::memory_order_relaxed);
+			publish_events(data);
+		}
+		else
+		{
+			roll_frame(data);
+		}
+
+		unsigned long long budget = m_frameBudget.load(std::memory_order_relaxed);
+		budget_listener* listener = m_budgetListener.load(std::memory_order_acquire);
+		if (listener && budget > 0 && frameCycles > budget)
+			listener->on_budget_exceeded(frameIndex, frameCycles, budget);
+	}
+
+
+	// Getter and setter for the way enter()/exit() record the scopes. The mode must be selected before any scope
+	// is entered (e.g. at the start of main), since switching it changes which thread owns the trees.
+	ProfilingMgr::recording_mode ProfilingMgr::get_recording_mode() const
+	{
+		return m_recordingMode.load(std::memory_order_relaxed);
+	}
+	void ProfilingMgr::set_recording_mode(recording_mode mode)
+	{
+		std::unique_lock<std::mutex> lock(m_sinkMutex);
+		m_recordingMode.store(mode, std::memory_order_relaxed);
+		update_recording(lock);
 	}
 
 
@@ -137,140 +366,1394 @@ namespace Profiler
 	void ProfilingMgr::setProfilerActive(bool active)
 	{
 		m_profilerActive = active;
+		g_activeCategories.store(active ? m_enabledCategories.load(std::memory_order_relaxed) : 0, std::memory_order_relaxed);
 	}
 
 
-	// Return the root node of the tree.
-	ProfilingMgr::node* ProfilingMgr::get_root() const
+	// Getter and setter for the categories of scopes that are profiled while the profiler is active (all of them by
+	// default). The scopes of the other categories cost a single branch.
+	category_mask ProfilingMgr::get_enabled_categories() const
+	{
+		return m_enabledCategories.load(std::memory_order_relaxed);
+	}
+	void ProfilingMgr::set_enabled_categories(category_mask categories)
 	{
-		return m_root;
+		m_enabledCategories.store(categories, std::memory_order_relaxed);
+		g_activeCategories.store(m_profilerActive ? categories : 0, std::memory_order_relaxed);
 	}
 
-	// Return the current node of the tree.
-	ProfilingMgr::node* ProfilingMgr::get_current_node() const
+	// Names a category (a single bit) for the formatters.
+	void ProfilingMgr::set_category_name(category_mask category, const char* name)
 	{
-		return m_currentNode;
+		for (unsigned bit = 0; bit < sizeof(category_mask) * 8; ++bit)
+		{
+			if (category == 1u << bit)
+				m_categoryNames[bit].store(name, std::memory_order_relaxed);
+		}
 	}
 
+	// Returns the name of a category (a single bit), or nullptr if it wasn't named.
+	const char* ProfilingMgr::get_category_name(category_mask category) const
+	{
+		for (unsigned bit = 0; bit < sizeof(category_mask) * 8; ++bit)
+		{
+			if (category == 1u << bit)
+				return m_categoryNames[bit].load(std::memory_order_relaxed);
+		}
+		return nullptr;
+	}
 
-	ProfilingMgr::node_stats::node_stats()
-		:	m_recursionLevel(0),
-			m_callCount(0),
-			m_startCycles(0),
-			m_totalCycles(0)
+	// Returns the categories of all the scopes registered so far.
+	category_mask ProfilingMgr::get_used_categories() const
 	{
-		m_maxCycles = 0;
-		m_minCycles = std::numeric_limits<unsigned long long>::max();
+		return m_usedCategories.load(std::memory_order_relaxed);
 	}
 
-	// Resets all the stats to 0 or their default value.
-	void ProfilingMgr::node_stats::reset()
+
+	// Getter and setter for the ammount of frames kept in the history of every node. A new length is applied to
+	// each node the next time a frame is recorded into it, discarding the frames it had.
+	unsigned ProfilingMgr::get_history_length() const
 	{
-		m_recursionLevel = 0;
-		m_callCount = 0;
-		m_startCycles = 0;
-		m_totalCycles = 0;
-		m_maxCycles = 0;
-		m_minCycles = std::numeric_limits<unsigned long long>::max();
+		return m_historyLength.load(std::memory_order_relaxed);
+	}
+	void ProfilingMgr::set_history_length(unsigned frames)
+	{
+		m_historyLength.store(frames > 0 ? frames : 1, std::memory_order_relaxed);
 	}
 
+	// Bracket every read of the histories from a thread that doesn't push into them.
+	void ProfilingMgr::begin_history_read()
+	{
+		// Sequentially consistent on both sides, so that either the resizing thread sees this reader or this reader
+		// sees the resize (see begin_history_resize)
+		while (true)
+		{
+			m_historyReaders.fetch_add(1);
+			if (m_historyResizes.load() == 0)
+				return;
 
-	ProfilingMgr::node::node(const char* id, node* parent, node* children, node* sibling)
-		:	m_id(id),
-			m_parent(parent),
-			m_child(children),
-			m_sibling(sibling)
+			m_historyReaders.fetch_sub(1);
+			std::this_thread::yield();
+		}
+	}
+	void ProfilingMgr::end_history_read()
 	{
+		m_historyReaders.fetch_sub(1, std::memory_order_release);
 	}
 
+	// Returns whether the histories can be reallocated to a new length now, which is the case when no other thread
+	// is reading them. Otherwise the caller keeps the current length until a later frame.
+	bool ProfilingMgr::begin_history_resize() const
+	{
+		m_historyResizes.fetch_add(1);
+		if (m_historyReaders.load() == 0)
+			return true;
 
-	// Helper function that returns the child node (or sibling of child) of this with the same id as passed.
-	// If no child exists with that id, returns nullptr.
-	ProfilingMgr::node* ProfilingMgr::node::find_child_node(const char* id) const
+		m_historyResizes.fetch_sub(1);
+		return false;
+	}
+	void ProfilingMgr::end_history_resize() const
 	{
-		// If the child is null, we already know it doesn't exist
-		if (m_child == nullptr)
-			return nullptr;
+		m_historyResizes.fetch_sub(1, std::memory_order_release);
+	}
 
-		// Check if the child is the same
-		if (m_child->m_id == id)
-			return m_child;
 
-		// Traverse through the siblings of the children to find it
-		node* traverser = m_child->m_sibling;
-		while (traverser)
+	// Sets the name shown by the formatters for the tree of the calling thread.
+	void ProfilingMgr::set_thread_name(const char* name)
+	{
+		get_thread_data()->m_name = name;
+	}
+
+
+	// Return the root node of the tree of the calling thread.
+	ProfilingMgr::node* ProfilingMgr::get_root()
+	{
+		return get_thread_data()->m_root;
+	}
+
+	// Return the current node of the tree of the calling thread.
+	ProfilingMgr::node* ProfilingMgr::get_current_node()
+	{
+		return get_thread_data()->m_currentNode.load(std::memory_order_relaxed);
+	}
+
+	// Return the first thread of the registry. The rest are reached through thread_data::m_next.
+	ProfilingMgr::thread_data* ProfilingMgr::get_thread_list() const
+	{
+		return m_threadList.load(std::memory_order_acquire);
+	}
+
+
+	// Returns the profiling state of the calling thread, registering it on first use.
+	ProfilingMgr::thread_data* ProfilingMgr::get_thread_data()
+	{
+		if (t_threadData == nullptr)
+			t_threadData = register_thread();
+
+		return t_threadData;
+	}
+
+	// Creates the profiling state of the calling thread and pushes it into the registry.
+	ProfilingMgr::thread_data* ProfilingMgr::register_thread()
+	{
+		thread_data* data = new thread_data(m_threadCount.fetch_add(1, std::memory_order_relaxed));
+		data->m_root = create_node(data, s_rootScope.m_index.load(std::memory_order_relaxed));
+		data->m_currentNode.store(data->m_root, std::memory_order_relaxed);
+		data->m_overheadNode = create_node(data, s_overheadScope.m_index.load(std::memory_order_relaxed));
+		data->m_root->add_child(data->m_overheadNode);
+		data->m_frameIndex = m_frameIndex.load(std::memory_order_relaxed);
+		data->m_historyCapacity = m_historyLength.load(std::memory_order_relaxed);
+
+		// Lock-free push to the front of the registry. Threads are never removed, so there is no ABA problem.
+		thread_data* head = m_threadList.load(std::memory_order_relaxed);
+		do
 		{
-			if (traverser->m_id == id)
-				return traverser;
+			data->m_next = head;
+		} while (!m_threadList.compare_exchange_weak(head, data, std::memory_order_release, std::memory_order_relaxed));
+
+		t_threadExitMarker.m_data = data;
+		return data;
+	}
+
+	// Applies the start of a new frame to the tree of the given thread.
+	void ProfilingMgr::roll_frame(thread_data* data) const
+	{
+		validate_stack(data);
+		roll_tree_stats(data, m_historyLength.load(std::memory_order_relaxed));
+		data->m_frameIndex = m_frameIndex.load(std::memory_order_relaxed);
+
+		// Bound the latency of the event stream to one frame
+		publish_events(data);
+	}
+
+
+	// Registers a consumer of the event streams. While there is at least one sink, every thread records its
+	// scope entries, exits and frame starts, and a background thread delivers them to the sinks.
+	void ProfilingMgr::add_event_sink(event_sink* sink)
+	{
+		std::unique_lock<std::mutex> lock(m_sinkMutex);
+		m_sinks.push_back(sink);
+		update_recording(lock);
+	}
+
+	// Unregisters a sink after delivering it the events published so far (including the unfinished chunk of
+	// the calling thread, if it profiles anything: the call never registers the thread). Stops the background
+	// thread when it was the last sink.
+	void ProfilingMgr::remove_event_sink(event_sink* sink)
+	{
+		if (t_threadData != nullptr)
+			publish_events(t_threadData);
+
+		std::unique_lock<std::mutex> lock(m_sinkMutex);
+		pump_events();
+
+		auto it = std::find(m_sinks.begin(), m_sinks.end(), sink);
+		if (it != m_sinks.end())
+			m_sinks.erase(it);
+
+		update_recording(lock);
+	}
+
+	// Starts or stops the event recording and the pump thread depending on the sinks and the recording mode.
+	// The lock must own m_sinkMutex, and is released when the function returns.
+	void ProfilingMgr::update_recording(std::unique_lock<std::mutex>& lock)
+	{
+		bool record = !m_sinks.empty() || m_recordingMode.load(std::memory_order_relaxed) == recording_mode::events;
 
-			traverser = traverser->m_sibling;
+		if (record && !m_pumpRunning)
+		{
+			// A previous pump thread may still be finishing after the recording was stopped. It needs the lock to
+			// exit, and the sinks may change meanwhile, so start over once it is gone.
+			if (m_pumpThread.joinable())
+			{
+				std::thread previousPump = std::move(m_pumpThread);
+				lock.unlock();
+				previousPump.join();
+				lock.lock();
+				update_recording(lock);
+				return;
+			}
+
+			// Events left unpublished by a previous recording are dropped by their threads
+			m_eventSession.fetch_add(1, std::memory_order_relaxed);
+			m_recordEvents.store(true, std::memory_order_relaxed);
+
+			m_pumpRunning = true;
+			m_pumpThread = std::thread(&ProfilingMgr::pump_loop, this);
+		}
+		else if (!record && m_pumpRunning)
+		{
+			m_recordEvents.store(false, std::memory_order_relaxed);
+			m_pumpRunning = false;
+			lock.unlock();
+			m_pumpWakeUp.notify_all();
 		}
+	}
 
-		return nullptr;
+	// Returns whether the threads are recording events.
+	bool ProfilingMgr::is_recording_events() const
+	{
+		return m_recordEvents.load(std::memory_order_relaxed);
 	}
 
-	// Adds a child node (as m_child if it is null, or at the end of siblings otherwise).
-	void ProfilingMgr::node::add_child(node* child)
+
+	// Appends an event to the stream of a thread.
+	void ProfilingMgr::record_event(thread_data* data, unsigned long long time, event_type type, unsigned scopeIndex) const
 	{
-		child->m_parent = this;
+		event_chunk* chunk = data->m_eventChunk;
 
-		if (m_child == nullptr)
+		unsigned session = m_eventSession.load(std::memory_order_relaxed);
+		if (data->m_eventSession != session)
 		{
-			m_child = child;
-			return;
+			data->m_eventSession = session;
+			if (chunk)
+				chunk->m_count = 0;
 		}
 
-		node* sibTraverser = m_child;
-		while (sibTraverser->m_sibling)
+		if (chunk == nullptr || chunk->m_count == EVENTS_PER_CHUNK)
 		{
-			sibTraverser = sibTraverser->m_sibling;
+			publish_events(data);
+
+			// Reuse a chunk given back by the pump. Only this thread pops from the free list, so there is no ABA problem.
+			chunk = data->m_freeChunks.load(std::memory_order_acquire);
+			while (chunk && !data->m_freeChunks.compare_exchange_weak(chunk, chunk->m_next, std::memory_order_acquire))
+			{
+			}
+
+			if (chunk == nullptr)
+				chunk = new event_chunk;
+
+			chunk->m_count = 0;
+			chunk->m_next = nullptr;
+			data->m_eventChunk = chunk;
 		}
 
-		sibTraverser->m_sibling = child;
+		chunk->m_events[chunk->m_count++] = { time, scopeIndex, type };
 	}
 
+	// Delivers all the published chunks to the sinks and returns them to their threads. m_sinkMutex must be locked.
+	void ProfilingMgr::pump_events()
+	{
+		bool replay = m_recordingMode.load(std::memory_order_relaxed) == recording_mode::events;
+
+		for (thread_data* thread = get_thread_list(); thread; thread = thread->m_next)
+		{
+			// Take all the published chunks at once. They are stacked newest first, so reverse them.
+			event_chunk* chunk = thread->m_publishedChunks.exchange(nullptr, std::memory_order_acquire);
+			event_chunk* ordered = nullptr;
+			while (chunk)
+			{
+				event_chunk* next = chunk->m_next;
+				chunk->m_next = ordered;
+				ordered = chunk;
+				chunk = next;
+			}
+
+			while (ordered)
+			{
+				event_chunk* next = ordered->m_next;
+
+				if (replay)
+					replay_events(thread, ordered->m_events, ordered->m_count);
+
+				for (event_sink* sink : m_sinks)
+					sink->on_events(*thread, ordered->m_events, ordered->m_count);
+
+				// Give the chunk back to its thread
+				ordered->m_next = thread->m_freeChunks.load(std::memory_order_relaxed);
+				while (!thread->m_freeChunks.compare_exchange_weak(ordered->m_next, ordered, std::memory_order_release, std::memory_order_relaxed))
+				{
+				}
+
+				ordered = next;
+			}
+		}
 
+		for (event_sink* sink : m_sinks)
+			sink->on_flush();
+	}
 
-	// Helper function to allocate a node of the tree with a specific id.
-	ProfilingMgr::node* ProfilingMgr::create_node(const char* id) const
+	// Starts a background thread that, every intervalMicroseconds, finds the current node of each running thread
+	// and counts a hit on it. This gives a statistical view of where time goes without timing every scope.
+	// Only available in tree mode, since it reads the current nodes the threads maintain themselves.
+	bool ProfilingMgr::start_sampling(unsigned intervalMicroseconds)
 	{
-		return new node(id);
+		if (m_recordingMode.load(std::memory_order_relaxed) != recording_mode::tree || m_samplerRunning.load())
+			return false;
+
+		// A previous sampler thread may still be finishing
+		if (m_samplerThread.joinable())
+			m_samplerThread.join();
+
+		m_samplingInterval = intervalMicroseconds > 0 ? intervalMicroseconds : 1;
+		m_samplerRunning.store(true);
+		m_samplerThread = std::thread(&ProfilingMgr::sampler_loop, this);
+		return true;
 	}
 
+	// Stops the sampler thread. The hits gathered so far are kept.
+	void ProfilingMgr::stop_sampling()
+	{
+		m_samplerRunning.store(false);
+		if (m_samplerThread.joinable())
+			m_samplerThread.join();
+	}
 
-	// Helper function to free the memory of a specific node.
-	void ProfilingMgr::free_node(ProfilingMgr::node* nodeToFree) const
+	bool ProfilingMgr::is_sampling() const
 	{
-		delete nodeToFree;
-		nodeToFree = nullptr;
+		return m_samplerRunning.load();
 	}
 
 
-	// Helper function to free the memory of all the nodes in a specific tree.
-	void ProfilingMgr::free_tree(ProfilingMgr::node* treeToFree) const
+	// Returns the cost of one profiled scope as seen by the scope that encloses it, measured at startup in ticks of
+	// the profiler clock.
+	unsigned long long ProfilingMgr::get_scope_overhead() const
 	{
-		// If we reached a null node, return
-		if (treeToFree == nullptr)
-			return;
+		return m_scopeOverhead.load(std::memory_order_relaxed);
+	}
 
-		// Delete the nodes using post-order traversal
-		free_tree(treeToFree->m_child);
-		free_tree(treeToFree->m_sibling);
-		free_node(treeToFree);
+	// Returns the part of the cost of a profiled scope that falls inside its own measurement.
+	unsigned long long ProfilingMgr::get_self_overhead() const
+	{
+		return m_selfOverhead.load(std::memory_order_relaxed);
+	}
+
+	// Enables/disables subtracting the overhead of the profiler from the measured times (enabled by default).
+	// Only applies to the tree mode.
+	void ProfilingMgr::set_overhead_compensation(bool enabled)
+	{
+		m_compensateOverhead.store(enabled, std::memory_order_relaxed);
+	}
+	bool ProfilingMgr::get_overhead_compensation() const
+	{
+		return m_compensateOverhead.load(std::memory_order_relaxed);
+	}
+
+
+	// Adds an amount to a counter of the calling thread. The counters of all the threads are summed up once per frame.
+	void ProfilingMgr::add_to_counter(channel_descriptor& channel, long long amount)
+	{
+		unsigned channelIndex = channel.m_index.load(std::memory_order_relaxed);
+		if (channelIndex == channel_descriptor::INVALID_INDEX)
+			channelIndex = get_channel_index(channel);
+
+		// Only this thread writes the slot, so there is no need for a locked add
+		std::atomic<long long>& slot = get_thread_data()->m_channelValues[channelIndex];
+		slot.store(slot.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	// Sets a gauge of the calling thread. The gauges of all the threads are summed up once per frame.
+	void ProfilingMgr::set_gauge(channel_descriptor& channel, long long value)
+	{
+		unsigned channelIndex = channel.m_index.load(std::memory_order_relaxed);
+		if (channelIndex == channel_descriptor::INVALID_INDEX)
+			channelIndex = get_channel_index(channel);
+
+		get_thread_data()->m_channelValues[channelIndex].store(value, std::memory_order_relaxed);
+	}
+
+	// Returns the values of a channel over the last frames. Updated by new_frame().
+	const ProfilingMgr::channel_history& ProfilingMgr::get_channel_history(unsigned channelIndex) const
+	{
+		return m_channelHistory[channelIndex];
+	}
+
+	// Returns the duration of the last frames in ticks of the profiler clock. Updated by new_frame().
+	const ProfilingMgr::channel_history& ProfilingMgr::get_frame_history() const
+	{
+		return m_frameHistory;
+	}
+
+	// Returns the number of frames started with new_frame() so far.
+	unsigned long long ProfilingMgr::get_frame_index() const
+	{
+		return m_frameIndex.load(std::memory_order_relaxed);
+	}
+
+	// Sequence number of the channel and frame histories, odd while new_frame() pushes into them. Other threads read
+	// it before and after reading the histories to detect a push in the middle of their read.
+	unsigned ProfilingMgr::get_channel_sequence() const
+	{
+		return m_channelSequence.load(std::memory_order_acquire);
+	}
+
+	// Returns the index of the frame stored at age 0 of the channel and frame histories.
+	unsigned long long ProfilingMgr::get_sampled_frame() const
+	{
+		return m_sampledFrame.load(std::memory_order_relaxed);
+	}
+
+	// Getter and setter for the longest frame (time between two new_frame() calls) that doesn't notify the budget
+	// listener. 0 disables the check.
+	double ProfilingMgr::get_frame_budget() const
+	{
+		return Clock::to_ms(m_frameBudget.load(std::memory_order_relaxed));
+	}
+	void ProfilingMgr::set_frame_budget(double milliseconds)
+	{
+		double ticks = milliseconds > 0.0 ? milliseconds * 1e-3 * Clock::ticks_per_second() : 0.0;
+		m_frameBudget.store(static_cast<unsigned long long>(ticks), std::memory_order_relaxed);
 	}
 
+	// Sets the object notified of the frames over budget (nullptr for none). Must not be changed while another
+	// thread is calling new_frame().
+	void ProfilingMgr::set_budget_listener(budget_listener* listener)
+	{
+		m_budgetListener.store(listener, std::memory_order_release);
+	}
 
-	// Reset the stats of all the nodes in the tree passed as parameter.
-	void ProfilingMgr::reset_tree_stats(node* treeToReset) const
+	// Counts an allocation of the given size in the current node of the calling thread (tree mode only).
+	// Meant to be called from allocator hooks, see ImGuiFormatter::hook_allocator.
+	void ProfilingMgr::count_allocation(size_t bytes)
 	{
-		if (treeToReset == nullptr)
+		// In events mode the trees belong to the pump thread
+		if (!is_profiling(CATEGORY_ALL) || m_recordingMode.load(std::memory_order_relaxed) == recording_mode::events)
 			return;
 
-		reset_tree_stats(treeToReset->m_child);
-		reset_tree_stats(treeToReset->m_sibling);
-		treeToReset->m_stats.reset();
+		node* current = get_thread_data()->m_currentNode.load(std::memory_order_relaxed);
+		current->m_stats.m_allocCount++;
+		current->m_stats.m_allocBytes += bytes;
+	}
+
+	// Sums the channels of all the threads into their history and records the duration of the frame that just
+	// ended. Appends the values to the event stream of the calling thread when recording events.
+	unsigned long long ProfilingMgr::sample_channels(thread_data* data, unsigned long long frameStart)
+	{
+		std::lock_guard<std::mutex> lock(m_channelMutex);
+		bool recordEvents = m_recordEvents.load(std::memory_order_relaxed);
+
+		// A new length reallocates the histories, which is put off while other threads read them
+		unsigned historyLength = m_historyLength.load(std::memory_order_relaxed);
+		bool resizing = historyLength != m_channelCapacity && begin_history_resize();
+		if (resizing)
+			m_channelCapacity = historyLength;
+
+		m_channelSequence.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		m_sampledFrame.store(m_frameIndex.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+		// Nothing to measure before the first frame
+		unsigned long long frameCycles = m_lastFrameStart != 0 ? frameStart - m_lastFrameStart : 0;
+		if (m_lastFrameStart != 0)
+			m_frameHistory.push(static_cast<long long>(frameCycles), m_channelCapacity);
+		m_lastFrameStart = frameStart;
+
+		unsigned channelCount = get_channel_count();
+		for (unsigned channelIndex = 0; channelIndex < channelCount; ++channelIndex)
+		{
+			bool isCounter = get_channel(channelIndex)->m_kind == channel_kind::counter;
+			long long value = 0;
+			for (thread_data* thread = get_thread_list(); thread; thread = thread->m_next)
+			{
+				long long current = thread->m_channelValues[channelIndex].load(std::memory_order_relaxed);
+				if (isCounter)
+				{
+					value += current - thread->m_sampledValues[channelIndex];
+					thread->m_sampledValues[channelIndex] = current;
+				}
+				else
+				{
+					value += current;
+				}
+			}
+
+			m_channelHistory[channelIndex].push(value, m_channelCapacity);
+			if (recordEvents)
+				record_event(data, static_cast<unsigned long long>(value), event_type::channel, channelIndex);
+		}
+
+		m_channelSequence.fetch_add(1, std::memory_order_release);
+		if (resizing)
+			end_history_resize();
+		return frameCycles;
 	}
 
+	// Measures the overhead of the profiler on the calling thread, using a thread_data of its own so that no
+	// registered tree is touched. Batches of empty scopes are timed from outside (what an enclosing scope sees) and
+	// from inside (what the empty scope measures itself). The fastest batch is kept, since it is the one with the
+	// least interference from the OS; the measurement stops once it doesn't improve anymore.
+	void ProfilingMgr::measure_overhead()
+	{
+		thread_data calibration(~0u);
+		calibration.m_root = create_node(&calibration, s_rootScope.m_index.load(std::memory_order_relaxed));
+		calibration.m_currentNode.store(calibration.m_root, std::memory_order_relaxed);
+		calibration.m_frameIndex = m_frameIndex.load(std::memory_order_relaxed);
+
+		thread_data* previousData = t_threadData;
+		t_threadData = &calibration;
+		bool previousCompensation = m_compensateOverhead.exchange(false);
+
+		unsigned long long bestScope = std::numeric_limits<unsigned long long>::max();
+		unsigned long long bestSelf = std::numeric_limits<unsigned long long>::max();
+		unsigned stableBatches = 0;
+		for (unsigned batch = 0; batch < OVERHEAD_MAX_BATCHES && stableBatches < OVERHEAD_STABLE_BATCHES; ++batch)
+		{
+			// Same calls as the ScopedProfiler (minus get_instance, which can't be used while constructing the instance)
+			unsigned long long start = Clock::now();
+			for (unsigned i = 0; i < OVERHEAD_BATCH_CALLS; ++i)
+				exit(enter(s_calibrationScope));
+			unsigned long long end = Clock::now();
+
+			node_stats& stats = calibration.m_root->m_child.load(std::memory_order_relaxed)->m_stats;
+			unsigned long long scopeCost = (end - start) / OVERHEAD_BATCH_CALLS;
+			unsigned long long selfCost = stats.m_totalCycles / OVERHEAD_BATCH_CALLS;
+			stats.reset();
+
+			// Improvements within 2% count as noise
+			if (scopeCost < bestScope - bestScope / 50)
+				stableBatches = 0;
+			else
+				stableBatches++;
+
+			bestScope = std::min(bestScope, scopeCost);
+			bestSelf = std::min(bestSelf, selfCost);
+		}
+
+		t_threadData = previousData;
+		m_scopeOverhead.store(bestScope, std::memory_order_relaxed);
+		m_selfOverhead.store(std::min(bestSelf, bestScope), std::memory_order_relaxed);
+		m_compensateOverhead.store(previousCompensation);
+	}
+
+	// Body of the sampler thread.
+	void ProfilingMgr::sampler_loop()
+	{
+		while (m_samplerRunning.load(std::memory_order_relaxed))
+		{
+			std::this_thread::sleep_for(std::chrono::microseconds(m_samplingInterval));
+
+			// Nodes are never freed while the manager lives, so the current node of any thread can be read safely.
+			// Only the sampler writes the hit counters.
+			for (thread_data* thread = get_thread_list(); thread; thread = thread->m_next)
+			{
+				if (thread->m_finished.load(std::memory_order_relaxed))
+					continue;
+
+				node* current = thread->m_currentNode.load(std::memory_order_acquire);
+				current->m_sampleHits++;
+				thread->m_sampleCount++;
+			}
+		}
+	}
+
+
+	// Builds the tree of a thread from its events, as enter()/exit()/new_frame() do in tree mode. Only the pump
+	// thread touches the trees in events mode, so a frame start rolls the trees of all the threads at once.
+	void ProfilingMgr::replay_events(thread_data* thread, const event* events, unsigned count)
+	{
+		for (unsigned i = 0; i < count; ++i)
+		{
+			const event& e = events[i];
+			if (e.is_enter())
+			{
+				node* child = enter_node(thread, e.m_scope);
+				if (child)
+					child->m_stats.m_startCycles = e.m_time;
+			}
+			else if (e.is_exit())
+			{
+				exit_node(thread, e.m_time, false);
+			}
+			else if (e.is_frame())
+			{
+				unsigned historyLength = m_historyLength.load(std::memory_order_relaxed);
+				for (thread_data* other = get_thread_list(); other; other = other->m_next)
+				{
+					validate_stack(other);
+					roll_tree_stats(other, historyLength);
+				}
+			}
+		}
+	}
+
+	// Body of the pump thread.
+	void ProfilingMgr::pump_loop()
+	{
+		std::unique_lock<std::mutex> lock(m_sinkMutex);
+		while (m_pumpRunning)
+		{
+			m_pumpWakeUp.wait_for(lock, std::chrono::milliseconds(EVENT_PUMP_INTERVAL_MS));
+			pump_events();
+		}
+	}
+
+
+	ProfilingMgr::thread_data::thread_data(unsigned index)
+		:	m_index(index)
+	{
+	}
+
+	// Dtor. Frees all the event chunks and the pages of scope stats of the thread.
+	ProfilingMgr::thread_data::~thread_data()
+	{
+		auto free_list = [](event_chunk* chunk)
+		{
+			while (chunk)
+			{
+				event_chunk* next = chunk->m_next;
+				delete chunk;
+				chunk = next;
+			}
+		};
+
+		delete m_eventChunk;
+		free_list(m_publishedChunks.exchange(nullptr));
+		free_list(m_freeChunks.exchange(nullptr));
+
+		for (std::atomic<scope_stats*>& page : m_scopeStatsPages)
+			delete[] page.load(std::memory_order_relaxed);
+	}
+
+	// Returns the stats of a scope over the last frame, nullptr if the thread never ran a scope of its page.
+	const ProfilingMgr::scope_stats* ProfilingMgr::thread_data::get_scope_stats(unsigned scopeIndex) const
+	{
+		if (scopeIndex >= SCOPES_PER_PAGE * MAX_SCOPE_PAGES)
+			return nullptr;
+
+		const scope_stats* page = m_scopeStatsPages[scopeIndex / SCOPES_PER_PAGE].load(std::memory_order_acquire);
+		return page ? &page[scopeIndex % SCOPES_PER_PAGE] : nullptr;
+	}
+
+
+	ProfilingMgr::node_stats::node_stats()
+		:	m_recursionLevel(0),
+			m_callCount(0),
+			m_startCycles(0),
+			m_totalCycles(0)
+	{
+		m_maxCycles = 0;
+		m_minCycles = std::numeric_limits<unsigned long long>::max();
+	}
+
+	// Resets all the stats to 0 or their default value. The recursion level and start cycles are kept, since
+	// the scope may still be running when the frame starts.
+	void ProfilingMgr::node_stats::reset()
+	{
+		m_callCount = 0;
+		m_totalCycles = 0;
+		m_maxCycles = 0;
+		m_minCycles = std::numeric_limits<unsigned long long>::max();
+		m_childCycles = 0;
+		m_childCalls = 0;
+		m_allocCount = 0;
+		m_allocBytes = 0;
+	}
+
+	// Returns the cycles spent in the node itself rather than in its children. Only valid while rolling the frame.
+	unsigned long long ProfilingMgr::node_stats::self_cycles() const
+	{
+		// A child still running when its parent exited may have been counted in a previous frame
+		return m_totalCycles > m_childCycles ? m_totalCycles - m_childCycles : 0;
+	}
+
+
+	// Records the stats of the frame that just ended, overwriting the oldest frame when full. The columns are
+	// (re)allocated here whenever the capacity differs from the requested one.
+	void ProfilingMgr::node_history::push(const node_stats& stats, unsigned capacity)
+	{
+		if (m_totalCycles.size() != capacity)
+		{
+			m_totalCycles.assign(capacity, 0);
+			m_maxCycles.assign(capacity, 0);
+			m_callCount.assign(capacity, 0);
+			m_selfCycles.assign(capacity, 0);
+			m_childCalls.assign(capacity, 0);
+			m_allocCount.assign(capacity, 0);
+			m_allocBytes.assign(capacity, 0);
+			m_head = 0;
+			m_size = 0;
+		}
+
+		m_totalCycles[m_head] = stats.m_totalCycles;
+		m_maxCycles[m_head] = stats.m_maxCycles;
+		m_callCount[m_head] = stats.m_callCount;
+		m_selfCycles[m_head] = stats.self_cycles();
+		m_childCalls[m_head] = stats.m_childCalls;
+		m_allocCount[m_head] = stats.m_allocCount;
+		m_allocBytes[m_head] = stats.m_allocBytes;
+
+		m_head = (m_head + 1) % capacity;
+		if (m_size < capacity)
+			m_size++;
+	}
+
+	// Returns the number of frames currently stored.
+	unsigned ProfilingMgr::node_history::size() const
+	{
+		return m_size;
+	}
+
+	// Returns the total cycles of the frame "age" frames ago (0 is the last recorded frame).
+	unsigned long long ProfilingMgr::node_history::total_cycles(unsigned age) const
+	{
+		if (age >= m_size)
+			return 0;
+
+		unsigned capacity = static_cast<unsigned>(m_totalCycles.size());
+		return m_totalCycles[(m_head + capacity - 1 - age) % capacity];
+	}
+
+	// Returns the call count of the frame "age" frames ago (0 is the last recorded frame).
+	unsigned ProfilingMgr::node_history::call_count(unsigned age) const
+	{
+		if (age >= m_size)
+			return 0;
+
+		unsigned capacity = static_cast<unsigned>(m_callCount.size());
+		return m_callCount[(m_head + capacity - 1 - age) % capacity];
+	}
+
+	// Returns the slowest call of the frame "age" frames ago (0 is the last recorded frame).
+	unsigned long long ProfilingMgr::node_history::max_cycles(unsigned age) const
+	{
+		if (age >= m_size)
+			return 0;
+
+		unsigned capacity = static_cast<unsigned>(m_maxCycles.size());
+		return m_maxCycles[(m_head + capacity - 1 - age) % capacity];
+	}
+
+	// Returns the cycles spent in the node itself (not in its children) in the frame "age" frames ago.
+	unsigned long long ProfilingMgr::node_history::self_cycles(unsigned age) const
+	{
+		if (age >= m_size)
+			return 0;
+
+		unsigned capacity = static_cast<unsigned>(m_selfCycles.size());
+		return m_selfCycles[(m_head + capacity - 1 - age) % capacity];
+	}
+
+	// Returns the calls of the children in the frame "age" frames ago.
+	unsigned ProfilingMgr::node_history::child_calls(unsigned age) const
+	{
+		if (age >= m_size)
+			return 0;
+
+		unsigned capacity = static_cast<unsigned>(m_childCalls.size());
+		return m_childCalls[(m_head + capacity - 1 - age) % capacity];
+	}
+
+	// Returns the allocations counted in the node itself in the frame "age" frames ago.
+	unsigned ProfilingMgr::node_history::alloc_count(unsigned age) const
+	{
+		if (age >= m_size)
+			return 0;
+
+		unsigned capacity = static_cast<unsigned>(m_allocCount.size());
+		return m_allocCount[(m_head + capacity - 1 - age) % capacity];
+	}
+
+	// Returns the bytes allocated in the node itself in the frame "age" frames ago.
+	unsigned long long ProfilingMgr::node_history::alloc_bytes(unsigned age) const
+	{
+		if (age >= m_size)
+			return 0;
+
+		unsigned capacity = static_cast<unsigned>(m_allocBytes.size());
+		return m_allocBytes[(m_head + capacity - 1 - age) % capacity];
+	}
+
+	// Records the value of the frame that just ended, overwriting the oldest frame when full. The buffer is
+	// (re)allocated here whenever the capacity differs from the requested one.
+	void ProfilingMgr::channel_history::push(long long value, unsigned capacity)
+	{
+		if (m_values.size() != capacity)
+		{
+			m_values.assign(capacity, 0);
+			m_head = 0;
+			m_size = 0;
+		}
+
+		m_values[m_head] = value;
+		m_head = (m_head + 1) % capacity;
+		if (m_size < capacity)
+			m_size++;
+	}
+
+	// Returns the number of frames currently stored.
+	unsigned ProfilingMgr::channel_history::size() const
+	{
+		return m_size;
+	}
+
+	// Returns the value of the frame "age" frames ago (0 is the last recorded frame).
+	long long ProfilingMgr::channel_history::value(unsigned age) const
+	{
+		if (age >= m_size)
+			return 0;
+
+		unsigned capacity = static_cast<unsigned>(m_values.size());
+		return m_values[(m_head + capacity - 1 - age) % capacity];
+	}
+
+
+	// Computes the rolling mean, percentiles and maximums over all the stored frames.
+	ProfilingMgr::history_summary ProfilingMgr::node_history::summarize() const
+	{
+		history_summary summary;
+		summary.m_frames = m_size;
+		if (m_size == 0)
+			return summary;
+
+		// While the buffer is not full, the stored frames are the first m_size slots
+		unsigned long long cycleSum = 0;
+		unsigned long long selfSum = 0;
+		unsigned long long callSum = 0;
+		for (unsigned i = 0; i < m_size; ++i)
+		{
+			cycleSum += m_totalCycles[i];
+			selfSum += m_selfCycles[i];
+			callSum += m_callCount[i];
+			summary.m_maxCycles = std::max(summary.m_maxCycles, m_totalCycles[i]);
+			summary.m_maxCallCycles = std::max(summary.m_maxCallCycles, m_maxCycles[i]);
+		}
+		summary.m_meanCycles = static_cast<double>(cycleSum) / m_size;
+		summary.m_meanCalls = static_cast<double>(callSum) / m_size;
+		summary.m_meanSelfCycles = static_cast<double>(selfSum) / m_size;
+
+		// Nearest-rank percentiles over a copy of the column
+		std::vector<unsigned long long> sorted(m_totalCycles.begin(), m_totalCycles.begin() + m_size);
+		auto percentile = [&sorted](double p)
+		{
+			size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+			auto nth = sorted.begin() + (rank == 0 ? 0 : rank - 1);
+			std::nth_element(sorted.begin(), nth, sorted.end());
+			return *nth;
+		};
+		summary.m_p50Cycles = percentile(0.50);
+		summary.m_p95Cycles = percentile(0.95);
+		summary.m_p99Cycles = percentile(0.99);
+
+		return summary;
+	}
+
+
+	ProfilingMgr::node::node(const scope_descriptor* scope, unsigned scopeIndex, node* parent, node* children, node* sibling)
+		:	m_id(scope ? scope->m_name : nullptr),
+			m_scope(scope),
+			m_scopeIndex(scopeIndex),
+			m_parent(parent),
+			m_child(children),
+			m_sibling(sibling)
+	{
+	}
+
+
+	// Dtor. Frees the child index table, if any.
+	ProfilingMgr::node::~node()
+	{
+		delete[] m_childTable;
+	}
+
+
+	// Helper function that returns the child node (or sibling of child) of this with the same scope index as passed.
+	// If no child exists with that index, returns nullptr.
+	ProfilingMgr::node* ProfilingMgr::node::find_child_node(unsigned scopeIndex) const
+	{
+		// The same child tends to be entered over and over again (e.g. a function called in a loop)
+		if (m_lastHit && m_lastHit->m_scopeIndex == scopeIndex)
+			return m_lastHit;
+
+		// Big fan-outs are looked up in the hash table
+		if (m_childTable)
+		{
+			unsigned mask = m_childTableCapacity - 1;
+			for (unsigned slot = hash_scope(scopeIndex) & mask; m_childTable[slot]; slot = (slot + 1) & mask)
+			{
+				if (m_childTable[slot]->m_scopeIndex == scopeIndex)
+				{
+					m_lastHit = m_childTable[slot];
+					return m_lastHit;
+				}
+			}
+
+			return nullptr;
+		}
+
+		// Traverse through the children to find it, which is cheaper than hashing for tiny fan-outs
+		node* traverser = m_child.load(std::memory_order_relaxed);
+		while (traverser)
+		{
+			if (traverser->m_scopeIndex == scopeIndex)
+			{
+				m_lastHit = traverser;
+				return traverser;
+			}
+
+			traverser = traverser->m_sibling.load(std::memory_order_relaxed);
+		}
+
+		return nullptr;
+	}
+
+	// Adds a child node (as m_child if it is null, or at the end of siblings otherwise).
+	void ProfilingMgr::node::add_child(node* child)
+	{
+		child->m_parent = this;
+		child->m_depth = m_depth + 1;
+
+		// Released, so that the formatters walking the tree from other threads see the child fully built
+		if (m_lastChild == nullptr)
+			m_child.store(child, std::memory_order_release);
+		else
+			m_lastChild->m_sibling.store(child, std::memory_order_release);
+
+		m_lastChild = child;
+		m_lastHit = child;
+		m_childCount++;
+
+		// Keep the load factor of the index table at or below one half
+		if (m_childTable && m_childCount * 2 <= m_childTableCapacity)
+			index_child(child);
+		else if (m_childCount > CHILD_LIST_THRESHOLD)
+			rebuild_child_table(m_childTableCapacity ? m_childTableCapacity * 2 : CHILD_LIST_THRESHOLD * 4);
+	}
+
+	// Inserts a child in the open-addressing index table (which must have a free slot).
+	void ProfilingMgr::node::index_child(node* child)
+	{
+		unsigned mask = m_childTableCapacity - 1;
+		unsigned slot = hash_scope(child->m_scopeIndex) & mask;
+		while (m_childTable[slot])
+			slot = (slot + 1) & mask;
+
+		m_childTable[slot] = child;
+	}
+
+	// Rebuilds the index table with the given capacity (a power of two) from the sibling list.
+	void ProfilingMgr::node::rebuild_child_table(unsigned capacity)
+	{
+		delete[] m_childTable;
+		m_childTable = new node*[capacity]();
+		m_childTableCapacity = capacity;
+
+		for (node* child = m_child.load(std::memory_order_relaxed); child; child = child->m_sibling.load(std::memory_order_relaxed))
+			index_child(child);
+	}
+
+	// Return the first child and the next sibling of the node, as published by add_child.
+	ProfilingMgr::node* ProfilingMgr::node::first_child() const
+	{
+		return m_child.load(std::memory_order_acquire);
+	}
+	ProfilingMgr::node* ProfilingMgr::node::next_sibling() const
+	{
+		return m_sibling.load(std::memory_order_acquire);
+	}
+
+
+
+	// Moves the current node of a thread to the child with the given scope (creating it if needed) and counts the call.
+	// Returns nullptr for a direct recursion, which only increases the recursion level of the current node.
+	ProfilingMgr::node* ProfilingMgr::enter_node(thread_data* data, unsigned scopeIndex) const
+	{
+		node* current = data->m_currentNode.load(std::memory_order_relaxed);
+
+		std::vector<unsigned>& activeScopes = data->m_activeScopes;
+		if (scopeIndex >= activeScopes.size())
+			activeScopes.resize((scopeIndex / SCOPES_PER_PAGE + 1) * SCOPES_PER_PAGE, 0);
+
+		// A recursive call (direct or through other scopes) is folded into the node of the running call, whose time
+		// already includes it
+		node* foldInto = nullptr;
+		if (activeScopes[scopeIndex] > 0)
+		{
+			for (size_t i = data->m_scopeStack.size(); i-- > 0;)
+			{
+				if (data->m_scopeStack[i].m_node->m_scopeIndex == scopeIndex)
+				{
+					foldInto = data->m_scopeStack[i].m_node;
+					break;
+				}
+			}
+		}
+
+		// So is a call that would make the tree too deep, into the current node
+		if (foldInto == nullptr && current->m_depth >= MAX_SCOPE_DEPTH)
+		{
+			foldInto = current;
+			data->m_depthOverflows++;
+		}
+
+		activeScopes[scopeIndex]++;
+		if (foldInto)
+		{
+			foldInto->m_stats.m_recursionLevel++;
+			data->m_scopeStack.push_back({ foldInto, current, scopeIndex });
+			data->m_currentNode.store(foldInto, std::memory_order_release);
+			return nullptr;
+		}
+
+		// Otherwise check to see if this scope already exists as a child of the current node
+		node* child = current->find_child_node(scopeIndex);
+
+		// If it doesn't exist, create a node for it
+		if (child == nullptr)
+		{
+			child = create_node(data, scopeIndex);
+			current->add_child(child);
+		}
+
+		data->m_scopeStack.push_back({ child, current, scopeIndex });
+		data->m_currentNode.store(child, std::memory_order_release);
+		child->m_stats.m_callCount++;
+		return child;
+	}
+
+	// Records the stats of the call of the current node of a thread that ended at endCycles and moves back to its parent.
+	// Returns false if there was no scope to exit.
+	bool ProfilingMgr::exit_node(thread_data* data, unsigned long long endCycles, bool compensate) const
+	{
+		// Exiting more scopes than were entered would leave the tree through the root
+		if (data->m_scopeStack.empty())
+			return false;
+
+		stack_entry entry = data->m_scopeStack.back();
+		data->m_scopeStack.pop_back();
+		data->m_activeScopes[entry.m_scopeIndex]--;
+		data->m_currentNode.store(entry.m_returnNode, std::memory_order_relaxed);
+
+		// If the call was folded, simply reduce the recursion level
+		node* current = entry.m_node;
+		if (current->m_stats.m_recursionLevel > 0)
+		{
+			current->m_stats.m_recursionLevel--;
+			return true;
+		}
+
+		// Otherwise, record CPU cycles and return to parent
+		unsigned long long cyclesTaken = endCycles - current->m_stats.m_startCycles;
+
+		// Every scope entered during the call (at any depth) added the overhead of the profiler to it
+		if (compensate && m_compensateOverhead.load(std::memory_order_relaxed))
+		{
+			unsigned long long nestedScopes = data->m_scopeSerial - current->m_stats.m_startSerial;
+			unsigned long long overhead = m_selfOverhead.load(std::memory_order_relaxed) + nestedScopes * m_scopeOverhead.load(std::memory_order_relaxed);
+			cyclesTaken = cyclesTaken > overhead ? cyclesTaken - overhead : 0;
+		}
+
+		// Record on the array of samples the cycles taken for the current call of this node's scope/function
+		current->m_stats.m_previousCycles[current->m_stats.m_sampleCount++ % CALLS_RECORDED] = static_cast<float>(cyclesTaken);
+
+		// Update the maximum and minimum number of cycles
+		if (cyclesTaken > current->m_stats.m_maxCycles)
+			current->m_stats.m_maxCycles = cyclesTaken;
+		if (cyclesTaken < current->m_stats.m_minCycles)
+			current->m_stats.m_minCycles = cyclesTaken;
+
+		current->m_stats.m_totalCycles += cyclesTaken;
+		return true;
+	}
+
+	// Checks that the scope stack of a thread matches its current node, and resets both to the root otherwise.
+	// Called before rolling the stats of a frame.
+	void ProfilingMgr::validate_stack(thread_data* data) const
+	{
+		// Each call returns to the node of the call below it, and the current node is the one of the last call
+		node* expected = data->m_root;
+		bool valid = true;
+		for (const stack_entry& entry : data->m_scopeStack)
+		{
+			if (entry.m_returnNode != expected || entry.m_node->m_depth > MAX_SCOPE_DEPTH)
+			{
+				valid = false;
+				break;
+			}
+			expected = entry.m_node;
+		}
+
+		if (valid && data->m_currentNode.load(std::memory_order_relaxed) == expected)
+			return;
+
+		// The open calls can't be trusted anymore, drop them. Their exits will be ignored.
+		for (const stack_entry& entry : data->m_scopeStack)
+			entry.m_node->m_stats.m_recursionLevel = 0;
+		data->m_scopeStack.clear();
+		std::fill(data->m_activeScopes.begin(), data->m_activeScopes.end(), 0u);
+		data->m_currentNode.store(data->m_root, std::memory_order_relaxed);
+		data->m_stackRepairs++;
+	}
+
+
+	// Helper function to allocate a node of the tree of a thread for a specific scope.
+	ProfilingMgr::node* ProfilingMgr::create_node(thread_data* data, unsigned scopeIndex) const
+	{
+		return data->m_pool.allocate(get_scope(scopeIndex), scopeIndex);
+	}
+
+
+	// Returns the dense index of a scope, registering its name the first time it is seen.
+	unsigned ProfilingMgr::get_scope_index(scope_descriptor& scope)
+	{
+		std::lock_guard<std::mutex> lock(m_scopeMutex);
+
+		// Another thread may have registered this call site while we were waiting for the lock
+		unsigned scopeIndex = scope.m_index.load(std::memory_order_relaxed);
+		if (scopeIndex != scope_descriptor::INVALID_INDEX)
+			return scopeIndex;
+
+		// Call sites with the same name share their index, even across translation units
+		auto range = m_scopesByHash.equal_range(scope.m_hash);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (std::strcmp(get_scope(it->second)->m_name, scope.m_name) == 0)
+			{
+				scopeIndex = it->second;
+				break;
+			}
+		}
+
+		if (scopeIndex == scope_descriptor::INVALID_INDEX)
+		{
+			scopeIndex = add_scope(&scope);
+			m_scopesByHash.emplace(scope.m_hash, scopeIndex);
+		}
+
+		m_usedCategories.fetch_or(scope.m_category, std::memory_order_relaxed);
+		scope.m_index.store(scopeIndex, std::memory_order_relaxed);
+		return scopeIndex;
+	}
+
+	// Returns the dense index of a channel, registering its name the first time it is seen.
+	unsigned ProfilingMgr::get_channel_index(channel_descriptor& channel)
+	{
+		std::lock_guard<std::mutex> lock(m_channelMutex);
+
+		// Another thread may have registered this call site while we were waiting for the lock
+		unsigned channelIndex = channel.m_index.load(std::memory_order_relaxed);
+		if (channelIndex != channel_descriptor::INVALID_INDEX)
+			return channelIndex;
+
+		auto range = m_channelsByHash.equal_range(channel.m_hash);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (std::strcmp(get_channel(it->second)->m_name, channel.m_name) == 0)
+			{
+				channelIndex = it->second;
+				break;
+			}
+		}
+
+		if (channelIndex == channel_descriptor::INVALID_INDEX)
+		{
+			channelIndex = m_channelCount.load(std::memory_order_relaxed);
+			if (channelIndex >= MAX_CHANNELS)
+				throw std::length_error("Profiler: too many distinct channel names");
+
+			m_channels[channelIndex].store(&channel, std::memory_order_relaxed);
+			m_channelCount.store(channelIndex + 1, std::memory_order_release);
+			m_channelsByHash.emplace(channel.m_hash, channelIndex);
+		}
+
+		channel.m_index.store(channelIndex, std::memory_order_relaxed);
+		return channelIndex;
+	}
+
+	// Returns the first call site registered with the given channel index (nullptr if there is none).
+	const channel_descriptor* ProfilingMgr::get_channel(unsigned channelIndex) const
+	{
+		if (channelIndex >= m_channelCount.load(std::memory_order_acquire))
+			return nullptr;
+
+		return m_channels[channelIndex].load(std::memory_order_relaxed);
+	}
+
+	// Returns the number of channel indices handed out so far.
+	unsigned ProfilingMgr::get_channel_count() const
+	{
+		return m_channelCount.load(std::memory_order_acquire);
+	}
+
+	// Assigns the next scope index to a descriptor. m_scopeMutex must be locked.
+	unsigned ProfilingMgr::add_scope(const scope_descriptor* scope)
+	{
+		unsigned scopeIndex = m_scopeCount.load(std::memory_order_relaxed);
+		unsigned page = scopeIndex / SCOPES_PER_PAGE;
+		if (page >= MAX_SCOPE_PAGES)
+			throw std::length_error("Profiler: too many distinct scope names");
+
+		if (m_scopePages[page] == nullptr)
+			m_scopePages[page] = new std::atomic<const scope_descriptor*>[SCOPES_PER_PAGE]();
+
+		m_scopePages[page][scopeIndex % SCOPES_PER_PAGE].store(scope, std::memory_order_relaxed);
+
+		// Publish the descriptor before the index can be seen by get_scope
+		m_scopeCount.store(scopeIndex + 1, std::memory_order_release);
+		return scopeIndex;
+	}
+
+	// Returns the first call site registered with the given scope index (nullptr if there is none).
+	const scope_descriptor* ProfilingMgr::get_scope(unsigned scopeIndex) const
+	{
+		if (scopeIndex >= m_scopeCount.load(std::memory_order_acquire))
+			return nullptr;
+
+		return m_scopePages[scopeIndex / SCOPES_PER_PAGE][scopeIndex % SCOPES_PER_PAGE].load(std::memory_order_relaxed);
+	}
+
+	// Returns the number of scope indices handed out so far.
+	unsigned ProfilingMgr::get_scope_count() const
+	{
+		return m_scopeCount.load(std::memory_order_acquire);
+	}
+
+
+	// Dtor. Releases all the slabs.
+	ProfilingMgr::node_pool::~node_pool()
+	{
+		release_all();
+	}
+
+	// Constructs a new node for the given scope in the current slab, allocating a new slab if it is full.
+	ProfilingMgr::node* ProfilingMgr::node_pool::allocate(const scope_descriptor* scope, unsigned scopeIndex)
+	{
+		if (m_used == NODES_PER_SLAB)
+		{
+			slab* newSlab = new slab;
+			newSlab->m_previous = m_currentSlab;
+			m_currentSlab = newSlab;
+			m_used = 0;
+			m_slabCount++;
+		}
+
+		void* storage = m_currentSlab->m_storage + m_used * sizeof(node);
+		m_used++;
+		return new (storage) node(scope, scopeIndex);
+	}
+
+	// Destroys all the nodes and frees all the slabs at once.
+	void ProfilingMgr::node_pool::release_all()
+	{
+		unsigned constructed = m_used;
+		while (m_currentSlab)
+		{
+			node* nodes = reinterpret_cast<node*>(m_currentSlab->m_storage);
+			for (unsigned i = 0; i < constructed; ++i)
+				nodes[i].~node();
+
+			slab* previous = m_currentSlab->m_previous;
+			delete m_currentSlab;
+			m_currentSlab = previous;
+			constructed = NODES_PER_SLAB;
+		}
+
+		m_used = NODES_PER_SLAB;
+		m_slabCount = 0;
+	}
+
+	// Returns the number of nodes allocated from this pool.
+	unsigned ProfilingMgr::node_pool::size() const
+	{
+		return m_slabCount == 0 ? 0 : (m_slabCount - 1) * NODES_PER_SLAB + m_used;
+	}
+
+
+	// Records the stats of all the nodes in the tree of a thread into their history, then resets them. Computes the
+	// self time of every node and the stats per scope in the same pass.
+	void ProfilingMgr::roll_tree_stats(thread_data* data, unsigned historyLength) const
+	{
+		update_node_order(data);
+
+		// The overhead of the profiler in the frame, as seen by the code that entered the scopes
+		unsigned long long enteredScopes = data->m_scopeSerial - data->m_frameStartSerial;
+		data->m_frameStartSerial = data->m_scopeSerial;
+		if (data->m_overheadNode)
+		{
+			node_stats& overhead = data->m_overheadNode->m_stats;
+			unsigned long long scopeOverhead = m_scopeOverhead.load(std::memory_order_relaxed);
+			overhead.m_callCount = static_cast<unsigned>(enteredScopes);
+			overhead.m_totalCycles = enteredScopes * scopeOverhead;
+			overhead.m_maxCycles = enteredScopes > 0 ? scopeOverhead : 0;
+			overhead.m_minCycles = scopeOverhead;
+		}
+
+		// A new length reallocates every history of the tree, so it waits for a frame where no other thread reads them.
+		// The nodes created in the meantime get the length the rest of the tree has.
+		bool resizing = historyLength != data->m_historyCapacity && begin_history_resize();
+		if (resizing)
+			data->m_historyCapacity = historyLength;
+		unsigned capacity = data->m_historyCapacity;
+
+		// Readers on other threads (see HitchFormatter) find the frames of the node histories by their frame index
+		data->m_rollSequence.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		data->m_rollFrames.push(static_cast<long long>(m_frameIndex.load(std::memory_order_relaxed)), capacity);
+
+		// The pages of stats are only allocated for the scopes the thread runs, and never move once published since
+		// the formatters read them from other threads
+		for (std::atomic<scope_stats*>& page : data->m_scopeStatsPages)
+		{
+			if (scope_stats* stats = page.load(std::memory_order_relaxed))
+				std::fill(stats, stats + SCOPES_PER_PAGE, scope_stats());
+		}
+
+		// Parents come before their children in the array, so walking it backwards visits the children first: every
+		// node is complete (its children added their time to it) by the time it is reached
+		for (auto it = data->m_nodeOrder.rbegin(); it != data->m_nodeOrder.rend(); ++it)
+		{
+			node* current = *it;
+			node_stats& stats = current->m_stats;
+
+			if (current->m_parent)
+			{
+				current->m_parent->m_stats.m_childCycles += stats.m_totalCycles;
+				current->m_parent->m_stats.m_childCalls += stats.m_callCount;
+			}
+
+			std::atomic<scope_stats*>& page = data->m_scopeStatsPages[current->m_scopeIndex / SCOPES_PER_PAGE];
+			scope_stats* pageStats = page.load(std::memory_order_relaxed);
+			if (pageStats == nullptr)
+			{
+				pageStats = new scope_stats[SCOPES_PER_PAGE]();
+				page.store(pageStats, std::memory_order_release);
+			}
+
+			scope_stats& scope = pageStats[current->m_scopeIndex % SCOPES_PER_PAGE];
+			scope.m_selfCycles += stats.self_cycles();
+			scope.m_callCount += stats.m_callCount;
+			scope.m_maxCycles = std::max(scope.m_maxCycles, stats.m_maxCycles);
+			if (!current->m_nestedInSameScope)
+				scope.m_totalCycles += stats.m_totalCycles;
+
+			current->m_history.push(stats, capacity);
+			stats.reset();
+		}
+
+		data->m_rollSequence.fetch_add(1, std::memory_order_release);
+		if (resizing)
+			end_history_resize();
+	}
+
+	// Rebuilds the flat node array of a thread when nodes were added to its tree, and flags the nodes nested in
+	// a node of the same scope.
+	void ProfilingMgr::update_node_order(thread_data* data) const
+	{
+		if (data->m_nodeOrder.size() == data->m_pool.size())
+			return;
+
+		std::vector<node*>& order = data->m_nodeOrder;
+		order.clear();
+		order.push_back(data->m_root);
+
+		// The array itself is the queue of the breadth-first traversal
+		for (size_t i = 0; i < order.size(); ++i)
+		{
+			node* current = order[i];
+
+			current->m_nestedInSameScope = false;
+			for (node* ancestor = current->m_parent; ancestor; ancestor = ancestor->m_parent)
+			{
+				if (ancestor->m_scopeIndex == current->m_scopeIndex)
+				{
+					current->m_nestedInSameScope = true;
+					break;
+				}
+			}
+
+			for (node* child = current->m_child.load(std::memory_order_relaxed); child; child = child->m_sibling.load(std::memory_order_relaxed))
+				order.push_back(child);
+		}
+	}
 }
 
-#endif	// USE_PROFILER
\ No newline at end of file
+#endif	// USE_PROFILER
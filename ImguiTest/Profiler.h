@@ -15,74 +15,535 @@
 
 
 #if USE_PROFILER
+
+#if defined(_MSC_VER)
+#define PROFILER_FUNCTION_SIGNATURE __FUNCSIG__
+#else
+#define PROFILER_FUNCTION_SIGNATURE __PRETTY_FUNCTION__
+#endif
+
+#define PROFILER_CONCAT_IMPL(a, b) a##b
+#define PROFILER_CONCAT(a, b) PROFILER_CONCAT_IMPL(a, b)
+
+// Declares the static descriptor of a call site followed by the scoped profiler that uses it
+#define PROFILER_SCOPE(nameId, category)	static Profiler::scope_descriptor PROFILER_CONCAT(profScope, __LINE__)(nameId, __FILE__, __LINE__, category); \
+											Profiler::ScopedProfiler PROFILER_CONCAT(prof, __LINE__)(PROFILER_CONCAT(profScope, __LINE__));
+
 // Client must use this macros so that code still compiles when undefining USE_PROFILER
-#define SCOPED_PROFILER(nameId) Profiler::ScopedProfiler prof##__LINE__(nameId);			// Scoped profiler where the user can specify an ID
-#define FUNCTION_PROFILER()		Profiler::ScopedProfiler prof##__LINE__(__FUNCSIG__);		// Scoped profiler that uses the signature of the function we are in as the ID
+#define SCOPED_PROFILER(nameId) PROFILER_SCOPE(nameId, Profiler::CATEGORY_DEFAULT)								// Scoped profiler where the user can specify an ID (a string literal)
+#define SCOPED_PROFILER_CATEGORY(nameId, category) PROFILER_SCOPE(nameId, category)							// Scoped profiler that is only active while its category is enabled
+#define FUNCTION_PROFILER()		PROFILER_SCOPE(PROFILER_FUNCTION_SIGNATURE, Profiler::CATEGORY_DEFAULT)			// Scoped profiler that uses the signature of the function we are in as the ID
 #define PROF_NEW_FRAME()		Profiler::ProfilingMgr::get_instance().new_frame();
 #define PROF_SET_ACTIVE(active) Profiler::ProfilingMgr::get_instance().setProfilerActive(active);
 #define PROF_GET_ACTIVE()		Profiler::ProfilingMgr::get_instance().getProfilerActive();
+#define PROF_THREAD_NAME(name)	Profiler::ProfilingMgr::get_instance().set_thread_name(name);	// Names the profiling tree of the calling thread
+#define PROF_START_SAMPLING(intervalMicroseconds) Profiler::ProfilingMgr::get_instance().start_sampling(intervalMicroseconds);
+#define PROF_STOP_SAMPLING()	Profiler::ProfilingMgr::get_instance().stop_sampling();
+#define PROF_SET_CATEGORIES(categories) Profiler::ProfilingMgr::get_instance().set_enabled_categories(categories);	// Mask of the categories profiled (all by default)
+#define PROF_SET_EVENTS_MODE(eventsMode) Profiler::ProfilingMgr::get_instance().set_recording_mode((eventsMode) ? Profiler::ProfilingMgr::recording_mode::events : Profiler::ProfilingMgr::recording_mode::tree);	// Call before entering any scope
+#define PROF_SET_OVERHEAD_COMPENSATION(enabled) Profiler::ProfilingMgr::get_instance().set_overhead_compensation(enabled);	// Subtract the measured cost of the profiler from the times (on by default)
+#define PROF_SET_FRAME_BUDGET(milliseconds) Profiler::ProfilingMgr::get_instance().set_frame_budget(milliseconds);	// Frames longer than this notify the budget listener (0 disables it)
+
+// Declares the static descriptor of a counter/gauge call site and updates the channel of the calling thread
+#define PROFILER_CHANNEL(name, kind, function, value)	do { static Profiler::channel_descriptor PROFILER_CONCAT(profChannel, __LINE__)(name, Profiler::channel_kind::kind); \
+															if (Profiler::is_profiling(Profiler::CATEGORY_ALL)) \
+																Profiler::ProfilingMgr::get_instance().function(PROFILER_CONCAT(profChannel, __LINE__), static_cast<long long>(value)); } while (0)
+
+#define PROF_COUNTER(name, amount)	PROFILER_CHANNEL(name, counter, add_to_counter, amount)		// Adds an amount to a counter, which reports the sum of each frame
+#define PROF_GAUGE(name, value)		PROFILER_CHANNEL(name, gauge, set_gauge, value)				// Sets a gauge, which reports its value at the end of each frame
+
+#include "ProfilerClock.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 namespace Profiler
 {
+	// Bit mask of categories of scopes. The scopes of SCOPED_PROFILER/FUNCTION_PROFILER belong to CATEGORY_DEFAULT; the
+	// user can define categories for the subsystems with the bits from CATEGORY_USER upwards, and enable them at runtime
+	// with PROF_SET_CATEGORIES.
+	using category_mask = unsigned;
+	const category_mask CATEGORY_DEFAULT = 1u << 0;
+	const category_mask CATEGORY_USER = 1u << 1;
+	const category_mask CATEGORY_ALL = ~0u;
+
+	// Categories being profiled: the enabled categories while the profiler is active, 0 otherwise. Kept up to date by
+	// ProfilingMgr so that the scopes test it without touching the singleton.
+	extern std::atomic<category_mask> g_activeCategories;
+
+	// Returns whether the scopes of any of the given categories are being profiled.
+	inline bool is_profiling(category_mask categories)
+	{
+		return (g_activeCategories.load(std::memory_order_relaxed) & categories) != 0;
+	}
+
+	// Static description of a profiled call site. The profiling macros declare one per call site, so it is built at
+	// compile/static-init time and the hot path never deals with strings. Call sites with the same name (in any
+	// translation unit) share the same dense scope index, which is what the trees, the events and the formatters use.
+	struct scope_descriptor
+	{
+		static const unsigned INVALID_INDEX = ~0u;
+
+		constexpr scope_descriptor(const char* name, const char* file, unsigned line, category_mask category = CATEGORY_DEFAULT)
+			:	m_name(name),
+				m_file(file),
+				m_line(line),
+				m_hash(hash_name(name)),
+				m_category(category),
+				m_index(INVALID_INDEX)
+		{
+		}
+
+		// FNV-1a hash of the name.
+		static constexpr unsigned hash_name(const char* name)
+		{
+			unsigned hash = 2166136261u;
+			for (; *name; ++name)
+				hash = (hash ^ static_cast<unsigned char>(*name)) * 16777619u;
+			return hash;
+		}
+
+		const char* m_name;
+		const char* m_file;
+		unsigned m_line;
+		unsigned m_hash;
+		category_mask m_category;
+		std::atomic<unsigned> m_index;							// Dense scope index, assigned on first use (see ProfilingMgr::get_scope_index)
+	};
+
+	// Ways a channel reports its values (see PROF_COUNTER/PROF_GAUGE).
+	enum class channel_kind : unsigned
+	{
+		counter,	// Amounts added during a frame, reported as their sum (e.g. draw calls, texture uploads)
+		gauge		// Level set at any time, reported as its value when the frame ends (e.g. bytes of a vertex buffer)
+	};
+
+	// Static description of a counter or a gauge call site, declared by the macros like scope_descriptor. Call sites
+	// with the same name share the same dense channel index.
+	struct channel_descriptor
+	{
+		static const unsigned INVALID_INDEX = ~0u;
+
+		constexpr channel_descriptor(const char* name, channel_kind kind)
+			:	m_name(name),
+				m_kind(kind),
+				m_hash(scope_descriptor::hash_name(name)),
+				m_index(INVALID_INDEX)
+		{
+		}
+
+		const char* m_name;
+		channel_kind m_kind;
+		unsigned m_hash;
+		std::atomic<unsigned> m_index;							// Dense channel index, assigned on first use (see ProfilingMgr::get_channel_index)
+	};
+
 	class ScopedProfiler
 	{
 	public:
 
-		// Default ctor. Records the cycles passed since the CPU started.
-		ScopedProfiler(const char * id);
+		static const unsigned NOT_ENTERED = ~0u;
 
-		// Dtor. Records the cycles passed since the CPU started. Subtracts this
+		// Default ctor. Records the current time of the profiler clock. When the category of the scope isn't being
+		// profiled, it only costs a branch on g_activeCategories.
+		ScopedProfiler(scope_descriptor& scope)
+			:	m_token(is_profiling(scope.m_category) ? enter(scope) : NOT_ENTERED)
+		{
+		}
+
+		// Dtor. Records the current time of the profiler clock. Subtracts this
 		// with the constructor recording to get the cycles that have passed since
 		// construction of this object.
-		~ScopedProfiler();
+		~ScopedProfiler()
+		{
+			if (m_token != NOT_ENTERED)
+				exit(m_token);
+		}
+
+		ScopedProfiler(const ScopedProfiler&) = delete;
+		ScopedProfiler& operator=(const ScopedProfiler&) = delete;
 
 	private:
+		// Out of line, so that the code inlined into every scope stays small.
+		static unsigned enter(scope_descriptor& scope);
+		static void exit(unsigned token);
+
+		// Exit token returned by ProfilingMgr::enter, or NOT_ENTERED. Besides pairing the exit when the profiler is
+		// disabled inside the scope, it lets the exit close the scopes that were left open inside this one.
+		unsigned m_token;
 	};
 
 
 	// This will be the ammount of calls to each function whose stats will be recorded, for graph plotting purposes.
 	const unsigned CALLS_RECORDED = 20;
 
+	// Default ammount of frames kept in the history of every node (see ProfilingMgr::set_history_length).
+	const unsigned HISTORY_FRAMES = 600;
+
+	// Ammount of events stored in each chunk of the event stream of a thread (64KB per chunk).
+	const unsigned EVENTS_PER_CHUNK = 4096;
+
+	// Milliseconds between two deliveries of the recorded events to the event sinks.
+	const unsigned EVENT_PUMP_INTERVAL_MS = 5;
+
+	// Maximum amount of distinct scope names (the registry is made of pages of SCOPES_PER_PAGE scopes).
+	const unsigned SCOPES_PER_PAGE = 1024;
+	const unsigned MAX_SCOPE_PAGES = 64;
+
+	// Nodes with more children than this index them in a hash table instead of only walking the sibling list.
+	const unsigned CHILD_LIST_THRESHOLD = 8;
+
+	// Maximum depth of the trees. Scopes entered deeper than this are folded into the deepest node.
+	const unsigned MAX_SCOPE_DEPTH = 256;
+
+	// Measurement of the overhead of the profiler at startup: batches of empty scopes are timed until the fastest
+	// batch hasn't improved for OVERHEAD_STABLE_BATCHES batches in a row (or OVERHEAD_MAX_BATCHES were timed).
+	const unsigned OVERHEAD_BATCH_CALLS = 1000;
+	const unsigned OVERHEAD_STABLE_BATCHES = 10;
+	const unsigned OVERHEAD_MAX_BATCHES = 200;
+
+	// Maximum amount of distinct counter/gauge names. Every thread has a slot for each of them.
+	const unsigned MAX_CHANNELS = 256;
+
 	class ProfilingMgr
 	{
 	public:
 
+		// Stats of a node. All the "cycles" are ticks of the profiler clock (CPU cycles with the default rdtsc
+		// backend); use Clock::to_ns to report them in nanoseconds.
 		struct node_stats
 		{
 			node_stats();
 
-			// Resets all the stats to 0 or their default value.
+			// Resets all the stats to 0 or their default value (except the ones of a scope still running).
 			void reset();
 
 			unsigned m_recursionLevel;
 			unsigned m_callCount;
 			unsigned long long m_startCycles;
+			unsigned long long m_startSerial = 0;				// Scope serial of the thread when the running call was entered
 			unsigned long long m_totalCycles;
 			unsigned long long m_maxCycles;
 			unsigned long long m_minCycles;
 			float m_previousCycles[CALLS_RECORDED] = {0};
+			unsigned m_sampleCount = 0;							// Calls recorded in m_previousCycles since creation (never reset)
+			unsigned m_allocCount = 0;							// Allocations made while the node was the current one (see count_allocation)
+			unsigned long long m_allocBytes = 0;
+
+			// Filled by the children when the frame is rolled (see roll_tree_stats).
+			unsigned long long m_childCycles = 0;				// Total cycles of the children
+			unsigned m_childCalls = 0;							// Calls of the children, each adding profiler overhead to this node
+
+			// Returns the cycles spent in the node itself rather than in its children. Only valid while rolling the frame.
+			unsigned long long self_cycles() const;
+		};
+
+		// Summary of the frames kept in a node_history. Cycle values refer to the total cycles of the node in a frame,
+		// except m_maxCallCycles which is the slowest single call in any of the frames.
+		struct history_summary
+		{
+			unsigned m_frames = 0;
+			double m_meanCycles = 0.0;
+			unsigned long long m_p50Cycles = 0;
+			unsigned long long m_p95Cycles = 0;
+			unsigned long long m_p99Cycles = 0;
+			unsigned long long m_maxCycles = 0;
+			unsigned long long m_maxCallCycles = 0;
+			double m_meanCalls = 0.0;
+			double m_meanSelfCycles = 0.0;
+		};
+
+		// Ring buffer with the stats of a node over the last frames, stored as one column per stat so that
+		// the queries only touch the values they need.
+		struct node_history
+		{
+			// Records the stats of the frame that just ended, overwriting the oldest frame when full. The columns are
+			// (re)allocated here whenever the capacity differs from the requested one.
+			void push(const node_stats& stats, unsigned capacity);
+
+			// Returns the number of frames currently stored.
+			unsigned size() const;
+
+			// Returns the total cycles of the frame "age" frames ago (0 is the last recorded frame).
+			unsigned long long total_cycles(unsigned age) const;
+
+			// Returns the call count of the frame "age" frames ago (0 is the last recorded frame).
+			unsigned call_count(unsigned age) const;
+
+			// Returns the slowest call of the frame "age" frames ago (0 is the last recorded frame).
+			unsigned long long max_cycles(unsigned age) const;
+
+			// Returns the cycles spent in the node itself (not in its children) in the frame "age" frames ago.
+			unsigned long long self_cycles(unsigned age) const;
+
+			// Returns the calls of the children in the frame "age" frames ago.
+			unsigned child_calls(unsigned age) const;
+
+			// Returns the allocations counted in the node itself in the frame "age" frames ago.
+			unsigned alloc_count(unsigned age) const;
+
+			// Returns the bytes allocated in the node itself in the frame "age" frames ago.
+			unsigned long long alloc_bytes(unsigned age) const;
+
+			// Computes the rolling mean, percentiles and maximums over all the stored frames.
+			history_summary summarize() const;
+
+			std::vector<unsigned long long> m_totalCycles;
+			std::vector<unsigned long long> m_maxCycles;
+			std::vector<unsigned> m_callCount;
+			std::vector<unsigned long long> m_selfCycles;
+			std::vector<unsigned> m_childCalls;
+			std::vector<unsigned> m_allocCount;
+			std::vector<unsigned long long> m_allocBytes;
+			unsigned m_head = 0;								// Slot the next frame will be written to
+			unsigned m_size = 0;
+		};
+
+		// Ring buffer with the value of a channel (or the duration of the frame) over the last frames.
+		struct channel_history
+		{
+			// Records the value of the frame that just ended, overwriting the oldest frame when full. The buffer is
+			// (re)allocated here whenever the capacity differs from the requested one.
+			void push(long long value, unsigned capacity);
+
+			// Returns the number of frames currently stored.
+			unsigned size() const;
+
+			// Returns the value of the frame "age" frames ago (0 is the last recorded frame).
+			long long value(unsigned age) const;
+
+			std::vector<long long> m_values;
+			unsigned m_head = 0;								// Slot the next frame will be written to
+			unsigned m_size = 0;
 		};
 
 		struct node
 		{
-			node(const char* id = nullptr, node* parent = nullptr, node* children = nullptr, node* sibling = nullptr);
+			node(const scope_descriptor* scope = nullptr, unsigned scopeIndex = 0, node* parent = nullptr, node* children = nullptr, node* sibling = nullptr);
+			node(const node&) = delete;
+			node& operator=(const node&) = delete;
+
+			// Dtor. Frees the child index table, if any.
+			~node();
 
-			// Helper function that returns the child node of parent with the same id as passed.
-			// If no child exists with that id, returns nullptr.
-			node* find_child_node(const char* id) const;
+			// Helper function that returns the child node of parent with the same scope index as passed.
+			// If no child exists with that index, returns nullptr.
+			node* find_child_node(unsigned scopeIndex) const;
 
 			// Adds a child node (as m_child if it is null, or at the end of siblings otherwise).
 			void add_child(node* child);
 
+			// Return the first child and the next sibling of the node. The links are published with release stores
+			// (see add_child), so other threads can walk the children while the owning thread adds some.
+			node* first_child() const;
+			node* next_sibling() const;
 
-			const char* m_id = nullptr;
+
+			const char* m_id = nullptr;							// Name of the scope
+			const scope_descriptor* m_scope = nullptr;			// First call site registered with this name
+			unsigned m_scopeIndex = 0;
 			node* m_parent = nullptr;
-			node* m_child = nullptr;
-			node* m_sibling = nullptr;
+			std::atomic<node*> m_child = nullptr;				// Written by the owning thread only, read by others with first_child()
+			std::atomic<node*> m_sibling = nullptr;				// Written by the owning thread only, read by others with next_sibling()
 
 			node_stats m_stats;
+			node_history m_history;
+			unsigned long long m_sampleHits = 0;			// Times the sampler found this node as the current one (never reset)
+			bool m_nestedInSameScope = false;				// An ancestor has the same scope, so its time is already in the ancestor's
+			unsigned m_depth = 0;							// Distance to the root of the tree
+
+		private:
+			// Inserts a child in the open-addressing index table (which must have a free slot).
+			void index_child(node* child);
+
+			// Rebuilds the index table with the given capacity (a power of two) from the sibling list.
+			void rebuild_child_table(unsigned capacity);
+
+			node* m_lastChild = nullptr;					// Last sibling of m_child, so that add_child is O(1)
+			mutable node* m_lastHit = nullptr;				// Child returned by the last lookup, checked first
+			node** m_childTable = nullptr;					// Open-addressing table of children keyed on the scope index
+			unsigned m_childTableCapacity = 0;				// Size of m_childTable (0 while below CHILD_LIST_THRESHOLD)
+			unsigned m_childCount = 0;
 		};
 
+		// Slab allocator for the nodes of one tree. Nodes are constructed in place inside fixed size slabs, so
+		// allocating is a bump of an index (plus a slab allocation every NODES_PER_SLAB nodes) and the whole
+		// tree is released at once. Nodes created one after the other (e.g. the children entered by the same
+		// parent during the first frame) end up contiguous in memory.
+		class node_pool
+		{
+		public:
+			// Amount of nodes in each slab. A single slab covers most instrumented applications.
+			static const unsigned NODES_PER_SLAB = 256;
+
+			node_pool() = default;
+			node_pool(const node_pool&) = delete;
+			node_pool& operator=(const node_pool&) = delete;
+
+			// Dtor. Releases all the slabs.
+			~node_pool();
+
+			// Constructs a new node for the given scope in the current slab, allocating a new slab if it is full.
+			node* allocate(const scope_descriptor* scope, unsigned scopeIndex);
+
+			// Destroys all the nodes and frees all the slabs at once.
+			void release_all();
+
+			// Returns the number of nodes allocated from this pool.
+			unsigned size() const;
+
+		private:
+			struct slab
+			{
+				alignas(node) unsigned char m_storage[NODES_PER_SLAB * sizeof(node)];
+				slab* m_previous = nullptr;
+			};
+
+			slab* m_currentSlab = nullptr;						// Slab being filled. Full slabs are reached through m_previous
+			unsigned m_used = NODES_PER_SLAB;					// Nodes constructed in m_currentSlab
+			unsigned m_slabCount = 0;							// Number of slabs allocated
+		};
+
+		// Stats of one scope over all the call paths of a thread in the last frame (the bottom-up, or callee, view).
+		struct scope_stats
+		{
+			unsigned long long m_totalCycles = 0;				// Calls nested in a call of the same scope are only counted once
+			unsigned long long m_selfCycles = 0;
+			unsigned long long m_maxCycles = 0;					// Slowest single call
+			unsigned m_callCount = 0;
+		};
+
+		struct thread_data;
+
+		// Scope entered by a thread and not exited yet. A call of a scope that is already running on the thread (any
+		// recursion, direct or through other scopes) is folded into the node of the running call, so the trees stay
+		// bounded and the time of the recursion is only counted once, by the outermost call.
+		struct stack_entry
+		{
+			node* m_node;										// Node the call is recorded in
+			node* m_returnNode;									// Current node before the call, restored when it exits
+			unsigned m_scopeIndex;								// Scope entered (differs from the one of m_node past MAX_SCOPE_DEPTH)
+		};
+
+		enum class event_type : unsigned
+		{
+			enter,
+			exit,
+			frame,												// Start of a frame (see new_frame)
+			channel												// Value of a channel in the frame that ended at the preceding frame event
+		};
+
+		// Timestamped record of a scope entry, a scope exit, the start of a frame or the value of a channel (16 bytes).
+		struct event
+		{
+			bool is_enter() const { return m_type == event_type::enter; }
+			bool is_exit() const { return m_type == event_type::exit; }
+			bool is_frame() const { return m_type == event_type::frame; }
+			bool is_channel() const { return m_type == event_type::channel; }
+
+			// Returns the value carried by a channel event.
+			long long channel_value() const { return static_cast<long long>(m_time); }
+
+			unsigned long long m_time;							// Ticks of the profiler clock (the value, for channel events)
+			unsigned m_scope;									// Scope index of the scope entered, or channel index (unused by other events)
+			event_type m_type;
+		};
+
+		// Fixed size block of events. Each thread fills one chunk at a time and publishes it to the event pump when it
+		// is full (or when a frame starts); the pump gives it back once the sinks have consumed it.
+		struct event_chunk
+		{
+			event m_events[EVENTS_PER_CHUNK];
+			unsigned m_count = 0;
+			event_chunk* m_next = nullptr;
+		};
+
+		// Consumer of the event streams of all threads. Sinks are called from the background pump thread, one call per
+		// chunk of events of a thread (in recording order), followed by on_flush() once per delivery.
+		class event_sink
+		{
+		public:
+			virtual ~event_sink() = default;
+
+			// Receives consecutive events of one thread.
+			virtual void on_events(const thread_data& thread, const event* events, unsigned count) = 0;
+
+			// Gets called after every delivery, once all the published chunks have been passed to on_events.
+			virtual void on_flush() {}
+		};
+
+		// Gets notified when a frame takes longer than the frame budget (see set_frame_budget).
+		class budget_listener
+		{
+		public:
+			virtual ~budget_listener() = default;
+
+			// Gets called by new_frame(), on the thread that calls it, once the frame that exceeded the budget has been
+			// recorded into the history of the tree of that thread. Runs on the render thread, so it must return quickly.
+			virtual void on_budget_exceeded(unsigned long long frameIndex, unsigned long long frameCycles, unsigned long long budgetCycles) = 0;
+		};
+
+		// Profiling state of one thread. Each thread that enters a scope gets its own call tree, which is only
+		// ever modified by that thread, so enter()/exit() never need to lock. The structures are linked into
+		// a lock-free registry and are never freed before the manager, so formatters can walk them at frame end.
+		struct thread_data
+		{
+			thread_data(unsigned index);
+
+			node* m_root = nullptr;								// Root node of this thread's tree (ID = "Root")
+			std::atomic<node*> m_currentNode = nullptr;			// Represents the current function this thread is executing (read by the sampler)
+			const char* m_name = nullptr;						// Optional user given name (see PROF_THREAD_NAME)
+			unsigned m_index = 0;								// Registration order, used to identify unnamed threads
+			unsigned long long m_frameIndex = 0;				// Last frame whose start has been applied to this tree
+			std::atomic<bool> m_finished = false;				// Set when the owning thread has exited
+			node_pool m_pool;									// Storage of all the nodes of this thread's tree
+			thread_data* m_next = nullptr;						// Next thread in the registry (immutable once published)
+
+			// Dtor. Frees all the event chunks and the pages of scope stats of the thread.
+			~thread_data();
+
+			// Returns the stats of a scope over the last frame, nullptr if the thread never ran a scope of its page.
+			// Lock-free, so the formatters can read it while the thread rolls its frames.
+			const scope_stats* get_scope_stats(unsigned scopeIndex) const;
+
+			event_chunk* m_eventChunk = nullptr;				// Chunk being filled by the thread
+			unsigned m_eventSession = 0;						// Recording session the events of m_eventChunk belong to
+
+			unsigned long long m_sampleCount = 0;				// Samples taken of this thread by the sampler (never reset)
+
+			unsigned long long m_scopeSerial = 0;				// Scopes entered by the thread so far (tree mode)
+			unsigned long long m_frameStartSerial = 0;			// m_scopeSerial when the current frame started
+			node* m_overheadNode = nullptr;						// Child of the root reporting the overhead of the profiler per frame
+
+			std::vector<stack_entry> m_scopeStack;				// Scopes entered and not exited yet (tree mode, or replayed events)
+			std::vector<unsigned> m_activeScopes;				// Entries of m_scopeStack per scope index, to find recursions quickly
+			unsigned m_eventDepth = 0;							// Scopes entered and not exited yet in events mode
+			unsigned long long m_unmatchedExits = 0;			// Exits that closed scopes left open inside them, or found nothing to close (never reset)
+			unsigned long long m_depthOverflows = 0;			// Calls folded because of MAX_SCOPE_DEPTH (never reset)
+			unsigned long long m_stackRepairs = 0;				// Times the validation at frame start had to reset the stack (never reset)
+
+			std::vector<node*> m_nodeOrder;						// Nodes of the tree with parents before children, see update_node_order
+			unsigned m_historyCapacity = HISTORY_FRAMES;		// Frames the histories of the tree are allocated for (see set_history_length)
+			channel_history m_rollFrames;						// Frame index when each frame of the node histories was rolled, same ages (in events mode, when the pump replayed it)
+			std::atomic<unsigned> m_rollSequence = 0;			// Odd while roll_tree_stats pushes into the node histories
+			std::atomic<scope_stats*> m_scopeStatsPages[MAX_SCOPE_PAGES] = {};	// Last frame per scope index, a page is allocated the first time one of its scopes runs and never moved
+			std::atomic<event_chunk*> m_publishedChunks = nullptr;	// Full chunks waiting for the pump (newest first)
+			std::atomic<event_chunk*> m_freeChunks = nullptr;	// Chunks returned by the pump, ready to be reused
+
+			std::atomic<long long> m_channelValues[MAX_CHANNELS] = {};	// Written by the thread only: running total of the counters, value of the gauges
+			long long m_sampledValues[MAX_CHANNELS] = {};		// Running total of the counters when they were last sampled (see sample_channels)
+		};
+
+
+		// Ways of recording the scopes.
+		enum class recording_mode
+		{
+			tree,		// enter()/exit() update the tree of the calling thread directly (default)
+			events		// enter()/exit() only append an event; the pump thread builds the trees from the events
+		};
 
 		// Dtor. Frees the memory of the tree.
 		~ProfilingMgr();
@@ -91,44 +552,274 @@ namespace Profiler
 		static ProfilingMgr& get_instance();
 
 
-		// Gets called when a block of code to be profiled with id passed as parameter is entered and starts profiling it.
-		void enter(const char * id);
+		// Gets called when a block of code to be profiled with the scope passed as parameter is entered and starts profiling it.
+		// Whether the scope is profiled at all is decided by the caller (see ScopedProfiler), so that it can pair the exit.
+		// Returns the token to pass to exit().
+		unsigned enter(scope_descriptor& scope);
 
 		// Gets called when the current block of code that is being profiled exits, and records statistics about the number
-		// of calls, cycles passed etc.
-		void exit();
+		// of calls, cycles passed etc. Scopes entered after the one of the token and not exited yet (a missing exit) are
+		// closed first; a token whose scope was already closed is ignored.
+		void exit(unsigned token);
 
-		// Marks the start of a frame. As a result, resets all the statistics of all the nodes.
+		// Marks the start of a frame. As a result, resets all the statistics of all the nodes of the calling thread.
+		// Other threads reset their own trees the next time they enter a scope.
 		void new_frame();
 
+		// Getter and setter for the way enter()/exit() record the scopes. The mode must be selected before any scope
+		// is entered (e.g. at the start of main), since switching it changes which thread owns the trees.
+		recording_mode get_recording_mode() const;
+		void set_recording_mode(recording_mode mode);
+
 		// Getter and setter for the flag that indicates whether the profiler is active or not.
 		bool getProfilerActive();
 		void setProfilerActive(bool active);
 
-		// Return the root node of the tree.
-		node* get_root() const;
+		// Getter and setter for the categories of scopes that are profiled while the profiler is active (all of them by
+		// default). The scopes of the other categories cost a single branch.
+		category_mask get_enabled_categories() const;
+		void set_enabled_categories(category_mask categories);
 
-		// Return the current node of the tree.
-		node* get_current_node() const;
+		// Names a category (a single bit) for the formatters.
+		void set_category_name(category_mask category, const char* name);
 
-	private:
+		// Returns the name of a category (a single bit), or nullptr if it wasn't named.
+		const char* get_category_name(category_mask category) const;
 
-		node* m_root = nullptr;									// Root node of the tree (ID = "Root")
-		node* m_currentNode = nullptr;							// Represents the current function the program is executing
+		// Returns the categories of all the scopes registered so far.
+		category_mask get_used_categories() const;
 
-		bool  m_profilerActive = true;
+		// Getter and setter for the ammount of frames kept in the history of every node. A new length reallocates the
+		// histories, discarding the frames they had: each tree (and the channels) applies it when it rolls a frame while
+		// no other thread is reading the histories (see begin_history_read).
+		unsigned get_history_length() const;
+		void set_history_length(unsigned frames);
+
+		// Bracket every read of the node, channel and frame histories from a thread that doesn't push into them (the
+		// formatters). The histories are never reallocated in between, so their buffers stay valid until
+		// end_history_read. Waits for the end of a reallocation in progress, which takes at most one frame.
+		void begin_history_read();
+		void end_history_read();
+
+		// Sets the name shown by the formatters for the tree of the calling thread.
+		void set_thread_name(const char* name);
+
+		// Return the root node of the tree of the calling thread.
+		node* get_root();
+
+		// Return the current node of the tree of the calling thread.
+		node* get_current_node();
+
+		// Return the first thread of the registry. The rest are reached through thread_data::m_next.
+		thread_data* get_thread_list() const;
+
+		// Returns the dense index of a scope, registering its name the first time it is seen.
+		unsigned get_scope_index(scope_descriptor& scope);
+
+		// Returns the first call site registered with the given scope index (nullptr if there is none).
+		// Lock-free, so it can be used by the event sinks and the formatters.
+		const scope_descriptor* get_scope(unsigned scopeIndex) const;
+
+		// Returns the number of scope indices handed out so far.
+		unsigned get_scope_count() const;
+
+		// Registers a consumer of the event streams. While there is at least one sink, every thread records its
+		// scope entries, exits and frame starts, and a background thread delivers them to the sinks.
+		void add_event_sink(event_sink* sink);
+
+		// Unregisters a sink after delivering it the events published so far (including the unfinished chunk of
+		// the calling thread). Stops the background thread when it was the last sink.
+		void remove_event_sink(event_sink* sink);
+
+		// Returns whether the threads are recording events.
+		bool is_recording_events() const;
+
+		// Starts a background thread that, every intervalMicroseconds, finds the current node of each running thread
+		// and counts a hit on it. This gives a statistical view of where time goes without timing every scope.
+		// Only available in tree mode, since it reads the current nodes the threads maintain themselves.
+		bool start_sampling(unsigned intervalMicroseconds);
+
+		// Stops the sampler thread. The hits gathered so far are kept.
+		void stop_sampling();
+
+		bool is_sampling() const;
+
+		// Returns the cost of one profiled scope as seen by the scope that encloses it, measured at startup in ticks of
+		// the profiler clock.
+		unsigned long long get_scope_overhead() const;
 
-		// Helper function to allocate a node of the tree with a specific id.
-		node* create_node(const char * id) const;
+		// Returns the part of the cost of a profiled scope that falls inside its own measurement.
+		unsigned long long get_self_overhead() const;
 
-		// Helper function to free the memory of a specific node.
-		void free_node(node* nodeToFree) const;
+		// Enables/disables subtracting the overhead of the profiler from the measured times (enabled by default).
+		// Only applies to the tree mode.
+		void set_overhead_compensation(bool enabled);
+		bool get_overhead_compensation() const;
 
-		// Helper function to free the memory of all the nodes in a specific tree.
-		void free_tree(node* treeToFree) const;
+		// Adds an amount to a counter of the calling thread. The counters of all the threads are summed up once per frame.
+		void add_to_counter(channel_descriptor& channel, long long amount);
 
-		// Reset the stats of all the nodes in the tree passed as parameter.
-		void reset_tree_stats(node* treeToReset) const;
+		// Sets a gauge of the calling thread. The gauges of all the threads are summed up once per frame.
+		void set_gauge(channel_descriptor& channel, long long value);
+
+		// Returns the dense index of a channel, registering its name the first time it is seen.
+		unsigned get_channel_index(channel_descriptor& channel);
+
+		// Returns the first call site registered with the given channel index (nullptr if there is none).
+		const channel_descriptor* get_channel(unsigned channelIndex) const;
+
+		// Returns the number of channel indices handed out so far.
+		unsigned get_channel_count() const;
+
+		// Returns the values of a channel over the last frames. Updated by new_frame().
+		const channel_history& get_channel_history(unsigned channelIndex) const;
+
+		// Returns the duration of the last frames in ticks of the profiler clock. Updated by new_frame().
+		const channel_history& get_frame_history() const;
+
+		// Returns the number of frames started with new_frame() so far.
+		unsigned long long get_frame_index() const;
+
+		// Sequence number of the channel and frame histories, odd while new_frame() pushes into them. Other threads read
+		// it before and after reading the histories to detect a push in the middle of their read.
+		unsigned get_channel_sequence() const;
+
+		// Returns the index of the frame stored at age 0 of the channel and frame histories.
+		unsigned long long get_sampled_frame() const;
+
+		// Getter and setter for the longest frame (time between two new_frame() calls) that doesn't notify the budget
+		// listener. 0 disables the check.
+		double get_frame_budget() const;
+		void set_frame_budget(double milliseconds);
+
+		// Sets the object notified of the frames over budget (nullptr for none). Must not be changed while another
+		// thread is calling new_frame().
+		void set_budget_listener(budget_listener* listener);
+
+		// Counts an allocation of the given size in the current node of the calling thread (tree mode only).
+		// Meant to be called from allocator hooks, see ImGuiFormatter::hook_allocator.
+		void count_allocation(size_t bytes);
+
+	private:
+
+		std::atomic<thread_data*> m_threadList = nullptr;		// Head of the lock-free registry of per-thread trees
+		std::atomic<unsigned> m_threadCount = 0;				// Number of threads registered so far
+		std::atomic<unsigned long long> m_frameIndex = 0;		// Incremented by every new_frame()
+		std::atomic<unsigned> m_historyLength = HISTORY_FRAMES;	// Frames kept in the history of every node
+		std::atomic<unsigned> m_historyReaders = 0;				// Threads between begin_history_read and end_history_read
+		mutable std::atomic<unsigned> m_historyResizes = 0;		// Threads reallocating histories to a new length
+
+		// Returns whether the histories can be reallocated to a new length now, which is the case when no other thread
+		// is reading them. A successful call must be followed by end_history_resize.
+		bool begin_history_resize() const;
+		void end_history_resize() const;
+
+		bool  m_profilerActive = true;
+		std::atomic<category_mask> m_enabledCategories = CATEGORY_ALL;
+		std::atomic<category_mask> m_usedCategories = 0;		// Union of the categories of the registered scopes
+		std::atomic<const char*> m_categoryNames[sizeof(category_mask) * 8] = {};
+
+		std::mutex m_scopeMutex;								// Serializes the registration of new scope names
+		std::unordered_multimap<unsigned, unsigned> m_scopesByHash;	// Name hash to scope index. Protected by m_scopeMutex
+		std::atomic<const scope_descriptor*>* m_scopePages[MAX_SCOPE_PAGES] = {};	// Scope index to descriptor
+		std::atomic<unsigned> m_scopeCount = 0;
+
+		std::atomic<recording_mode> m_recordingMode = recording_mode::tree;
+		std::atomic<bool> m_recordEvents = false;				// Whether enter/exit/new_frame append to the event streams
+		std::atomic<unsigned> m_eventSession = 0;				// Incremented every time the recording starts
+		std::mutex m_sinkMutex;									// Protects the sinks and serializes the deliveries
+		std::vector<event_sink*> m_sinks;
+		std::thread m_pumpThread;								// Delivers the published chunks to the sinks
+		std::condition_variable m_pumpWakeUp;
+		bool m_pumpRunning = false;								// Protected by m_sinkMutex
+
+		// Appends an event to the stream of a thread.
+		void record_event(thread_data* data, unsigned long long time, event_type type, unsigned scopeIndex = 0) const;
+
+		// Delivers all the published chunks to the sinks and returns them to their threads. m_sinkMutex must be locked.
+		void pump_events();
+
+		std::thread m_samplerThread;
+		std::atomic<bool> m_samplerRunning = false;
+		unsigned m_samplingInterval = 0;						// Microseconds between two samples
+
+		// Body of the sampler thread.
+		void sampler_loop();
+
+		// Measures the overhead of the profiler on the calling thread, using a thread_data of its own so that no
+		// registered tree is touched.
+		void measure_overhead();
+
+		std::atomic<unsigned long long> m_scopeOverhead = 0;
+		std::atomic<unsigned long long> m_selfOverhead = 0;
+		std::atomic<bool> m_compensateOverhead = true;
+
+		std::mutex m_channelMutex;								// Serializes the registration of new channel names and the sampling
+		std::unordered_multimap<unsigned, unsigned> m_channelsByHash;	// Name hash to channel index. Protected by m_channelMutex
+		std::atomic<const channel_descriptor*> m_channels[MAX_CHANNELS] = {};	// Channel index to descriptor
+		std::atomic<unsigned> m_channelCount = 0;
+		channel_history m_channelHistory[MAX_CHANNELS];
+		channel_history m_frameHistory;
+		unsigned long long m_lastFrameStart = 0;				// Clock ticks of the last new_frame()
+		std::atomic<unsigned> m_channelSequence = 0;			// Odd while sample_channels pushes into the histories above
+		std::atomic<unsigned long long> m_sampledFrame = 0;		// Frame stored at age 0 of the histories above
+		unsigned m_channelCapacity = HISTORY_FRAMES;			// Frames the histories above are allocated for. Protected by m_channelMutex
+
+		std::atomic<unsigned long long> m_frameBudget = 0;		// Ticks of the profiler clock, 0 if disabled
+		std::atomic<budget_listener*> m_budgetListener = nullptr;
+
+		// Sums the channels of all the threads into their history and records the duration of the frame that just
+		// ended, which is returned (0 for the first frame). Appends the values to the event stream of the calling
+		// thread when recording events.
+		unsigned long long sample_channels(thread_data* data, unsigned long long frameStart);
+
+		// Builds the tree of a thread from its events, as enter()/exit()/new_frame() do in tree mode. Only the pump
+		// thread touches the trees in events mode, so a frame start rolls the trees of all the threads at once.
+		void replay_events(thread_data* thread, const event* events, unsigned count);
+
+		// Body of the pump thread.
+		void pump_loop();
+
+		// Starts or stops the event recording and the pump thread depending on the sinks and the recording mode.
+		// The lock must own m_sinkMutex, and is released when the function returns.
+		void update_recording(std::unique_lock<std::mutex>& lock);
+
+		// Returns the profiling state of the calling thread, registering it on first use.
+		thread_data* get_thread_data();
+
+		// Creates the profiling state of the calling thread and pushes it into the registry.
+		thread_data* register_thread();
+
+		// Applies the start of a new frame to the tree of the given thread.
+		void roll_frame(thread_data* data) const;
+
+		// Checks that the scope stack of a thread matches its current node, and resets both to the root otherwise.
+		// Called before rolling the stats of a frame.
+		void validate_stack(thread_data* data) const;
+
+		// Pushes a call of a scope on the stack of a thread and moves its current node to the child with the given id
+		// (creating it if needed), counting the call. Returns nullptr when the call is folded (a recursion, or a call past
+		// MAX_SCOPE_DEPTH), which only increases the recursion level of the node the call is folded into.
+		node* enter_node(thread_data* data, unsigned scopeIndex) const;
+
+		// Pops the last call from the stack of a thread, records its stats if it wasn't folded (the call ended at
+		// endCycles) and restores the current node from before the call. With compensate, the overhead of the profiler
+		// inside the call is subtracted (see measure_overhead). Returns false if there was no scope to exit.
+		bool exit_node(thread_data* data, unsigned long long endCycles, bool compensate) const;
+
+		// Helper function to allocate a node of the tree of a thread for a specific scope.
+		node* create_node(thread_data* data, unsigned scopeIndex) const;
+
+		// Assigns the next scope index to a descriptor. m_scopeMutex must be locked.
+		unsigned add_scope(const scope_descriptor* scope);
+
+		// Records the stats of all the nodes in the tree of a thread into their history, then resets them. Computes the
+		// self time of every node and the stats per scope in the same pass.
+		void roll_tree_stats(thread_data* data, unsigned historyLength) const;
+
+		// Rebuilds the flat node array of a thread when nodes were added to its tree, and flags the nodes nested in
+		// a node of the same scope.
+		void update_node_order(thread_data* data) const;
 
 		ProfilingMgr();											// Default ctor. Private because of singleton pattern
 		ProfilingMgr(const ProfilingMgr&) = delete;				// Copy ctor deleted because of singleton pattern
@@ -141,9 +832,19 @@ namespace Profiler
 
 // Empty versions of the scoped profiling macros so that the user code still compiles when deactivating the profiler
 #define SCOPED_PROFILER(nameId)
+#define SCOPED_PROFILER_CATEGORY(nameId, category)
 #define FUNCTION_PROFILER()
 #define PROF_NEW_FRAME()
 #define PROF_SET_ACTIVE(active)
 #define PROF_GET_ACTIVE()
+#define PROF_THREAD_NAME(name)
+#define PROF_SET_EVENTS_MODE(eventsMode)
+#define PROF_SET_CATEGORIES(categories)
+#define PROF_SET_OVERHEAD_COMPENSATION(enabled)
+#define PROF_SET_FRAME_BUDGET(milliseconds)
+#define PROF_COUNTER(name, amount)
+#define PROF_GAUGE(name, value)
+#define PROF_START_SAMPLING(intervalMicroseconds)
+#define PROF_STOP_SAMPLING()
 
 #endif	// USE_PROFILER
\ No newline at end of file
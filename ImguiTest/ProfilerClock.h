@@ -0,0 +1,74 @@
+/**
+* @file ProfilerClock.h
+* @brief Contains the clock used by the Profiler to timestamp scopes, together with the conversion
+*		 of its ticks to nanoseconds so that results can be compared across machines.
+*/
+
+#pragma once
+
+// Available clock backends. Set PROFILER_CLOCK to one of these before including the profiler (or in the
+// project's preprocessor definitions) to override the default one.
+#define PROFILER_CLOCK_RDTSC			0	// CPU time stamp counter, calibrated against the steady clock at startup
+#define PROFILER_CLOCK_MONOTONIC_RAW	1	// clock_gettime(CLOCK_MONOTONIC_RAW), Linux only
+#define PROFILER_CLOCK_STEADY			2	// std::chrono::steady_clock, available everywhere
+
+#ifndef PROFILER_CLOCK
+	#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+		#define PROFILER_CLOCK PROFILER_CLOCK_RDTSC
+	#elif defined(__linux__)
+		#define PROFILER_CLOCK PROFILER_CLOCK_MONOTONIC_RAW
+	#else
+		#define PROFILER_CLOCK PROFILER_CLOCK_STEADY
+	#endif
+#endif
+
+#if PROFILER_CLOCK == PROFILER_CLOCK_RDTSC
+	#if defined(_MSC_VER)
+		#include <intrin.h>		// __rdtsc
+	#else
+		#include <x86intrin.h>	// __rdtsc
+	#endif
+#elif PROFILER_CLOCK == PROFILER_CLOCK_MONOTONIC_RAW
+	#include <time.h>			// clock_gettime
+#else
+	#include <chrono>			// std::chrono::steady_clock
+#endif
+
+
+namespace Profiler
+{
+	namespace Clock
+	{
+		// Returns the current time in ticks of the selected backend. This is what gets stored in the "cycles"
+		// stats of the profiler, so it is kept inline since it runs on every scope entry and exit.
+		inline unsigned long long now()
+		{
+#if PROFILER_CLOCK == PROFILER_CLOCK_RDTSC
+			return __rdtsc();
+#elif PROFILER_CLOCK == PROFILER_CLOCK_MONOTONIC_RAW
+			timespec time;
+			clock_gettime(CLOCK_MONOTONIC_RAW, &time);
+			return static_cast<unsigned long long>(time.tv_sec) * 1000000000ull + static_cast<unsigned long long>(time.tv_nsec);
+#else
+			return static_cast<unsigned long long>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+		}
+
+		// Measures the frequency of the backend. Only the time stamp counter needs it, since its frequency depends
+		// on the machine; it is measured against the steady clock for a few milliseconds. Calling it again repeats
+		// the measurement. The profiler calls it once at startup.
+		void calibrate();
+
+		// Returns the amount of ticks per second of the backend (calibrating it on first use).
+		double ticks_per_second();
+
+		// Converts a duration in ticks to nanoseconds.
+		double to_ns(unsigned long long ticks);
+
+		// Converts a duration in ticks to milliseconds.
+		double to_ms(unsigned long long ticks);
+
+		// Returns the name of the selected backend, for the formatters.
+		const char* name();
+	}
+}
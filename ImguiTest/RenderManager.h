@@ -5,6 +5,7 @@
 #include "imgui_impl_dx11.h"
 #include <d3d11.h>
 #include <functional>
+#include "ImageLoader.h"
 //#########################################################
 //################ RENDER MANAGER #########################
 //#########################################################
@@ -94,6 +95,7 @@ public:
         // Setup Platform/Renderer backends
         ImGui_ImplWin32_Init(hWnd);
         ImGui_ImplDX11_Init(g_pd3dDevice, g_pd3dDeviceContext);
+        TextureCache::GetInstance()->SetDevice(g_pd3dDevice, g_pd3dDeviceContext);
     }
 
     void MainRenderLoop(std::function<void()> drawCallback)
@@ -103,6 +105,11 @@ public:
         ImGui_ImplDX11_NewFrame();
         ImGui_ImplWin32_NewFrame();
         ImGui::NewFrame();
+        // the background draw list is rendered first, every image of the frame is then sampled with its mips
+        ImGui::GetBackgroundDrawList()->AddCallback(TextureCache::BindSampler, nullptr);
+
+        // images decoded in the background since the last frame, before the menu draws them
+        ImageLoader::GetInstance()->Update(g_pd3dDevice);
 
         drawCallback();
 
@@ -134,6 +141,8 @@ public:
     {
         
         // Cleanup
+        ImageLoader::GetInstance()->Shutdown();
+        TextureCache::GetInstance()->Shutdown();
         ImGui_ImplDX11_Shutdown();
         ImGui_ImplWin32_Shutdown();
         ImGui::DestroyContext();
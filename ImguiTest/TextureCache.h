@@ -0,0 +1,418 @@
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+#include <d3d11.h>
+#include "imgui.h"
+#include "ImagePixels.h"
+#include "ImageAtlas.h"
+//#########################################################
+//################ TEXTURE CACHE ##########################
+//#########################################################
+
+/// <summary>
+/// Identifies a texture by the content of the file it comes from, whatever its path, and by its size and filter for
+/// the resized copies of it
+/// </summary>
+struct TextureKey {
+    uint64_t contentHash = 0;
+    size_t width = 0; // 0 for the texture of the file itself
+    size_t height = 0;
+    ResizeQuality quality = ResizeQuality::Box;
+
+    bool operator==(const TextureKey& other) const
+    {
+        return contentHash == other.contentHash && width == other.width && height == other.height && quality == other.quality;
+    }
+};
+
+/// <summary>
+/// A texture of the cache, alive as long as a handle points to it and then until the cache runs out of budget
+/// </summary>
+struct CachedTexture {
+    TextureKey key;
+    ImagePixels pixels; // kept for the textures of the files, the resized copies are made from them
+    ImVec2 size;
+    ID3D11ShaderResourceView* srv = nullptr; // with its mips, a page of the atlas for the small textures
+    AtlasRegion region; // uvs of the texture in its srv
+    size_t bytes = 0; // memory used by the texture and the pixels we keep
+    unsigned refs = 0;
+    bool unused = false; // in the least recently used list, while refs is 0
+    std::list<CachedTexture*>::iterator unusedPosition;
+};
+
+/// <summary>
+/// Reference counted handle to a texture of the cache, the texture can be evicted once every handle is gone
+/// </summary>
+class TextureHandle {
+public:
+    TextureHandle() = default;
+    explicit TextureHandle(CachedTexture* texture);
+    TextureHandle(const TextureHandle& other);
+    TextureHandle(TextureHandle&& other) noexcept;
+    TextureHandle& operator=(TextureHandle other) noexcept;
+    ~TextureHandle();
+
+    bool IsValid() const { return texture != nullptr; }
+    explicit operator bool() const { return IsValid(); }
+    bool operator==(const TextureHandle& other) const { return texture == other.texture; }
+
+    ImTextureID GetTextureID() const { return texture ? (ImTextureID)texture->srv : NULL; }
+    ImVec2 GetSize() const { return texture ? texture->size : ImVec2(0, 0); }
+    ImVec2 GetUV0() const { return texture ? texture->region.uvMin : ImVec2(0, 0); }
+    ImVec2 GetUV1() const { return texture ? texture->region.uvMax : ImVec2(1, 1); }
+    const TextureKey& GetKey() const { return texture->key; }
+    const ImagePixels& GetPixels() const { return texture->pixels; }
+
+private:
+    CachedTexture* texture = nullptr;
+};
+
+/// <summary>
+/// Shares the textures of the images, so a file is only decoded and uploaded once however many images show it, even
+/// under different paths. The textures nobody uses are kept for a while in case they are needed again and are released
+/// least recently used first when the cache goes over its memory budget. Used from the render thread only.
+/// </summary>
+class TextureCache {
+public:
+    static constexpr size_t DEFAULT_BUDGET_BYTES = 256 * 1024 * 1024;
+
+    static TextureCache* instance;
+    static TextureCache* GetInstance()
+    {
+        if (!instance)
+            instance = new TextureCache();
+        return instance;
+    }
+
+    /// <summary>
+    /// Sets the device the textures are created with, before loading anything
+    /// </summary>
+    void SetDevice(ID3D11Device* device, ID3D11DeviceContext* context)
+    {
+        this->device = device;
+        this->context = context;
+
+        // the sampler of the imgui backend only reads the first level of the textures
+        D3D11_SAMPLER_DESC desc = {};
+        desc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
+        desc.AddressU = D3D11_TEXTURE_ADDRESS_WRAP;
+        desc.AddressV = D3D11_TEXTURE_ADDRESS_WRAP;
+        desc.AddressW = D3D11_TEXTURE_ADDRESS_WRAP;
+        desc.ComparisonFunc = D3D11_COMPARISON_ALWAYS;
+        desc.MinLOD = 0.0f;
+        desc.MaxLOD = D3D11_FLOAT32_MAX;
+        if (FAILED(device->CreateSamplerState(&desc, &sampler)))
+            std::cout << "[ERROR] | " << __FUNCTION__ << " | Failed to create the sampler, the images will be drawn without their mips" << std::endl;
+    }
+
+    /// <summary>
+    /// Draw callback binding the sampler that reads the mips, in place of the one of the imgui backend. Added at the
+    /// start of the background draw list each frame, the backend doesnt bind its sampler again until the next frame.
+    /// </summary>
+    static void BindSampler(const ImDrawList*, const ImDrawCmd*)
+    {
+        TextureCache* cache = GetInstance();
+        if (cache->sampler)
+            cache->context->PSSetSamplers(0, 1, &cache->sampler);
+    }
+
+    /// <summary>
+    /// Reads a whole file, safe from any thread
+    /// </summary>
+    static bool ReadFile(const wchar_t* path, std::vector<uint8_t>& bytes)
+    {
+        std::ifstream file(std::filesystem::path(path), std::ios::binary | std::ios::ate);
+        if (!file.is_open())
+        {
+            std::cout << "Image doesnt exist , make sure the path is correct" << std::endl;
+            return false;
+        }
+        bytes.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        return static_cast<bool>(file.read(reinterpret_cast<char*>(bytes.data()), bytes.size()));
+    }
+
+    /// <summary>
+    /// Hash of the content of a file (64 bit FNV-1a), safe from any thread
+    /// </summary>
+    static uint64_t HashBytes(const std::vector<uint8_t>& bytes)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (uint8_t byte : bytes)
+        {
+            hash ^= byte;
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    /// <summary>
+    /// Returns the texture of a file, reading and decoding it only if no texture of the cache has the same content
+    /// </summary>
+    /// <returns>An invalid handle if the file couldnt be loaded</returns>
+    TextureHandle Load(const wchar_t* path)
+    {
+        TextureHandle cached = FindFile(path);
+        if (cached)
+            return cached;
+
+        std::vector<uint8_t> bytes;
+        if (!ReadFile(path, bytes))
+            return TextureHandle();
+
+        TextureKey key;
+        key.contentHash = HashBytes(bytes);
+        cached = Find(key);
+        if (cached)
+        {
+            RememberFile(path, key);
+            return cached;
+        }
+
+        ImagePixels pixels;
+        if (!pixels.Decode(bytes))
+            return TextureHandle();
+        return Insert(key, std::move(pixels), true, path);
+    }
+
+    /// <summary>
+    /// Returns the texture of a file if the file didnt change since the cache loaded it, without reading it
+    /// </summary>
+    TextureHandle FindFile(const wchar_t* path)
+    {
+        auto file = files.find(NormalizePath(path));
+        if (file == files.end() || !(file->second.stamp == GetStamp(path)))
+            return TextureHandle();
+        return Find(file->second.key);
+    }
+
+    TextureHandle Find(const TextureKey& key)
+    {
+        auto found = textures.find(key);
+        return found != textures.end() ? TextureHandle(found->second.get()) : TextureHandle();
+    }
+
+    /// <summary>
+    /// Uploads a texture with its mips and adds it to the cache, unless the cache already has one with the same key.
+    /// The small textures are packed in the atlas.
+    /// </summary>
+    /// <param name="keepPixels">Whether to keep the pixels in memory, to make resized copies from them</param>
+    /// <param name="path">File the pixels come from, nullptr for the resized copies</param>
+    /// <param name="mips">Levels already built from the pixels, built here if empty</param>
+    /// <returns>An invalid handle if the texture couldnt be created</returns>
+    TextureHandle Insert(const TextureKey& key, ImagePixels&& pixels, bool keepPixels, const wchar_t* path = nullptr,
+        std::vector<ImagePixels> mips = {})
+    {
+        if (path)
+            RememberFile(path, key);
+        TextureHandle existing = Find(key);
+        if (existing)
+            return existing;
+
+        AtlasRegion region;
+        ID3D11ShaderResourceView* srv = nullptr;
+        size_t gpuBytes = pixels.data.size();
+        if (ImageAtlas::CanPack(pixels) && atlas.Pack(device, context, pixels, region))
+        {
+            srv = atlas.GetPageView(region.page);
+            srv->AddRef();
+        }
+        else
+        {
+            if (mips.empty())
+                mips = pixels.BuildMips();
+            srv = pixels.Upload(device, mips);
+            if (!srv)
+                return TextureHandle();
+            for (const ImagePixels& mip : mips)
+                gpuBytes += mip.data.size();
+        }
+
+        auto texture = std::make_unique<CachedTexture>();
+        texture->key = key;
+        texture->size = ImVec2((float)pixels.width, (float)pixels.height);
+        texture->srv = srv;
+        texture->region = region;
+        texture->bytes = gpuBytes;
+        if (keepPixels)
+        {
+            texture->bytes += pixels.data.size();
+            texture->pixels = std::move(pixels);
+        }
+        used_bytes += texture->bytes;
+
+        TextureHandle handle(texture.get());
+        textures.emplace(key, std::move(texture));
+        Trim();
+        return handle;
+    }
+
+    /// <summary>
+    /// Sets how much memory the textures nobody uses can keep, the ones in use are never evicted
+    /// </summary>
+    void SetBudget(size_t bytes)
+    {
+        budget_bytes = bytes;
+        Trim();
+    }
+
+    size_t GetBudget() const { return budget_bytes; }
+    size_t GetUsedBytes() const { return used_bytes; }
+    size_t GetAtlasPageCount() const { return atlas.GetPageCount(); }
+
+    /// <summary>
+    /// Releases every texture, called before the device is released. The handles still alive become empty textures.
+    /// </summary>
+    void Shutdown()
+    {
+        for (auto& texture : textures)
+        {
+            if (texture.second->srv) { texture.second->srv->Release(); texture.second->srv = nullptr; }
+        }
+        budget_bytes = 0;
+        Trim();
+        atlas.Shutdown();
+        if (sampler) { sampler->Release(); sampler = nullptr; }
+        files.clear();
+    }
+
+    /// <summary>
+    /// Absolute form of a path, the one the cache and the loader know the files by
+    /// </summary>
+    static std::wstring NormalizePath(const wchar_t* path)
+    {
+        std::error_code error;
+        std::filesystem::path absolute = std::filesystem::absolute(path, error);
+        return (error ? std::filesystem::path(path) : absolute).lexically_normal().wstring();
+    }
+
+private:
+    friend class TextureHandle;
+
+    /// <summary>
+    /// Size and last write time of a file, to know if it changed since it was loaded
+    /// </summary>
+    struct FileStamp {
+        uintmax_t size = 0;
+        std::filesystem::file_time_type writeTime;
+
+        bool operator==(const FileStamp& other) const { return size == other.size && writeTime == other.writeTime; }
+    };
+
+    struct FileEntry {
+        FileStamp stamp;
+        TextureKey key;
+    };
+
+    struct KeyHasher {
+        size_t operator()(const TextureKey& key) const
+        {
+            return static_cast<size_t>(key.contentHash ^ (static_cast<uint64_t>(key.width) * 0x9E3779B97F4A7C15ull) ^ (static_cast<uint64_t>(key.height) << 32)
+                ^ (static_cast<uint64_t>(key.quality) << 60));
+        }
+    };
+
+    static FileStamp GetStamp(const wchar_t* path)
+    {
+        std::error_code error;
+        FileStamp stamp;
+        stamp.size = std::filesystem::file_size(path, error);
+        stamp.writeTime = std::filesystem::last_write_time(path, error);
+        return stamp;
+    }
+
+    void RememberFile(const wchar_t* path, const TextureKey& key)
+    {
+        FileEntry& file = files[NormalizePath(path)];
+        file.stamp = GetStamp(path);
+        file.key = key;
+    }
+
+    void AddRef(CachedTexture* texture)
+    {
+        if (texture->refs++ == 0 && texture->unused)
+        {
+            unused.erase(texture->unusedPosition);
+            texture->unused = false;
+        }
+    }
+
+    void Release(CachedTexture* texture)
+    {
+        if (--texture->refs == 0)
+        {
+            texture->unusedPosition = unused.insert(unused.end(), texture);
+            texture->unused = true;
+            Trim();
+        }
+    }
+
+    /// <summary>
+    /// Evicts the least recently used textures nobody uses until the cache fits in its budget
+    /// </summary>
+    void Trim()
+    {
+        while (used_bytes > budget_bytes && !unused.empty())
+        {
+            CachedTexture* texture = unused.front();
+            unused.pop_front();
+            if (texture->srv)
+                texture->srv->Release();
+            atlas.Release(texture->region);
+            used_bytes -= texture->bytes;
+            textures.erase(texture->key);
+        }
+    }
+
+    std::unordered_map<TextureKey, std::unique_ptr<CachedTexture>, KeyHasher> textures;
+    std::unordered_map<std::wstring, FileEntry> files; // by absolute path
+    std::list<CachedTexture*> unused; // least recently used first
+    size_t used_bytes = 0;
+    size_t budget_bytes = DEFAULT_BUDGET_BYTES;
+    ImageAtlas atlas;
+    ID3D11Device* device = nullptr;
+    ID3D11DeviceContext* context = nullptr;
+    ID3D11SamplerState* sampler = nullptr;
+};
+
+TextureCache* TextureCache::instance = nullptr;
+
+inline TextureHandle::TextureHandle(CachedTexture* texture)
+    : texture(texture)
+{
+    if (texture)
+        TextureCache::GetInstance()->AddRef(texture);
+}
+
+inline TextureHandle::TextureHandle(const TextureHandle& other)
+    : TextureHandle(other.texture)
+{
+}
+
+inline TextureHandle::TextureHandle(TextureHandle&& other) noexcept
+    : texture(other.texture)
+{
+    other.texture = nullptr;
+}
+
+inline TextureHandle& TextureHandle::operator=(TextureHandle other) noexcept
+{
+    std::swap(texture, other.texture);
+    return *this;
+}
+
+inline TextureHandle::~TextureHandle()
+{
+    if (texture)
+        TextureCache::GetInstance()->Release(texture);
+}
+
+#endif // !TEXTURECACHE_H
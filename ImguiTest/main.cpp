@@ -22,6 +22,7 @@
 //################ USER FUNCTIONS #########################
 //#########################################################
 void DrawMenu();
+void LoadImages();
 
 
 //#########################################################
@@ -34,6 +35,7 @@ LRESULT WINAPI WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam);
 // Main code
 int main(int, char**)
 {
+    PROF_THREAD_NAME("Main thread");
     SCOPED_PROFILER("main");
     // Create application window
     //ImGui_ImplWin32_EnableDpiAwareness();
@@ -53,7 +55,12 @@ int main(int, char**)
     ::ShowWindow(hwnd, SW_SHOWDEFAULT);
     ::UpdateWindow(hwnd);
 
+    PROF_HOOK_IMGUI_ALLOCATOR();
     manager->InitImGui();
+    LoadImages();
+
+    // Uncomment to let a viewer attach on localhost without drawing the profiler in the frames being measured
+    //START_SERVER(Profiler::Formatters::ServerFormatter::DEFAULT_PORT);
 
     // Main loop
     bool done = false;
@@ -72,8 +79,18 @@ int main(int, char**)
         if (done)
             break;
         manager->MainRenderLoop(DrawMenu);
+
+        // Geometry submitted this frame, next to the frame times in the Counters tab
+        if (ImDrawData* drawData = ImGui::GetDrawData())
+        {
+            PROF_GAUGE("ImGui vertices", drawData->TotalVtxCount);
+            PROF_GAUGE("ImGui indices", drawData->TotalIdxCount);
+        }
+        PROF_NEW_FRAME();
+        SERVE_FRAME();
     }
 
+    STOP_SERVER();
     manager->Shutdown();
     ::DestroyWindow(hwnd);
     ::UnregisterClassW(wc.lpszClassName, wc.hInstance);
@@ -130,8 +147,7 @@ LRESULT WINAPI WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
 
 #include <map>
 ImGuiImage test;
-ImTextureID myIconID;
-DirectX::TexMetadata iconMetadata;
+ImGuiImage icon;
 std::once_flag flag;
 
 
@@ -140,7 +156,7 @@ static std::vector<ImVec2> sparkle_positions;
 static std::vector<ImVec2> sparkle_sizes;
 
 
-bool EmojiSliderWithLabel(const char* label, float* value, float min, float max, ImTextureID knobTexture, ImTextureID starTexture, float knobRadius = 20, ImGuiSliderFlags flags = 0)
+bool EmojiSliderWithLabel(const char* label, float* value, float min, float max, ImGuiImage& knobImage, ImGuiImage& starImage, float knobRadius = 20, ImGuiSliderFlags flags = 0)
 {
     bool value_changed = false; // Declare and initialize value_changed
 
@@ -221,7 +237,7 @@ bool EmojiSliderWithLabel(const char* label, float* value, float min, float max,
 
     Rotation::ImRotateStart();
     // Draw the circular knob with the provided emoji image
-    ImGui::GetWindowDrawList()->AddImage(knobTexture, knob_pos - ImVec2(knob_radius, knob_radius), knob_pos + ImVec2(knob_radius, knob_radius), ImVec2(0, 0), ImVec2(1, 1));
+    knobImage.AddToDrawList(ImGui::GetWindowDrawList(), knob_pos - ImVec2(knob_radius, knob_radius), knob_pos + ImVec2(knob_radius, knob_radius));
     Rotation::ImRotateEnd(DirectX::XM_PI);
     // Display value using user-provided display format so the user can add prefix/suffix/decorations to the value.
     char value_buf[64];
@@ -301,7 +317,7 @@ bool EmojiSliderWithLabel(const char* label, float* value, float min, float max,
         // Draw the sparkle
         const float sparkle_alpha = it_padding->second * 0.5f; // Adjust sparkle alpha based on padding animation
         //ImGui::GetWindowDrawList()->AddCircleFilled(sparkle_pos, sparkle_size, IM_COL32(255, 255, 0, static_cast<int>(255 * sparkle_alpha)));
-        ImGui::GetWindowDrawList()->AddImage(starTexture, ImVec2(sparkle_pos.x - sparkle_size.x / 2, sparkle_pos.y - sparkle_size.y / 2), ImVec2(sparkle_pos.x + sparkle_size.x / 2, sparkle_pos.y + sparkle_size.y / 2));
+        starImage.AddToDrawList(ImGui::GetWindowDrawList(), ImVec2(sparkle_pos.x - sparkle_size.x / 2, sparkle_pos.y - sparkle_size.y / 2), ImVec2(sparkle_pos.x + sparkle_size.x / 2, sparkle_pos.y + sparkle_size.y / 2));
     }
 
     return value_changed;
@@ -318,7 +334,7 @@ enum class Edge
 
 
 
-void MoveEmojiAlongBorder(float& xPos, float& yPos, ImTextureID emoji, Edge& currentEdge)
+void MoveEmojiAlongBorder(float& xPos, float& yPos, ImGuiImage& emoji, Edge& currentEdge)
 {
     const char* text = "";
     ImGui::Text(text);
@@ -381,7 +397,7 @@ void MoveEmojiAlongBorder(float& xPos, float& yPos, ImTextureID emoji, Edge& cur
     ImGuiWindow* window = ImGui::GetCurrentWindow();
     ImVec2 rectMin = ImVec2(xPos, yPos);
     ImVec2 rectMax = ImVec2(xPos + 50, yPos + 50);
-    window->DrawList->AddImage(emoji, rectMin, rectMax);
+    emoji.AddToDrawList(window->DrawList, rectMin, rectMax);
 }
 
 
@@ -390,6 +406,21 @@ float test_float;
 int knob_radius;
 ImVec2 pos_rect;
 Edge CurrentEdge;
+
+/// <summary>
+/// Queues the images of the menu, the loader decodes them while the first frames are drawn with placeholders
+/// </summary>
+void LoadImages()
+{
+    SCOPED_PROFILER("LoadImages");
+    test = ImGuiImage::LoadAsync(L"icon.png");
+    star = ImGuiImage::LoadAsync(L"star.png");
+    test.Resize(64, 64);
+
+    icon = ImGuiImage::LoadAsync(L"icon.png");
+    icon.Bake(64, 64);
+}
+
 void DrawMenu()
 {
     
@@ -399,55 +430,11 @@ void DrawMenu()
     
     std::call_once(flag, []() {
         SCOPED_PROFILER("LambdaFunction");
-        
-        ID3D11Device* g_pd3dDevice = RenderManager::GetInstance()->GetDevice();
-        test = ImGuiImage(L"icon.png");
-        star = ImGuiImage(L"star.png");
-
-        test.Resize(64, 64);
-        DirectX::TexMetadata metadata;
-        DirectX::ScratchImage scratchImage;
-
-        HRESULT hr = DirectX::LoadFromWICFile(L"icon.png", DirectX::WIC_FLAGS_NONE, &metadata, scratchImage);
-
-        if (SUCCEEDED(hr))
-        { 
-
-            DirectX::ScratchImage resizedImage;
-
-            hr = DirectX::Resize(
-                scratchImage.GetImages(),
-                scratchImage.GetImageCount(),
-                scratchImage.GetMetadata(),
-                64,                         // Destination width
-                64,                         // Destination height
-                DirectX::TEX_FILTER_DEFAULT,
-                resizedImage
-            );
-
-            
-            using namespace DirectX;
-            ScratchImage out;
-            ID3D11ShaderResourceView* srv;
-            hr = DirectX::CreateShaderResourceView(g_pd3dDevice, resizedImage.GetImages(), resizedImage.GetImageCount(), resizedImage.GetMetadata(), &srv);
-            if (SUCCEEDED(hr))
-            {
-                myIconID = (ImTextureID)srv;
-                iconMetadata = resizedImage.GetMetadata();
-            }
-        }
 
         pos_rect = ImVec2(ImGui::GetWindowPos().x, ImGui::GetWindowPos().y);
         CurrentEdge = Edge::Right;
-
-        
         });
-    if (myIconID)
-    {
-        
-        ImGui::Image(myIconID, ImVec2(iconMetadata.width, iconMetadata.height));
-        
-    }
+    icon.Draw();
     test.Draw();
     ImGui::SameLine();
     if (ImGui::Button("Reset"))
@@ -460,13 +447,18 @@ void DrawMenu()
         test.Resize(64, 64);
     }
     ImGui::SameLine();
+    if (ImGui::Button("Bake"))
+    {
+        test.Bake(64, 64, ResizeQuality::Cubic);
+    }
+    ImGui::SameLine();
     if (ImGui::Button("Rotate"))
     {
         test.Rotation() += 45;
     }
     ImGui::SliderInt("Radius", &knob_radius, 12, 100, "%d");
-    EmojiSliderWithLabel("test", &test_float, 0, 100, test.GetTextureID(), star.GetTextureID(), knob_radius);
-    MoveEmojiAlongBorder(pos_rect.x , pos_rect.y, star.GetTextureID(), CurrentEdge);
+    EmojiSliderWithLabel("test", &test_float, 0, 100, test, star, knob_radius);
+    MoveEmojiAlongBorder(pos_rect.x , pos_rect.y, star, CurrentEdge);
     DrawFunnySquares();
 
     ImGui::End();
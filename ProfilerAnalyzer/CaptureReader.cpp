@@ -0,0 +1,460 @@
+/**
+* @file CaptureReader.cpp
+* @brief Contains the implementation of the reader of the binary capture files.
+*/
+
+
+#include "CaptureReader.h"
+#include <cstdio>		// std::FILE
+#include <cstring>		// std::memcmp, std::memcpy
+#include <deque>
+#include <stdexcept>	// std::runtime_error
+#include <unordered_map>
+
+namespace Profiler
+{
+	namespace Analyzer
+	{
+		namespace
+		{
+			const unsigned MAX_VERSION = 3;
+			const unsigned BUFFER_SIZE = 64 * 1024;
+
+			// Frames kept open after their end, for the events of the other threads that the event pump delivered
+			// after the frame start. A span that ends in an older frame is dropped.
+			const unsigned FRAME_LAG = 8;
+
+			const unsigned NO_KEY = ~0u;
+
+			// Thrown when the end of the file is reached in the middle of the records.
+			struct end_of_file {};
+
+			// Decodes a capture file into the samples of one file.
+			class capture_reader
+			{
+			public:
+				capture_reader(const char* filePath, const read_options& options);
+				~capture_reader();
+
+				// Reads the whole file and returns the samples of every key, one per complete frame.
+				void read(std::map<std::string, sample_stats>& samples, unsigned long long& frames);
+
+			private:
+				// Scope entered and not exited yet.
+				struct open_scope
+				{
+					unsigned m_key;
+					unsigned long long m_start;
+				};
+
+				struct thread_state
+				{
+					std::string m_name;
+					unsigned m_rootKey = NO_KEY;
+					unsigned long long m_lastTime = 0;
+					std::vector<open_scope> m_stack;
+					std::unordered_map<unsigned, unsigned> m_openCounts;	// Spans of each key on the stack, to count recursions once
+				};
+
+				// Time spent in every key during one frame.
+				struct frame_totals
+				{
+					unsigned long long m_start;
+					std::vector<double> m_totals;			// Indexed by key
+				};
+
+				struct key_info
+				{
+					std::string m_name;
+					bool m_reported;						// The roots of the threads only group their paths
+				};
+
+				// Reads the records up to the frame index. Throws end_of_file if the file ends before it.
+				void read_records();
+
+				unsigned char read_byte();
+				unsigned long long read_varint();
+				std::string read_string();
+
+				void read_events(unsigned threadIndex);
+
+				// Returns the key of a scope called from a node of the call tree (any node for NO_KEY), creating it the first
+				// time.
+				unsigned child_key(unsigned parentKey, unsigned scopeIndex);
+
+				// Adds a key that doesn't belong to the call tree (frame time, channels).
+				unsigned named_key(const std::string& name);
+
+				thread_state& get_thread(unsigned threadIndex);
+
+				// Adds a span to the frame it ended in.
+				void add_span(unsigned key, unsigned long long start, unsigned long long end);
+
+				void start_frame(unsigned long long time);
+
+				// Adds the samples of the oldest open frame.
+				void finish_oldest_frame();
+
+				std::FILE* m_file = nullptr;
+				const char* m_filePath;
+				read_options m_options;
+				std::vector<unsigned char> m_buffer;
+				size_t m_bufferSize = 0;
+				size_t m_bufferPosition = 0;
+
+				unsigned m_version = 0;
+				double m_nanosecondsPerTick = 1.0;
+				std::vector<std::string> m_scopes;			// Names by scope index
+				std::vector<std::string> m_channels;		// Names by channel index
+				std::unordered_map<unsigned, thread_state> m_threads;
+
+				std::vector<key_info> m_keys;
+				std::unordered_map<std::string, unsigned> m_keysByName;
+				std::unordered_map<unsigned long long, unsigned> m_childKeys;	// (parent key << 32 | scope index) to key
+				unsigned m_frameKey = NO_KEY;
+
+				std::deque<frame_totals> m_openFrames;		// The last one is the frame being recorded
+				unsigned long long m_finishedFrames = 0;
+				std::map<std::string, sample_stats>* m_samples = nullptr;
+				std::vector<sample_stats*> m_keySamples;	// Samples of each reported key, in m_samples
+			};
+
+			capture_reader::capture_reader(const char* filePath, const read_options& options)
+				:	m_filePath(filePath),
+					m_options(options),
+					m_buffer(BUFFER_SIZE)
+			{
+#ifdef _MSC_VER
+				// fopen is deprecated under /sdl, fopen_s leaves m_file null on failure
+				fopen_s(&m_file, filePath, "rb");
+#else
+				m_file = std::fopen(filePath, "rb");
+#endif
+				if (m_file == nullptr)
+					throw std::runtime_error(std::string("can't open ") + filePath);
+			}
+
+			capture_reader::~capture_reader()
+			{
+				std::fclose(m_file);
+			}
+
+			// Reads the whole file and returns the samples of every key, one per complete frame.
+			void capture_reader::read(std::map<std::string, sample_stats>& samples, unsigned long long& frames)
+			{
+				m_samples = &samples;
+				m_frameKey = named_key(run_stats::FRAME_KEY);
+
+				// Header
+				unsigned char header[16];
+				try
+				{
+					for (unsigned i = 0; i < sizeof(header); ++i)
+						header[i] = read_byte();
+				}
+				catch (const end_of_file&)
+				{
+					throw std::runtime_error(std::string(m_filePath) + " is not a capture file");
+				}
+				if (std::memcmp(header, "PRFC", 4) != 0)
+					throw std::runtime_error(std::string(m_filePath) + " is not a capture file");
+
+				for (unsigned i = 0; i < 4; ++i)
+					m_version |= static_cast<unsigned>(header[4 + i]) << (8 * i);
+				if (m_version == 0 || m_version > MAX_VERSION)
+					throw std::runtime_error(std::string(m_filePath) + " has an unsupported capture version " + std::to_string(m_version));
+
+				unsigned long long frequencyBits = 0;
+				for (unsigned i = 0; i < 8; ++i)
+					frequencyBits |= static_cast<unsigned long long>(header[8 + i]) << (8 * i);
+				double ticksPerSecond;
+				std::memcpy(&ticksPerSecond, &frequencyBits, sizeof(ticksPerSecond));
+				if (!(ticksPerSecond > 0.0))
+					throw std::runtime_error(std::string(m_filePath) + " has an invalid clock frequency");
+				m_nanosecondsPerTick = 1e9 / ticksPerSecond;
+
+				// Records, up to the frame index that precedes the footer. A capture that wasn't stopped (the application
+				// crashed) has no index, and its last record may be incomplete.
+				try
+				{
+					read_records();
+				}
+				catch (const end_of_file&)
+				{
+				}
+
+				// The last frame never ended
+				while (m_openFrames.size() > 1)
+					finish_oldest_frame();
+				frames = m_finishedFrames;
+			}
+
+			// Reads the records up to the frame index. Throws end_of_file if the file ends before it.
+			void capture_reader::read_records()
+			{
+				for (;;)
+				{
+					unsigned char tag = read_byte();
+					if (tag == 'I')
+						break;
+
+					if (tag == 'S')
+					{
+						unsigned scopeIndex = static_cast<unsigned>(read_varint());
+						if (scopeIndex >= m_scopes.size())
+							m_scopes.resize(scopeIndex + 1);
+						m_scopes[scopeIndex] = read_string();
+
+						// The call site was added in version 2
+						if (m_version >= 2)
+						{
+							read_string();
+							read_varint();
+						}
+					}
+					else if (tag == 'C')
+					{
+						unsigned channelIndex = static_cast<unsigned>(read_varint());
+						read_varint();
+						if (channelIndex >= m_channels.size())
+							m_channels.resize(channelIndex + 1);
+						m_channels[channelIndex] = read_string();
+					}
+					else if (tag == 'T')
+					{
+						unsigned threadIndex = static_cast<unsigned>(read_varint());
+
+						// Always before the events of the thread, so before its paths get their names
+						m_threads[threadIndex].m_name = read_string();
+						get_thread(threadIndex);
+					}
+					else if (tag == 'E')
+					{
+						read_events(static_cast<unsigned>(read_varint()));
+					}
+					else
+					{
+						throw std::runtime_error(std::string(m_filePath) + " has an unknown record '" + static_cast<char>(tag) + "'");
+					}
+				}
+			}
+
+			unsigned char capture_reader::read_byte()
+			{
+				if (m_bufferPosition == m_bufferSize)
+				{
+					m_bufferSize = std::fread(m_buffer.data(), 1, BUFFER_SIZE, m_file);
+					m_bufferPosition = 0;
+
+					if (m_bufferSize == 0)
+						throw end_of_file();
+				}
+				return m_buffer[m_bufferPosition++];
+			}
+
+			unsigned long long capture_reader::read_varint()
+			{
+				unsigned long long value = 0;
+				for (unsigned shift = 0; shift < 64; shift += 7)
+				{
+					unsigned char byte = read_byte();
+					value |= static_cast<unsigned long long>(byte & 0x7f) << shift;
+					if (byte < 0x80)
+						return value;
+				}
+				throw std::runtime_error(std::string(m_filePath) + " has an invalid varint");
+			}
+
+			std::string capture_reader::read_string()
+			{
+				unsigned long long length = read_varint();
+				std::string text;
+				text.reserve(static_cast<size_t>(length));
+				for (unsigned long long i = 0; i < length; ++i)
+					text.push_back(static_cast<char>(read_byte()));
+				return text;
+			}
+
+			void capture_reader::read_events(unsigned threadIndex)
+			{
+				thread_state& thread = get_thread(threadIndex);
+				unsigned long long count = read_varint();
+				for (unsigned long long i = 0; i < count; ++i)
+				{
+					unsigned long long value = read_varint();
+					unsigned kind = static_cast<unsigned>(value & 3);
+
+					// Value of a channel over the frame that ended at the last frame start
+					if (kind == 3)
+					{
+						unsigned channelIndex = static_cast<unsigned>(read_varint());
+						unsigned long long zigzag = read_varint();
+						long long channelValue = static_cast<long long>(zigzag >> 1) ^ -static_cast<long long>(zigzag & 1);
+						if (channelIndex < m_channels.size() && m_openFrames.size() > 1)
+						{
+							unsigned key = named_key(run_stats::CHANNEL_PREFIX + m_channels[channelIndex]);
+							std::vector<double>& totals = m_openFrames[m_openFrames.size() - 2].m_totals;
+							if (totals.size() <= key)
+								totals.resize(key + 1, 0.0);
+							totals[key] = static_cast<double>(channelValue);
+						}
+						continue;
+					}
+
+					thread.m_lastTime += value >> 2;
+					if (kind == 0)
+					{
+						unsigned scopeIndex = static_cast<unsigned>(read_varint());
+						unsigned parentKey = m_options.m_byScope ? NO_KEY : (thread.m_stack.empty() ? thread.m_rootKey : thread.m_stack.back().m_key);
+						unsigned key = child_key(parentKey, scopeIndex);
+						thread.m_openCounts[key]++;
+						thread.m_stack.push_back({ key, thread.m_lastTime });
+					}
+					else if (kind == 1)
+					{
+						// Scopes entered before the capture started
+						if (thread.m_stack.empty())
+							continue;
+
+						open_scope scope = thread.m_stack.back();
+						thread.m_stack.pop_back();
+						// Counted per thread, with --by-scope the threads share their keys and their spans overlap
+						if (--thread.m_openCounts[scope.m_key] == 0)
+							add_span(scope.m_key, scope.m_start, thread.m_lastTime);
+					}
+					else
+					{
+						start_frame(thread.m_lastTime);
+					}
+				}
+			}
+
+			// Returns the key of a scope called from a node of the call tree (any node for NO_KEY), creating it the first
+			// time.
+			unsigned capture_reader::child_key(unsigned parentKey, unsigned scopeIndex)
+			{
+				unsigned long long childId = static_cast<unsigned long long>(parentKey) << 32 | scopeIndex;
+				auto found = m_childKeys.find(childId);
+				if (found != m_childKeys.end())
+					return found->second;
+
+				// Call sites with the same name share their key, like they share their node in the Profiler
+				std::string name = scopeIndex < m_scopes.size() ? m_scopes[scopeIndex] : "Scope " + std::to_string(scopeIndex);
+				unsigned key = named_key(parentKey == NO_KEY ? name : m_keys[parentKey].m_name + "/" + name);
+				m_childKeys.emplace(childId, key);
+				return key;
+			}
+
+			// Adds a key that doesn't belong to the call tree (frame time, channels).
+			unsigned capture_reader::named_key(const std::string& name)
+			{
+				auto found = m_keysByName.find(name);
+				if (found != m_keysByName.end())
+					return found->second;
+
+				unsigned key = static_cast<unsigned>(m_keys.size());
+				m_keysByName.emplace(name, key);
+				m_keys.push_back({ name, true });
+
+				// The frames already finished didn't have this key
+				sample_stats& keySamples = (*m_samples)[name];
+				keySamples.add(0.0, m_finishedFrames);
+				m_keySamples.push_back(&keySamples);
+				return key;
+			}
+
+			capture_reader::thread_state& capture_reader::get_thread(unsigned threadIndex)
+			{
+				thread_state& thread = m_threads[threadIndex];
+				if (thread.m_rootKey == NO_KEY)
+				{
+					if (thread.m_name.empty())
+						thread.m_name = "Thread " + std::to_string(threadIndex);
+
+					// Not a sample of its own, only the prefix of the paths of the thread
+					thread.m_rootKey = static_cast<unsigned>(m_keys.size());
+					m_keys.push_back({ thread.m_name, false });
+					m_keySamples.push_back(nullptr);
+				}
+				return thread;
+			}
+
+			// Adds a span to the frame it ended in.
+			void capture_reader::add_span(unsigned key, unsigned long long start, unsigned long long end)
+			{
+				// Spans before the first frame start or in frames already finished are left out
+				if (m_openFrames.empty() || end < m_openFrames.front().m_start)
+					return;
+
+				size_t frame = m_openFrames.size() - 1;
+				while (m_openFrames[frame].m_start > end)
+					frame--;
+
+				std::vector<double>& totals = m_openFrames[frame].m_totals;
+				if (totals.size() <= key)
+					totals.resize(key + 1, 0.0);
+				totals[key] += static_cast<double>(end - start) * m_nanosecondsPerTick;
+			}
+
+			void capture_reader::start_frame(unsigned long long time)
+			{
+				if (!m_openFrames.empty())
+				{
+					frame_totals& previous = m_openFrames.back();
+					if (previous.m_totals.size() <= m_frameKey)
+						previous.m_totals.resize(m_frameKey + 1, 0.0);
+					previous.m_totals[m_frameKey] = static_cast<double>(time - previous.m_start) * m_nanosecondsPerTick;
+				}
+
+				m_openFrames.push_back({ time, std::vector<double>() });
+				if (m_openFrames.size() > FRAME_LAG + 1)
+					finish_oldest_frame();
+			}
+
+			// Adds the samples of the oldest open frame.
+			void capture_reader::finish_oldest_frame()
+			{
+				const std::vector<double>& totals = m_openFrames.front().m_totals;
+				for (unsigned key = 0; key < m_keys.size(); ++key)
+				{
+					if (m_keys[key].m_reported)
+						m_keySamples[key]->add(key < totals.size() ? totals[key] : 0.0);
+				}
+
+				m_openFrames.pop_front();
+				m_finishedFrames++;
+			}
+		}
+
+		// Returns whether a file starts like a binary capture ("PRFC").
+		bool is_capture_file(const char* filePath)
+		{
+			std::FILE* file = nullptr;
+#ifdef _MSC_VER
+			fopen_s(&file, filePath, "rb");
+#else
+			file = std::fopen(filePath, "rb");
+#endif
+			if (file == nullptr)
+				return false;
+
+			char magic[4] = {};
+			bool isCapture = std::fread(magic, 1, sizeof(magic), file) == sizeof(magic) && std::memcmp(magic, "PRFC", 4) == 0;
+			std::fclose(file);
+			return isCapture;
+		}
+
+		// Adds the frames of a binary capture (versions 1 to 3) to a set of runs: the time spent in every call path
+		// (or scope) per frame, the frame times and the values of the channels, with times in nanoseconds. The events
+		// are decoded as they are read through a fixed size buffer, so captures larger than the memory can be read.
+		// The frame being recorded when the capture stopped is incomplete and left out.
+		// Throws std::runtime_error if the file can't be read or isn't a valid capture.
+		void read_capture(const char* filePath, run_stats& stats, const read_options& options)
+		{
+			std::map<std::string, sample_stats> samples;
+			unsigned long long frames = 0;
+			capture_reader(filePath, options).read(samples, frames);
+			stats.add_file(samples, frames, "ns");
+		}
+	}
+}
@@ -0,0 +1,24 @@
+/**
+* @file CaptureReader.h
+* @brief Contains the reader of the binary capture files written by the CaptureFormatter of the Profiler.
+*/
+
+#pragma once
+
+#include "SampleStats.h"
+
+namespace Profiler
+{
+	namespace Analyzer
+	{
+		// Returns whether a file starts like a binary capture ("PRFC").
+		bool is_capture_file(const char* filePath);
+
+		// Adds the frames of a binary capture (versions 1 to 3) to a set of runs: the time spent in every call path
+		// (or scope) per frame, the frame times and the values of the channels, with times in nanoseconds. The events
+		// are decoded as they are read through a fixed size buffer, so captures larger than the memory can be read.
+		// The frame being recorded when the capture stopped is incomplete and left out.
+		// Throws std::runtime_error if the file can't be read or isn't a valid capture.
+		void read_capture(const char* filePath, run_stats& stats, const read_options& options);
+	}
+}
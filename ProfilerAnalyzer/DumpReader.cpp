@@ -0,0 +1,332 @@
+/**
+* @file DumpReader.cpp
+* @brief Contains the implementation of the reader of the JSON dumps.
+*/
+
+
+#include "DumpReader.h"
+#include <stdexcept>	// std::runtime_error
+
+#if DUMP_INPUT
+#include <algorithm>	// std::max
+#include <fstream>
+#include <json.hpp>		// Json.hpp from Nlohman json library is assumed to be part of additional include directories (otherwise, DUMP_INPUT can be turned off)
+#endif
+
+namespace Profiler
+{
+	namespace Analyzer
+	{
+#if DUMP_INPUT
+		namespace
+		{
+			// Containers of the dump the reader needs to tell apart. The keys of the objects are sorted (nlohmann::json
+			// keeps them in a std::map), which is why the formatter numbers them: the ID of a node comes before its
+			// children and its history, and the name of a thread before its nodes.
+			enum class container
+			{
+				root,
+				threads,			// "Threads" array of the root
+				thread,
+				children,			// "2) Children" of a thread or "8) Children" of a node
+				node,
+				history,			// "9) History" of a node
+				node_times,			// "Time per frame" of a history
+				frame_times,		// "Frame times" of the root
+				channels,			// "Channels" of the root
+				channel,
+				channel_values,		// "3) Values" of a channel
+				other
+			};
+
+			// Receives the tokens of the dump from the parser and accumulates the series of every key, aligned on their
+			// last frame (the histories of the nodes created after the first frames are shorter).
+			class dump_handler : public nlohmann::json_sax<nlohmann::json>
+			{
+			public:
+				dump_handler(const char* filePath, const read_options& options);
+
+				bool null() override;
+				bool boolean(bool value) override;
+				bool number_integer(number_integer_t value) override;
+				bool number_unsigned(number_unsigned_t value) override;
+				bool number_float(number_float_t value, const string_t& text) override;
+				bool string(string_t& value) override;
+				bool binary(binary_t& value) override;
+				bool start_object(std::size_t elements) override;
+				bool key(string_t& value) override;
+				bool end_object() override;
+				bool start_array(std::size_t elements) override;
+				bool end_array() override;
+				bool parse_error(std::size_t position, const std::string& lastToken, const nlohmann::detail::exception& error) override;
+
+				// Turns the series into samples, with 0 for the frames before the start of each series.
+				void get_samples(std::map<std::string, sample_stats>& samples, unsigned long long& frames) const;
+
+				const std::string& get_time_unit() const;
+
+			private:
+				struct node_context
+				{
+					std::string m_path;						// Thread name followed by the IDs from the root
+					std::vector<double> m_times;			// "Time per frame", oldest first
+					double m_meanTime = 0.0;				// "Mean time per frame", for the dumps without the series
+					bool m_hasMean = false;
+				};
+
+				bool number(double value);
+
+				// Adds a series to the one of a key, aligning their last frames.
+				void add_series(const std::string& key, const std::vector<double>& values);
+
+				container parent() const;
+
+				const char* m_filePath;
+				read_options m_options;
+				std::string m_timeUnit = "cycles";			// Dumps older than the clock layer reported raw cycles
+				std::vector<container> m_stack;
+				std::string m_key;							// Last key read, the one of the value being parsed
+				std::string m_threadName;
+				std::vector<node_context> m_nodes;			// Nodes being parsed, the last one is the innermost
+				std::string m_channelName;
+				std::vector<double> m_values;				// Values of the frame times or of the current channel
+				std::map<std::string, std::vector<double>> m_series;
+			};
+
+			dump_handler::dump_handler(const char* filePath, const read_options& options)
+				:	m_filePath(filePath),
+					m_options(options)
+			{
+			}
+
+			bool dump_handler::null()
+			{
+				return true;
+			}
+
+			bool dump_handler::boolean(bool)
+			{
+				return true;
+			}
+
+			bool dump_handler::number_integer(number_integer_t value)
+			{
+				return number(static_cast<double>(value));
+			}
+
+			bool dump_handler::number_unsigned(number_unsigned_t value)
+			{
+				return number(static_cast<double>(value));
+			}
+
+			bool dump_handler::number_float(number_float_t value, const string_t&)
+			{
+				return number(static_cast<double>(value));
+			}
+
+			bool dump_handler::string(string_t& value)
+			{
+				container current = parent();
+				if (current == container::root && m_key == "Time unit")
+					m_timeUnit = value;
+				else if (current == container::thread && m_key == "1) Thread")
+					m_threadName = value;
+				else if (current == container::channel && m_key == "1) Name")
+					m_channelName = value;
+				else if (current == container::node && m_key == "1) ID")
+				{
+					// The enclosing node (or the thread) was named before its children started
+					node_context& node = m_nodes.back();
+					if (m_options.m_byScope)
+						node.m_path = value;
+					else
+						node.m_path = (m_nodes.size() > 1 ? m_nodes[m_nodes.size() - 2].m_path : m_threadName) + "/" + value;
+				}
+				return true;
+			}
+
+			bool dump_handler::binary(binary_t&)
+			{
+				return true;
+			}
+
+			bool dump_handler::start_object(std::size_t)
+			{
+				container current = parent();
+				if (m_stack.empty())
+				{
+					m_stack.push_back(container::root);
+				}
+				else if (current == container::threads)
+				{
+					m_threadName.clear();
+					m_stack.push_back(container::thread);
+				}
+				else if (current == container::children)
+				{
+					m_nodes.emplace_back();
+					m_stack.push_back(container::node);
+				}
+				else if (current == container::node && m_key == "9) History")
+				{
+					m_stack.push_back(container::history);
+				}
+				else if (current == container::channels)
+				{
+					m_channelName.clear();
+					m_values.clear();
+					m_stack.push_back(container::channel);
+				}
+				else
+				{
+					m_stack.push_back(container::other);
+				}
+				return true;
+			}
+
+			bool dump_handler::key(string_t& value)
+			{
+				m_key = value;
+				return true;
+			}
+
+			bool dump_handler::end_object()
+			{
+				container current = parent();
+				m_stack.pop_back();
+
+				if (current == container::node)
+				{
+					node_context& node = m_nodes.back();
+					if (!node.m_times.empty())
+						add_series(node.m_path, node.m_times);
+					else if (node.m_hasMean)
+						add_series(node.m_path, std::vector<double>(1, node.m_meanTime));
+					m_nodes.pop_back();
+				}
+				else if (current == container::channel)
+				{
+					add_series(run_stats::CHANNEL_PREFIX + m_channelName, m_values);
+				}
+				return true;
+			}
+
+			bool dump_handler::start_array(std::size_t)
+			{
+				container current = parent();
+				container array = container::other;
+				if (current == container::root && m_key == "Threads")
+					array = container::threads;
+				else if (current == container::root && m_key == "Frame times")
+					array = container::frame_times;
+				else if (current == container::root && m_key == "Channels")
+					array = container::channels;
+				else if ((current == container::thread && m_key == "2) Children") || (current == container::node && m_key == "8) Children"))
+					array = container::children;
+				else if (current == container::history && m_key == "Time per frame")
+					array = container::node_times;
+				else if (current == container::channel && m_key == "3) Values")
+					array = container::channel_values;
+
+				if (array == container::frame_times)
+					m_values.clear();
+				m_stack.push_back(array);
+				return true;
+			}
+
+			bool dump_handler::end_array()
+			{
+				container current = parent();
+				m_stack.pop_back();
+
+				if (current == container::frame_times)
+					add_series(run_stats::FRAME_KEY, m_values);
+				return true;
+			}
+
+			bool dump_handler::parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& error)
+			{
+				throw std::runtime_error(std::string(m_filePath) + ": " + error.what());
+			}
+
+			// Turns the series into samples, with 0 for the frames before the start of each series.
+			void dump_handler::get_samples(std::map<std::string, sample_stats>& samples, unsigned long long& frames) const
+			{
+				frames = 0;
+				for (const auto& series : m_series)
+					frames = std::max<unsigned long long>(frames, series.second.size());
+
+				for (const auto& series : m_series)
+				{
+					sample_stats& keySamples = samples[series.first];
+					keySamples.add(0.0, frames - series.second.size());
+					for (double value : series.second)
+						keySamples.add(value);
+				}
+			}
+
+			const std::string& dump_handler::get_time_unit() const
+			{
+				return m_timeUnit;
+			}
+
+			bool dump_handler::number(double value)
+			{
+				container current = parent();
+				if (current == container::node_times)
+					m_nodes.back().m_times.push_back(value);
+				else if (current == container::frame_times || current == container::channel_values)
+					m_values.push_back(value);
+				else if (current == container::history && m_key == "Mean time per frame")
+				{
+					m_nodes.back().m_meanTime = value;
+					m_nodes.back().m_hasMean = true;
+				}
+				return true;
+			}
+
+			// Adds a series to the one of a key, aligning their last frames.
+			void dump_handler::add_series(const std::string& key, const std::vector<double>& values)
+			{
+				std::vector<double>& series = m_series[key];
+				if (series.size() < values.size())
+					series.insert(series.begin(), values.size() - series.size(), 0.0);
+
+				size_t offset = series.size() - values.size();
+				for (size_t i = 0; i < values.size(); ++i)
+					series[offset + i] += values[i];
+			}
+
+			container dump_handler::parent() const
+			{
+				return m_stack.empty() ? container::other : m_stack.back();
+			}
+		}
+
+		// Adds the frames of a JSON dump (DUMP_TO_JSON) to a set of runs: the time per frame of every node of the trees
+		// over the history of the dump, the frame times and the values of the channels. Dumps written before the nodes
+		// had their "Time per frame" give one sample per node, their mean time per frame. The file is parsed as a
+		// stream of tokens and only the series are kept, so the size of the dump doesn't matter.
+		// Throws std::runtime_error if the file can't be read or isn't valid JSON.
+		void read_dump(const char* filePath, run_stats& stats, const read_options& options)
+		{
+			std::ifstream file(filePath, std::ios::binary);
+			if (!file.is_open())
+				throw std::runtime_error(std::string("can't open ") + filePath);
+
+			dump_handler handler(filePath, options);
+			nlohmann::json::sax_parse(file, &handler);
+
+			std::map<std::string, sample_stats> samples;
+			unsigned long long frames = 0;
+			handler.get_samples(samples, frames);
+			stats.add_file(samples, frames, handler.get_time_unit());
+		}
+#else
+		void read_dump(const char* filePath, run_stats&, const read_options&)
+		{
+			throw std::runtime_error(std::string(filePath) + " is not a capture file (reading JSON dumps requires DUMP_INPUT)");
+		}
+#endif
+	}
+}
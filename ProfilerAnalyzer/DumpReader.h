@@ -0,0 +1,24 @@
+/**
+* @file DumpReader.h
+* @brief Contains the reader of the JSON dumps written by the JsonFormatter of the Profiler.
+*/
+
+#pragma once
+
+#include "SampleStats.h"
+
+
+#define DUMP_INPUT 0		// Set to 1/0 to enable/disable reading the JSON dumps (requires json.hpp, like JSON_OUTPUT)
+
+namespace Profiler
+{
+	namespace Analyzer
+	{
+		// Adds the frames of a JSON dump (DUMP_TO_JSON) to a set of runs: the time per frame of every node of the trees
+		// over the history of the dump, the frame times and the values of the channels. Dumps written before the nodes
+		// had their "Time per frame" give one sample per node, their mean time per frame. The file is parsed as a
+		// stream of tokens and only the series are kept, so the size of the dump doesn't matter.
+		// Throws std::runtime_error if the file can't be read or isn't valid JSON, or always when DUMP_INPUT is 0.
+		void read_dump(const char* filePath, run_stats& stats, const read_options& options);
+	}
+}
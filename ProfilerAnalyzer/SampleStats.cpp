@@ -0,0 +1,281 @@
+/**
+* @file SampleStats.cpp
+* @brief Contains the implementation of the statistics of the analyzer and of Welch's t-test.
+*/
+
+
+#include "SampleStats.h"
+#include <algorithm>	// std::nth_element, std::min
+#include <cmath>		// std::sqrt, std::lgamma
+#include <limits>		// std::numeric_limits
+#include <stdexcept>	// std::runtime_error
+#include <utility>		// std::swap
+
+namespace Profiler
+{
+	namespace Analyzer
+	{
+		const char* const run_stats::FRAME_KEY = "[frame]";
+		const char* const run_stats::CHANNEL_PREFIX = "[channel] ";
+
+		namespace
+		{
+			// Continued fraction of the regularized incomplete beta function (modified Lentz's method), which converges
+			// quickly for x < (a + 1) / (a + b + 2).
+			double beta_continued_fraction(double a, double b, double x)
+			{
+				const int MAX_ITERATIONS = 300;
+				const double EPSILON = 1e-14;
+				const double TINY = 1e-300;
+
+				double c = 1.0;
+				double d = 1.0 - (a + b) * x / (a + 1.0);
+				d = std::abs(d) < TINY ? 1.0 / TINY : 1.0 / d;
+				double result = d;
+
+				for (int m = 1; m <= MAX_ITERATIONS; ++m)
+				{
+					// Even step
+					double numerator = m * (b - m) * x / ((a + 2.0 * m - 1.0) * (a + 2.0 * m));
+					d = 1.0 + numerator * d;
+					c = 1.0 + numerator / c;
+					d = std::abs(d) < TINY ? 1.0 / TINY : 1.0 / d;
+					c = std::abs(c) < TINY ? TINY : c;
+					result *= d * c;
+
+					// Odd step
+					numerator = -(a + m) * (a + b + m) * x / ((a + 2.0 * m) * (a + 2.0 * m + 1.0));
+					d = 1.0 + numerator * d;
+					c = 1.0 + numerator / c;
+					d = std::abs(d) < TINY ? 1.0 / TINY : 1.0 / d;
+					c = std::abs(c) < TINY ? TINY : c;
+					double delta = d * c;
+					result *= delta;
+
+					if (std::abs(delta - 1.0) < EPSILON)
+						break;
+				}
+				return result;
+			}
+
+			// Regularized incomplete beta function I_x(a, b).
+			double incomplete_beta(double a, double b, double x)
+			{
+				if (x <= 0.0)
+					return 0.0;
+				if (x >= 1.0)
+					return 1.0;
+
+				double front = std::exp(std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b) + a * std::log(x) + b * std::log(1.0 - x));
+
+				// Use the symmetry I_x(a, b) = 1 - I_(1-x)(b, a) where the continued fraction converges faster
+				if (x < (a + 1.0) / (a + b + 2.0))
+					return front * beta_continued_fraction(a, b, x) / a;
+				return 1.0 - front * beta_continued_fraction(b, a, 1.0 - x) / b;
+			}
+		}
+
+		// Adds the same sample a number of times.
+		void sample_stats::add(double value, unsigned long long repeat)
+		{
+			for (unsigned long long i = 0; i < repeat; ++i)
+			{
+				// Algorithm R: the n-th sample replaces a random slot with probability RESERVOIR_SIZE / n
+				if (m_reservoir.size() < RESERVOIR_SIZE)
+				{
+					m_reservoir.push_back(value);
+				}
+				else
+				{
+					unsigned long long slot = next_random() % (m_count + i + 1);
+					if (slot < RESERVOIR_SIZE)
+						m_reservoir[static_cast<size_t>(slot)] = value;
+				}
+			}
+
+			if (repeat == 0)
+				return;
+
+			// Combine with a set of identical samples, whose variance is 0
+			if (m_count == 0)
+			{
+				m_min = value;
+				m_max = value;
+			}
+			m_min = std::min(m_min, value);
+			m_max = std::max(m_max, value);
+
+			double total = static_cast<double>(m_count + repeat);
+			double delta = value - m_mean;
+			m_mean += delta * static_cast<double>(repeat) / total;
+			m_m2 += delta * delta * static_cast<double>(m_count) * static_cast<double>(repeat) / total;
+			m_count += repeat;
+		}
+
+		// Adds all the samples of another set, as if they had been added one by one.
+		void sample_stats::merge(const sample_stats& other)
+		{
+			if (other.m_count == 0)
+				return;
+			if (m_count == 0)
+			{
+				unsigned long long random = m_random;
+				*this = other;
+				m_random = random;
+				return;
+			}
+
+			// Each set gets a share of the reservoir that matches its share of the samples
+			if (m_reservoir.size() + other.m_reservoir.size() <= RESERVOIR_SIZE)
+			{
+				m_reservoir.insert(m_reservoir.end(), other.m_reservoir.begin(), other.m_reservoir.end());
+			}
+			else
+			{
+				double share = static_cast<double>(m_count) / static_cast<double>(m_count + other.m_count);
+				size_t kept = std::min(m_reservoir.size(), static_cast<size_t>(share * RESERVOIR_SIZE + 0.5));
+				size_t taken = std::min(other.m_reservoir.size(), RESERVOIR_SIZE - kept);
+
+				// Random subsets of both reservoirs (partial Fisher-Yates shuffles)
+				for (size_t i = 0; i < kept; ++i)
+					std::swap(m_reservoir[i], m_reservoir[i + static_cast<size_t>(next_random() % (m_reservoir.size() - i))]);
+				m_reservoir.resize(kept);
+
+				std::vector<double> others = other.m_reservoir;
+				for (size_t i = 0; i < taken; ++i)
+				{
+					std::swap(others[i], others[i + static_cast<size_t>(next_random() % (others.size() - i))]);
+					m_reservoir.push_back(others[i]);
+				}
+			}
+
+			// Chan's parallel combination of the moments
+			double total = static_cast<double>(m_count + other.m_count);
+			double delta = other.m_mean - m_mean;
+			m_mean += delta * static_cast<double>(other.m_count) / total;
+			m_m2 += other.m_m2 + delta * delta * static_cast<double>(m_count) * static_cast<double>(other.m_count) / total;
+			m_count += other.m_count;
+			m_min = std::min(m_min, other.m_min);
+			m_max = std::max(m_max, other.m_max);
+		}
+
+		unsigned long long sample_stats::count() const
+		{
+			return m_count;
+		}
+
+		double sample_stats::mean() const
+		{
+			return m_mean;
+		}
+
+		// Unbiased, 0 with less than two samples.
+		double sample_stats::variance() const
+		{
+			return m_count < 2 ? 0.0 : m_m2 / static_cast<double>(m_count - 1);
+		}
+
+		double sample_stats::min() const
+		{
+			return m_min;
+		}
+
+		double sample_stats::max() const
+		{
+			return m_max;
+		}
+
+		// Returns the value below which the given fraction (0 to 1) of the samples lie.
+		double sample_stats::percentile(double fraction) const
+		{
+			if (m_reservoir.empty())
+				return 0.0;
+
+			std::vector<double> sorted = m_reservoir;
+			size_t rank = static_cast<size_t>(fraction * static_cast<double>(sorted.size() - 1) + 0.5);
+			rank = std::min(rank, sorted.size() - 1);
+			std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+			return sorted[rank];
+		}
+
+		// Returns a pseudo-random number, the same sequence on every run so that the reports are reproducible.
+		unsigned long long sample_stats::next_random()
+		{
+			// xorshift64*
+			m_random ^= m_random >> 12;
+			m_random ^= m_random << 25;
+			m_random ^= m_random >> 27;
+			return m_random * 0x2545F4914F6CDD1Dull;
+		}
+
+		// Adds the samples of one file, which covers the given number of frames. The keys that didn't appear in the
+		// file (or in the previous ones) get a sample of 0 for each frame they weren't in.
+		// Throws std::runtime_error if the time unit differs from the one of the previous files.
+		void run_stats::add_file(const std::map<std::string, sample_stats>& scopes, unsigned long long frames, const std::string& timeUnit)
+		{
+			if (m_files > 0 && timeUnit != m_timeUnit)
+				throw std::runtime_error("the files measure time in different units (" + m_timeUnit + " and " + timeUnit + ")");
+			m_timeUnit = timeUnit;
+
+			for (auto& scope : m_scopes)
+			{
+				if (scopes.find(scope.first) == scopes.end())
+					scope.second.add(0.0, frames);
+			}
+
+			for (const auto& scope : scopes)
+			{
+				auto inserted = m_scopes.emplace(scope.first, sample_stats());
+				if (inserted.second)
+					inserted.first->second.add(0.0, m_frames);
+				inserted.first->second.merge(scope.second);
+			}
+
+			m_frames += frames;
+			m_files++;
+		}
+
+		// Tests whether two sets of samples have the same mean, without assuming that they have the same variance.
+		welch_result welch_test(const sample_stats& a, const sample_stats& b)
+		{
+			// Nothing can be told apart without a spread to compare the difference with
+			welch_result result;
+			if (a.count() == 0 || b.count() == 0 || (a.count() < 2 && b.count() < 2))
+				return result;
+
+			double errorA = a.variance() / static_cast<double>(a.count());
+			double errorB = b.variance() / static_cast<double>(b.count());
+			double error = errorA + errorB;
+			double difference = b.mean() - a.mean();
+
+			// Constant values on both sides, only equal means are compatible
+			if (error <= 0.0)
+			{
+				result.m_t = difference == 0.0 ? 0.0 : (difference > 0.0 ? std::numeric_limits<double>::infinity() : -std::numeric_limits<double>::infinity());
+				result.m_pValue = difference == 0.0 ? 1.0 : 0.0;
+				return result;
+			}
+
+			result.m_t = difference / std::sqrt(error);
+
+			// Welch-Satterthwaite equation. A set of one sample has no variance and contributes no error.
+			double denominator = 0.0;
+			if (a.count() > 1)
+				denominator += errorA * errorA / static_cast<double>(a.count() - 1);
+			if (b.count() > 1)
+				denominator += errorB * errorB / static_cast<double>(b.count() - 1);
+			result.m_degreesOfFreedom = error * error / denominator;
+			result.m_pValue = student_t_two_sided(result.m_t, result.m_degreesOfFreedom);
+			return result;
+		}
+
+		// Returns the probability that a Student's t variable with the given degrees of freedom is greater than |t|
+		// or lower than -|t|.
+		double student_t_two_sided(double t, double degreesOfFreedom)
+		{
+			if (degreesOfFreedom <= 0.0)
+				return 1.0;
+			return incomplete_beta(degreesOfFreedom / 2.0, 0.5, degreesOfFreedom / (degreesOfFreedom + t * t));
+		}
+	}
+}
@@ -0,0 +1,94 @@
+/**
+* @file SampleStats.h
+* @brief Contains the statistics the analyzer computes over the frames of profiler captures and dumps, and the
+*		 significance test used to compare two sets of runs.
+*/
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace Profiler
+{
+	namespace Analyzer
+	{
+		// Statistics of the samples of one scope (one sample per frame), updated online so that files of any size can
+		// be read and merged without keeping their samples. The percentiles are estimated from a uniform reservoir of
+		// RESERVOIR_SIZE samples.
+		class sample_stats
+		{
+		public:
+			static const unsigned RESERVOIR_SIZE = 4096;
+
+			// Adds the same sample a number of times.
+			void add(double value, unsigned long long repeat = 1);
+
+			// Adds all the samples of another set, as if they had been added one by one.
+			void merge(const sample_stats& other);
+
+			unsigned long long count() const;
+			double mean() const;
+			double variance() const;						// Unbiased, 0 with less than two samples
+			double min() const;
+			double max() const;
+
+			// Returns the value below which the given fraction (0 to 1) of the samples lie.
+			double percentile(double fraction) const;
+
+		private:
+			// Returns a pseudo-random number, the same sequence on every run so that the reports are reproducible.
+			unsigned long long next_random();
+
+			unsigned long long m_count = 0;
+			double m_mean = 0.0;
+			double m_m2 = 0.0;								// Sum of the squared differences from the mean (Welford)
+			double m_min = 0.0;
+			double m_max = 0.0;
+			std::vector<double> m_reservoir;
+			unsigned long long m_random = 0x9E3779B97F4A7C15ull;
+		};
+
+		// Samples of every scope of a set of runs. The keys are the thread name followed by the call path of the
+		// scope ("Main thread/main/DrawMenu"), or only the scope name when the paths are merged. The time of each
+		// frame uses the key FRAME_KEY and the counters/gauges CHANNEL_PREFIX followed by their name.
+		struct run_stats
+		{
+			static const char* const FRAME_KEY;
+			static const char* const CHANNEL_PREFIX;
+
+			std::string m_timeUnit;							// Unit of the times, the same for all the files of the set
+			unsigned m_files = 0;
+			unsigned long long m_frames = 0;				// Frames of all the files, the samples of each key
+			std::map<std::string, sample_stats> m_scopes;
+
+			// Adds the samples of one file, which covers the given number of frames. The keys that didn't appear in the
+			// file (or in the previous ones) get a sample of 0 for each frame they weren't in.
+			// Throws std::runtime_error if the time unit differs from the one of the previous files.
+			void add_file(const std::map<std::string, sample_stats>& scopes, unsigned long long frames, const std::string& timeUnit);
+		};
+
+		// How the readers turn the files into samples.
+		struct read_options
+		{
+			bool m_byScope = false;							// One key per scope name instead of one per call path
+		};
+
+		// Result of Welch's t-test on the means of two sets of samples.
+		struct welch_result
+		{
+			double m_t = 0.0;								// Positive when the second set has the higher mean
+			double m_degreesOfFreedom = 0.0;
+			double m_pValue = 1.0;							// Two-sided
+		};
+
+		// Tests whether two sets of samples have the same mean, without assuming that they have the same variance.
+		// Returns a p-value of 1 when neither set has two samples.
+		welch_result welch_test(const sample_stats& a, const sample_stats& b);
+
+		// Returns the probability that a Student's t variable with the given degrees of freedom is greater than |t|
+		// or lower than -|t|.
+		double student_t_two_sided(double t, double degreesOfFreedom);
+	}
+}
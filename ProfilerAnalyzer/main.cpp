@@ -0,0 +1,265 @@
+/**
+* @file main.cpp
+* @brief Command line tool that reads the captures and JSON dumps of the Profiler, prints the statistics of every
+*		 scope over their frames and compares two builds to catch the performance regressions automatically.
+*/
+
+
+#include "CaptureReader.h"
+#include "DumpReader.h"
+#include "SampleStats.h"
+#include <algorithm>	// std::sort
+#include <cmath>		// std::sqrt, std::abs
+#include <cstdio>		// std::printf
+#include <cstdlib>		// std::strtod
+#include <cstring>		// std::strcmp
+#include <limits>		// std::numeric_limits
+#include <stdexcept>	// std::runtime_error
+
+using namespace Profiler::Analyzer;
+
+namespace
+{
+	enum exit_code
+	{
+		EXIT_OK = 0,
+		EXIT_REGRESSION = 1,	// diff found a scope significantly slower in the candidate
+		EXIT_ERROR = 2
+	};
+
+	struct options
+	{
+		read_options m_read;
+		unsigned m_top = 30;			// Rows printed, 0 for all
+		double m_alpha = 0.01;			// Significance level of the diff
+		double m_threshold = 5.0;		// Smallest change of the mean, in percent, that is reported
+		double m_minTime = 0.0;			// Scopes whose mean is lower in both sets are left out of the diff
+	};
+
+	// Row of the diff of two sets of runs.
+	struct diff_row
+	{
+		const std::string* m_key;
+		const sample_stats* m_baseline;	// nullptr if the key isn't in the baseline
+		const sample_stats* m_candidate;
+		double m_change;				// Of the mean, in percent
+		welch_result m_test;
+		int m_verdict;					// 1 regression, -1 improvement, 0 neither
+	};
+
+	void print_usage()
+	{
+		std::printf(
+			"Usage:\n"
+			"  ProfilerAnalyzer stats [options] <file>...\n"
+			"  ProfilerAnalyzer diff [options] <baseline file>... -- <candidate file>...\n"
+			"\n"
+			"The files are binary captures (START_CAPTURE) or JSON dumps (DUMP_TO_JSON, read when built with DUMP_INPUT).\n"
+			"The files of a set are merged as runs of the same build. Each frame gives one sample of every call path, of the\n"
+			"frame time and of the channels.\n"
+			"\n"
+			"Options:\n"
+			"  --by-scope       merge the call paths of each scope\n"
+			"  --top <n>        rows printed, 0 for all (default 30, the diff always prints the significant changes)\n"
+			"  --alpha <p>      significance level of Welch's t-test in the diff (default 0.01)\n"
+			"  --threshold <%%>  smallest change of the mean reported by the diff (default 5)\n"
+			"  --min-time <t>   leaves out of the diff the scopes faster than this in both sets (default 0)\n"
+			"\n"
+			"diff exits with 1 when the candidate has a regression, 2 on errors.\n");
+	}
+
+	// Reads a file into a set of runs, guessing its format from its first bytes.
+	void read_file(const char* filePath, run_stats& stats, const read_options& options)
+	{
+		if (is_capture_file(filePath))
+			read_capture(filePath, stats, options);
+		else
+			read_dump(filePath, stats, options);
+	}
+
+	// Name printed for a key: channels and the frame time are not times of scopes.
+	bool is_time(const std::string& key)
+	{
+		return key.compare(0, std::strlen(run_stats::CHANNEL_PREFIX), run_stats::CHANNEL_PREFIX) != 0;
+	}
+
+	void print_stats(const run_stats& stats, const options& settings)
+	{
+		std::vector<const std::pair<const std::string, sample_stats>*> rows;
+		for (const auto& scope : stats.m_scopes)
+			rows.push_back(&scope);
+
+		std::sort(rows.begin(), rows.end(), [](const auto* a, const auto* b)
+		{
+			return a->second.mean() > b->second.mean();
+		});
+
+		std::printf("%u file(s), %llu frame(s), times in %s\n\n", stats.m_files, stats.m_frames, stats.m_timeUnit.c_str());
+		std::printf("%14s %14s %14s %14s %14s  %s\n", "Mean", "Std dev", "P50", "P95", "Max", "Scope");
+
+		size_t count = settings.m_top == 0 ? rows.size() : std::min<size_t>(rows.size(), settings.m_top);
+		for (size_t i = 0; i < count; ++i)
+		{
+			const sample_stats& samples = rows[i]->second;
+			std::printf("%14.1f %14.1f %14.1f %14.1f %14.1f  %s%s\n", samples.mean(), std::sqrt(samples.variance()), samples.percentile(0.5),
+				samples.percentile(0.95), samples.max(), rows[i]->first.c_str(), is_time(rows[i]->first) ? "" : " (value)");
+		}
+	}
+
+	// Prints the scopes whose mean changed between the two sets. Returns whether there is a regression.
+	bool print_diff(const run_stats& baseline, const run_stats& candidate, const options& settings)
+	{
+		if (baseline.m_files > 0 && candidate.m_files > 0 && baseline.m_timeUnit != candidate.m_timeUnit)
+			throw std::runtime_error("the sets measure time in different units (" + baseline.m_timeUnit + " and " + candidate.m_timeUnit + ")");
+
+		std::vector<diff_row> rows;
+		auto addRow = [&](const std::string& key, const sample_stats* a, const sample_stats* b)
+		{
+			double meanA = a ? a->mean() : 0.0;
+			double meanB = b ? b->mean() : 0.0;
+			if (is_time(key) && meanA < settings.m_minTime && meanB < settings.m_minTime)
+				return;
+
+			diff_row row;
+			row.m_key = &key;
+			row.m_baseline = a;
+			row.m_candidate = b;
+			row.m_change = meanA != 0.0 ? 100.0 * (meanB - meanA) / std::abs(meanA) : (meanB == 0.0 ? 0.0 : std::numeric_limits<double>::infinity());
+			row.m_verdict = 0;
+			if (a && b)
+			{
+				row.m_test = welch_test(*a, *b);
+				if (row.m_test.m_pValue < settings.m_alpha && std::abs(row.m_change) >= settings.m_threshold)
+					row.m_verdict = row.m_change > 0.0 ? 1 : -1;
+			}
+			rows.push_back(row);
+		};
+
+		for (const auto& scope : baseline.m_scopes)
+		{
+			auto found = candidate.m_scopes.find(scope.first);
+			addRow(scope.first, &scope.second, found != candidate.m_scopes.end() ? &found->second : nullptr);
+		}
+		for (const auto& scope : candidate.m_scopes)
+		{
+			if (baseline.m_scopes.find(scope.first) == baseline.m_scopes.end())
+				addRow(scope.first, nullptr, &scope.second);
+		}
+
+		// Regressions first, then improvements, then the rest, each by the size of the change
+		std::sort(rows.begin(), rows.end(), [](const diff_row& a, const diff_row& b)
+		{
+			int rankA = a.m_verdict == 1 ? 0 : (a.m_verdict == -1 ? 1 : 2);
+			int rankB = b.m_verdict == 1 ? 0 : (b.m_verdict == -1 ? 1 : 2);
+			if (rankA != rankB)
+				return rankA < rankB;
+			return std::abs(a.m_change) > std::abs(b.m_change);
+		});
+
+		unsigned regressions = 0;
+		unsigned improvements = 0;
+		for (const diff_row& row : rows)
+		{
+			regressions += row.m_verdict == 1;
+			improvements += row.m_verdict == -1;
+		}
+
+		std::printf("Baseline: %u file(s), %llu frame(s). Candidate: %u file(s), %llu frame(s). Times in %s\n", baseline.m_files, baseline.m_frames,
+			candidate.m_files, candidate.m_frames, candidate.m_timeUnit.c_str());
+		std::printf("%u regression(s), %u improvement(s) (p < %g, change of at least %g%%)\n\n", regressions, improvements, settings.m_alpha, settings.m_threshold);
+		std::printf("%-12s %14s %14s %9s %10s  %s\n", "", "Baseline", "Candidate", "Change", "p-value", "Scope");
+
+		size_t printed = 0;
+		for (const diff_row& row : rows)
+		{
+			if (row.m_verdict == 0 && settings.m_top != 0 && printed >= settings.m_top)
+				break;
+
+			const char* verdict = row.m_verdict == 1 ? "REGRESSION" : (row.m_verdict == -1 ? "improvement" : "");
+			if (!row.m_baseline)
+				verdict = "new";
+			else if (!row.m_candidate)
+				verdict = "removed";
+
+			char pValue[32] = "         -";
+			if (row.m_baseline && row.m_candidate)
+				std::snprintf(pValue, sizeof(pValue), "%10.2g", row.m_test.m_pValue);
+
+			std::printf("%-12s %14.1f %14.1f %+8.1f%% %s  %s%s\n", verdict, row.m_baseline ? row.m_baseline->mean() : 0.0,
+				row.m_candidate ? row.m_candidate->mean() : 0.0, row.m_change, pValue, row.m_key->c_str(), is_time(*row.m_key) ? "" : " (value)");
+			printed++;
+		}
+
+		return regressions > 0;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3 || (std::strcmp(argv[1], "stats") != 0 && std::strcmp(argv[1], "diff") != 0))
+	{
+		print_usage();
+		return EXIT_ERROR;
+	}
+
+	bool diff = std::strcmp(argv[1], "diff") == 0;
+	options settings;
+	std::vector<const char*> baselineFiles;
+	std::vector<const char*> candidateFiles;
+	bool afterSeparator = false;
+
+	for (int i = 2; i < argc; ++i)
+	{
+		const char* argument = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (std::strcmp(argument, "--by-scope") == 0)
+			settings.m_read.m_byScope = true;
+		else if (std::strcmp(argument, "--top") == 0 && hasValue)
+			settings.m_top = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+		else if (std::strcmp(argument, "--alpha") == 0 && hasValue)
+			settings.m_alpha = std::strtod(argv[++i], nullptr);
+		else if (std::strcmp(argument, "--threshold") == 0 && hasValue)
+			settings.m_threshold = std::strtod(argv[++i], nullptr);
+		else if (std::strcmp(argument, "--min-time") == 0 && hasValue)
+			settings.m_minTime = std::strtod(argv[++i], nullptr);
+		else if (std::strcmp(argument, "--") == 0 && diff)
+			afterSeparator = true;
+		else if (argument[0] == '-' && argument[1] == '-')
+		{
+			std::fprintf(stderr, "Unknown option %s\n\n", argument);
+			print_usage();
+			return EXIT_ERROR;
+		}
+		else
+			(afterSeparator ? candidateFiles : baselineFiles).push_back(argument);
+	}
+
+	if (baselineFiles.empty() || (diff && candidateFiles.empty()))
+	{
+		print_usage();
+		return EXIT_ERROR;
+	}
+
+	try
+	{
+		run_stats baseline;
+		for (const char* filePath : baselineFiles)
+			read_file(filePath, baseline, settings.m_read);
+
+		if (!diff)
+		{
+			print_stats(baseline, settings);
+			return EXIT_OK;
+		}
+
+		run_stats candidate;
+		for (const char* filePath : candidateFiles)
+			read_file(filePath, candidate, settings.m_read);
+		return print_diff(baseline, candidate, settings) ? EXIT_REGRESSION : EXIT_OK;
+	}
+	catch (const std::exception& error)
+	{
+		std::fprintf(stderr, "Error: %s\n", error.what());
+		return EXIT_ERROR;
+	}
+}
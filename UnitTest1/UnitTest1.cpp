@@ -1,5 +1,14 @@
 #include "pch.h"
 #include "CppUnitTest.h"
+#include "../ImguiTest/OutputFormatters.h"
+#include "../ProfilerAnalyzer/CaptureReader.h"
+#include "../ProfilerAnalyzer/SampleStats.h"
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
 
 // Writing unit tests cuz why not ?
 // It's more professional and i love to see green checkmarks everywhere
@@ -18,4 +27,182 @@ namespace UnitTest1
 		}
 		
 	};
+
+	// Statistics of the ProfilerAnalyzer, against values computed by hand or with a reference t distribution
+	TEST_CLASS(SampleStats)
+	{
+		static Profiler::Analyzer::sample_stats make_stats(const std::vector<double>& values)
+		{
+			Profiler::Analyzer::sample_stats stats;
+			for (double value : values)
+				stats.add(value);
+			return stats;
+		}
+
+		TEST_METHOD(AddRepeatMatchesSingleAdds)
+		{
+			Profiler::Analyzer::sample_stats repeated;
+			repeated.add(2.0, 3);
+			repeated.add(5.0);
+			Profiler::Analyzer::sample_stats single = make_stats({ 2.0, 2.0, 2.0, 5.0 });
+
+			Assert::AreEqual(4ull, repeated.count());
+			Assert::AreEqual(2.75, repeated.mean(), 1e-12);
+			Assert::AreEqual(2.25, repeated.variance(), 1e-12);
+			Assert::AreEqual(2.0, repeated.min());
+			Assert::AreEqual(5.0, repeated.max());
+			Assert::AreEqual(single.mean(), repeated.mean(), 1e-12);
+			Assert::AreEqual(single.variance(), repeated.variance(), 1e-12);
+		}
+
+		TEST_METHOD(MergeMatchesSingleSet)
+		{
+			Profiler::Analyzer::sample_stats merged = make_stats({ 1.0, 2.0, 3.0 });
+			merged.merge(make_stats({ 4.0, 5.0 }));
+
+			Assert::AreEqual(5ull, merged.count());
+			Assert::AreEqual(3.0, merged.mean(), 1e-12);
+			Assert::AreEqual(2.5, merged.variance(), 1e-12);
+			Assert::AreEqual(1.0, merged.min());
+			Assert::AreEqual(5.0, merged.max());
+
+			// Into an empty set
+			Profiler::Analyzer::sample_stats empty;
+			empty.merge(merged);
+			Assert::AreEqual(5ull, empty.count());
+			Assert::AreEqual(3.0, empty.mean(), 1e-12);
+			Assert::AreEqual(2.5, empty.variance(), 1e-12);
+			Assert::AreEqual(1.0, empty.min());
+		}
+
+		TEST_METHOD(StudentTTwoSided)
+		{
+			Assert::AreEqual(1.0, Profiler::Analyzer::student_t_two_sided(0.0, 10.0), 1e-9);
+			Assert::AreEqual(0.5, Profiler::Analyzer::student_t_two_sided(1.0, 1.0), 1e-9);			// Cauchy
+			Assert::AreEqual(0.1835034190722739, Profiler::Analyzer::student_t_two_sided(2.0, 2.0), 1e-9);	// 1 - 2 / sqrt(6)
+			Assert::AreEqual(0.0733880347707455, Profiler::Analyzer::student_t_two_sided(2.0, 10.0), 1e-9);
+			Assert::AreEqual(0.0733880347707455, Profiler::Analyzer::student_t_two_sided(-2.0, 10.0), 1e-9);
+			Assert::AreEqual(0.05, Profiler::Analyzer::student_t_two_sided(2.228138851986274, 10.0), 1e-9);
+		}
+
+		TEST_METHOD(WelchTest)
+		{
+			Profiler::Analyzer::welch_result result = Profiler::Analyzer::welch_test(make_stats({ 1.0, 2.0, 3.0, 4.0, 5.0 }), make_stats({ 2.0, 4.0, 6.0, 8.0, 10.0 }));
+			Assert::AreEqual(1.8973665961010275, result.m_t, 1e-9);
+			Assert::AreEqual(5.882352941176471, result.m_degreesOfFreedom, 1e-9);
+			Assert::AreEqual(0.1075311949306332, result.m_pValue, 1e-6);
+
+			// Not enough samples to tell
+			Profiler::Analyzer::welch_result single = Profiler::Analyzer::welch_test(make_stats({ 1.0 }), make_stats({ 2.0 }));
+			Assert::AreEqual(1.0, single.m_pValue);
+		}
+	};
+
+	// Events encoded by the RecordEncoder of the Profiler and decoded by the capture reader of the ProfilerAnalyzer
+	TEST_CLASS(CaptureRoundTrip)
+	{
+		static Profiler::ProfilingMgr::event make_event(Profiler::ProfilingMgr::event_type type, unsigned long long time, unsigned scope = 0)
+		{
+			Profiler::ProfilingMgr::event e;
+			e.m_time = time;
+			e.m_scope = scope;
+			e.m_type = type;
+			return e;
+		}
+
+		TEST_METHOD(BoundaryValues)
+		{
+			using Profiler::ProfilingMgr;
+			using Profiler::Formatters::RecordEncoder;
+
+			static Profiler::scope_descriptor outerScope("RoundTrip outer", __FILE__, __LINE__);
+			static Profiler::scope_descriptor innerScope("RoundTrip inner", __FILE__, __LINE__);
+			static Profiler::channel_descriptor gauge("RoundTrip gauge", Profiler::channel_kind::gauge);
+			ProfilingMgr& mgr = ProfilingMgr::get_instance();
+			unsigned outer = mgr.get_scope_index(outerScope);
+			unsigned inner = mgr.get_scope_index(innerScope);
+			unsigned channel = mgr.get_channel_index(gauge);
+
+			ProfilingMgr::thread_data thread(7);
+			thread.m_name = "RoundTrip thread";
+
+			// A delta of 2^61 ticks is written as a varint of 2^63, the largest the format holds
+			const unsigned long long longFrame = 1ull << 61;
+			const unsigned long long end = 2000 + longFrame;
+			std::vector<ProfilingMgr::event> events = {
+				make_event(ProfilingMgr::event_type::frame, 1000),
+				make_event(ProfilingMgr::event_type::enter, 1000, outer),					// Delta of 0
+				make_event(ProfilingMgr::event_type::enter, 900, inner),					// Negative delta, written as 0
+				make_event(ProfilingMgr::event_type::exit, 1400),
+				make_event(ProfilingMgr::event_type::exit, 1500),
+				make_event(ProfilingMgr::event_type::frame, 2000),
+				make_event(ProfilingMgr::event_type::channel, 1ull << 63, channel),		// LLONG_MIN
+				make_event(ProfilingMgr::event_type::enter, 2000, outer),
+				make_event(ProfilingMgr::event_type::exit, end),
+				make_event(ProfilingMgr::event_type::frame, end),
+				make_event(ProfilingMgr::event_type::channel, LLONG_MAX, channel),
+				make_event(ProfilingMgr::event_type::frame, end + 500),
+				make_event(ProfilingMgr::event_type::channel, ~0ull, channel),			// -1
+			};
+
+			// Header and footer of the CaptureFormatter, with a clock of 1 tick per nanosecond
+			std::vector<unsigned char> file;
+			double ticksPerSecond = 1e9;
+			unsigned long long frequencyBits;
+			std::memcpy(&frequencyBits, &ticksPerSecond, sizeof(frequencyBits));
+			RecordEncoder::write_bytes(file, "PRFC", 4);
+			for (unsigned i = 0; i < 4; ++i)
+				file.push_back(static_cast<unsigned char>(Profiler::Formatters::CaptureFormatter::VERSION >> (8 * i)));
+			for (unsigned i = 0; i < 8; ++i)
+				file.push_back(static_cast<unsigned char>(frequencyBits >> (8 * i)));
+
+			// Split in two records, the deltas carry over from one to the next
+			RecordEncoder encoder;
+			encoder.write_events(file, thread, events.data(), 6);
+			encoder.write_events(file, thread, events.data() + 6, static_cast<unsigned>(events.size() - 6));
+
+			unsigned long long indexOffset = file.size();
+			file.push_back('I');
+			RecordEncoder::write_varint(file, 0);
+			for (unsigned i = 0; i < 8; ++i)
+				file.push_back(static_cast<unsigned char>(indexOffset >> (8 * i)));
+			RecordEncoder::write_bytes(file, "PRFE", 4);
+
+			std::string path = (std::filesystem::temp_directory_path() / "UnitTest1_RoundTrip.prfc").string();
+			std::FILE* output = nullptr;
+#ifdef _MSC_VER
+			fopen_s(&output, path.c_str(), "wb");
+#else
+			output = std::fopen(path.c_str(), "wb");
+#endif
+			Assert::IsNotNull(output);
+			std::fwrite(file.data(), 1, file.size(), output);
+			std::fclose(output);
+
+			Profiler::Analyzer::run_stats stats;
+			Profiler::Analyzer::read_capture(path.c_str(), stats, Profiler::Analyzer::read_options());
+			std::remove(path.c_str());
+
+			// The frame started by the last event never ended
+			Assert::AreEqual(3ull, stats.m_frames);
+
+			const Profiler::Analyzer::sample_stats& frames = stats.m_scopes[Profiler::Analyzer::run_stats::FRAME_KEY];
+			Assert::AreEqual(500.0, frames.min());
+			Assert::AreEqual(static_cast<double>(longFrame), frames.max());
+
+			const Profiler::Analyzer::sample_stats& outerSpans = stats.m_scopes["RoundTrip thread/RoundTrip outer"];
+			Assert::AreEqual(3ull, outerSpans.count());
+			Assert::AreEqual(0.0, outerSpans.min());
+			Assert::AreEqual(static_cast<double>(longFrame), outerSpans.max());
+
+			// Entered at the time of the previous event
+			const Profiler::Analyzer::sample_stats& innerSpans = stats.m_scopes["RoundTrip thread/RoundTrip outer/RoundTrip inner"];
+			Assert::AreEqual(400.0, innerSpans.max());
+
+			const Profiler::Analyzer::sample_stats& values = stats.m_scopes[std::string(Profiler::Analyzer::run_stats::CHANNEL_PREFIX) + "RoundTrip gauge"];
+			Assert::AreEqual(3ull, values.count());
+			Assert::AreEqual(static_cast<double>(LLONG_MIN), values.min());
+			Assert::AreEqual(static_cast<double>(LLONG_MAX), values.max());
+		}
+	};
 }